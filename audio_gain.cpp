@@ -0,0 +1,255 @@
+#include <immintrin.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include "audio_gain.hpp"
+
+
+static inline int16_t get_gain_q15(float gain) {
+	// 1.0 itself is not representable in Q15; 32767 is within rounding of it
+	return (std::lround(std::max(0.0f, std::min(gain, 1.0f)) * 32767.0f));
+}
+
+static inline int16_t float_to_s16(float s) {
+	return (std::max(-32768L, std::min(std::lrint(s), 32767L)));
+}
+
+
+// each handles [i, count); also the tails of the vectorized kernels
+static void gain_s16_tail(const int16_t* src, int16_t* dst, size_t i, size_t count, int16_t gain) {
+	for (; i < count; i++) {
+		dst[i] = (int32_t(src[i]) * gain + (1 << 14)) >> 15;
+	}
+}
+
+static void gain_float_tail(const float* src, float* dst, size_t i, size_t count, float gain) {
+	for (; i < count; i++) {
+		dst[i] = src[i] * gain;
+	}
+}
+
+// gain already includes the 32768 scale; rounds to nearest like cvtps2dq
+static void gain_float_s16_tail(const float* src, int16_t* dst, size_t i, size_t count, float gain) {
+	for (; i < count; i++) {
+		dst[i] = float_to_s16(src[i] * gain);
+	}
+}
+
+// gain already includes the 1/32768 scale
+static void gain_s16_float_tail(const int16_t* src, float* dst, size_t i, size_t count, float gain) {
+	for (; i < count; i++) {
+		dst[i] = src[i] * gain;
+	}
+}
+
+
+static void gain_s16_scalar(const void* src, void* dst, size_t count, float gain) {
+	gain_s16_tail(reinterpret_cast<const int16_t*>(src), reinterpret_cast<int16_t*>(dst), 0, count, get_gain_q15(gain));
+}
+
+static void gain_float_scalar(const void* src, void* dst, size_t count, float gain) {
+	gain_float_tail(reinterpret_cast<const float*>(src), reinterpret_cast<float*>(dst), 0, count, gain);
+}
+
+static void gain_float_s16_scalar(const void* src, void* dst, size_t count, float gain) {
+	gain_float_s16_tail(reinterpret_cast<const float*>(src), reinterpret_cast<int16_t*>(dst), 0, count, gain * 32768.0f);
+}
+static void gain_s16_float_scalar(const void* src, void* dst, size_t count, float gain) {
+	gain_s16_float_tail(reinterpret_cast<const int16_t*>(src), reinterpret_cast<float*>(dst), 0, count, gain * (1.0f / 32768.0f));
+}
+
+
+// pmulhrsw is exactly the rounded Q15 product
+__attribute__((target("ssse3")))
+static void gain_s16_ssse3(const void* src, void* dst, size_t count, float gain) {
+	const int16_t* s = reinterpret_cast<const int16_t*>(src);
+	int16_t* d = reinterpret_cast<int16_t*>(dst);
+
+	const int16_t gain_q15 = get_gain_q15(gain);
+	const __m128i g = _mm_set1_epi16(gain_q15);
+
+	size_t i = 0;
+
+	for (; (i + 8) <= count; i += 8) {
+		const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&s[i]));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(&d[i]), _mm_mulhrs_epi16(v, g));
+	}
+
+	gain_s16_tail(s, d, i, count, gain_q15);
+}
+
+__attribute__((target("ssse3")))
+static void gain_float_ssse3(const void* src, void* dst, size_t count, float gain) {
+	const float* s = reinterpret_cast<const float*>(src);
+	float* d = reinterpret_cast<float*>(dst);
+
+	const __m128 g = _mm_set1_ps(gain);
+
+	size_t i = 0;
+
+	for (; (i + 4) <= count; i += 4) {
+		_mm_storeu_ps(&d[i], _mm_mul_ps(_mm_loadu_ps(&s[i]), g));
+	}
+
+	gain_float_tail(s, d, i, count, gain);
+}
+
+// packssdw saturates, so out-of-range floats clip instead of wrapping
+__attribute__((target("ssse3")))
+static void gain_float_s16_ssse3(const void* src, void* dst, size_t count, float gain) {
+	const float* s = reinterpret_cast<const float*>(src);
+	int16_t* d = reinterpret_cast<int16_t*>(dst);
+
+	const __m128 g = _mm_set1_ps(gain * 32768.0f);
+
+	size_t i = 0;
+
+	// in place works too: 8 samples are read before their 16 bytes are written
+	for (; (i + 8) <= count; i += 8) {
+		const __m128i lo = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(&s[i + 0]), g));
+		const __m128i hi = _mm_cvtps_epi32(_mm_mul_ps(_mm_loadu_ps(&s[i + 4]), g));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(&d[i]), _mm_packs_epi32(lo, hi));
+	}
+
+	gain_float_s16_tail(s, d, i, count, gain * 32768.0f);
+}
+
+__attribute__((target("ssse3")))
+static void gain_s16_float_ssse3(const void* src, void* dst, size_t count, float gain) {
+	const int16_t* s = reinterpret_cast<const int16_t*>(src);
+	float* d = reinterpret_cast<float*>(dst);
+
+	const __m128 g = _mm_set1_ps(gain * (1.0f / 32768.0f));
+
+	size_t i = 0;
+
+	for (; (i + 8) <= count; i += 8) {
+		const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&s[i]));
+
+		// sign-extend by unpacking each sample into the top half of a dword
+		const __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+		const __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+
+		_mm_storeu_ps(&d[i + 0], _mm_mul_ps(_mm_cvtepi32_ps(lo), g));
+		_mm_storeu_ps(&d[i + 4], _mm_mul_ps(_mm_cvtepi32_ps(hi), g));
+	}
+
+	gain_s16_float_tail(s, d, i, count, gain * (1.0f / 32768.0f));
+}
+
+
+__attribute__((target("avx2")))
+static void gain_s16_avx2(const void* src, void* dst, size_t count, float gain) {
+	const int16_t* s = reinterpret_cast<const int16_t*>(src);
+	int16_t* d = reinterpret_cast<int16_t*>(dst);
+
+	const int16_t gain_q15 = get_gain_q15(gain);
+	const __m256i g = _mm256_set1_epi16(gain_q15);
+
+	size_t i = 0;
+
+	for (; (i + 16) <= count; i += 16) {
+		const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&s[i]));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(&d[i]), _mm256_mulhrs_epi16(v, g));
+	}
+
+	gain_s16_tail(s, d, i, count, gain_q15);
+}
+
+__attribute__((target("avx2")))
+static void gain_float_avx2(const void* src, void* dst, size_t count, float gain) {
+	const float* s = reinterpret_cast<const float*>(src);
+	float* d = reinterpret_cast<float*>(dst);
+
+	const __m256 g = _mm256_set1_ps(gain);
+
+	size_t i = 0;
+
+	for (; (i + 8) <= count; i += 8) {
+		_mm256_storeu_ps(&d[i], _mm256_mul_ps(_mm256_loadu_ps(&s[i]), g));
+	}
+
+	gain_float_tail(s, d, i, count, gain);
+}
+
+__attribute__((target("avx2")))
+static void gain_float_s16_avx2(const void* src, void* dst, size_t count, float gain) {
+	const float* s = reinterpret_cast<const float*>(src);
+	int16_t* d = reinterpret_cast<int16_t*>(dst);
+
+	const __m256 g = _mm256_set1_ps(gain * 32768.0f);
+
+	size_t i = 0;
+
+	for (; (i + 16) <= count; i += 16) {
+		const __m256i lo = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(&s[i + 0]), g));
+		const __m256i hi = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(&s[i + 8]), g));
+
+		// vpackssdw packs within 128-bit lanes, put the quadwords back in order
+		const __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8);
+
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(&d[i]), packed);
+	}
+
+	gain_float_s16_tail(s, d, i, count, gain * 32768.0f);
+}
+
+__attribute__((target("avx2")))
+static void gain_s16_float_avx2(const void* src, void* dst, size_t count, float gain) {
+	const int16_t* s = reinterpret_cast<const int16_t*>(src);
+	float* d = reinterpret_cast<float*>(dst);
+
+	const __m256 g = _mm256_set1_ps(gain * (1.0f / 32768.0f));
+
+	size_t i = 0;
+
+	for (; (i + 8) <= count; i += 8) {
+		const __m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&s[i])));
+		_mm256_storeu_ps(&d[i], _mm256_mul_ps(_mm256_cvtepi32_ps(v), g));
+	}
+
+	gain_s16_float_tail(s, d, i, count, gain * (1.0f / 32768.0f));
+}
+
+
+
+audio_gain::audio_gain(float gain, int src_format, int dst_format) {
+	this->gain = gain;
+	this->src_format = src_format;
+	this->dst_format = dst_format;
+
+	// [s16 -> s16, float -> float, float -> s16, s16 -> float] per instruction set
+	static const audio_gain_kernel kernels[3][4] = {
+		{gain_s16_avx2,   gain_float_avx2,   gain_float_s16_avx2,   gain_s16_float_avx2  },
+		{gain_s16_ssse3,  gain_float_ssse3,  gain_float_s16_ssse3,  gain_s16_float_ssse3 },
+		{gain_s16_scalar, gain_float_scalar, gain_float_s16_scalar, gain_s16_float_scalar},
+	};
+	static const char* kernel_names[3] = {"avx2", "ssse3", "scalar"};
+
+	int isa = 2;
+	int conversion = 0;
+
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2")) {
+		isa = 0;
+	} else if (__builtin_cpu_supports("ssse3")) {
+		isa = 1;
+	}
+
+	if (src_format == AUDIO_SAMPLE_FLOAT)
+		conversion = (dst_format == AUDIO_SAMPLE_FLOAT)? 1: 2;
+	else
+		conversion = (dst_format == AUDIO_SAMPLE_FLOAT)? 3: 0;
+
+	kernel = kernels[isa][conversion];
+	kernel_name = kernel_names[isa];
+
+	const char* format_names[2] = {"s16", "float"};
+
+	printf("[%s] gain %.3f, %s -> %s, %s kernel\n", __func__, gain, format_names[src_format], format_names[dst_format], kernel_name);
+}
+
@@ -0,0 +1,46 @@
+#ifndef AUDIO_GAIN_HDR
+#define AUDIO_GAIN_HDR
+
+#include <cstddef>
+#include <cstdint>
+
+
+enum {
+	AUDIO_SAMPLE_S16   = 0,
+	AUDIO_SAMPLE_FLOAT = 1, // [-1, 1]
+};
+
+typedef void (*audio_gain_kernel)(const void* src, void* dst, size_t count, float gain);
+
+
+// scales interleaved samples by a fixed gain and converts them (once) to
+// the format the rest of the audio path runs in; src and dst may be the
+// same buffer unless converting s16 to float. s16 to s16 holds the gain
+// as Q15 in [0, 1], so that every kernel computes the same rounded
+// (s * gain + 2^14) >> 15
+class audio_gain {
+public:
+	audio_gain(float gain, int src_format, int dst_format);
+
+	static size_t get_sample_size(int format) { return ((format == AUDIO_SAMPLE_FLOAT)? sizeof(float): sizeof(int16_t)); }
+
+	void apply(const void* src, void* dst, size_t count) const { kernel(src, dst, count, gain); }
+
+	int get_src_format() const { return src_format; }
+	int get_dst_format() const { return dst_format; }
+
+	const char* get_kernel_name() const { return kernel_name; }
+
+private:
+	audio_gain_kernel kernel = nullptr;
+
+	const char* kernel_name = "";
+
+	float gain = 1.0f;
+
+	int src_format = AUDIO_SAMPLE_S16;
+	int dst_format = AUDIO_SAMPLE_S16;
+};
+
+#endif
+
@@ -0,0 +1,251 @@
+#include <immintrin.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "audio_mix.hpp"
+#include "audio_gain.hpp"
+#include "audio_sync.hpp"
+#include "rec_config.hpp"
+
+// how far a source may lag the others before it is mixed as silence
+#define MIX_MAX_WAIT 0.25
+
+static const char* audio_sources_env_var = "SNAPSHOT_AUDIO_SOURCES";
+static const char* audio_tracks_env_var = "SNAPSHOT_AUDIO_TRACKS";
+
+
+// each handles [i, count); s16 sums saturate like paddsw
+static void mix_s16_tail(const int16_t* src, int16_t* dst, size_t i, size_t count) {
+	for (; i < count; i++) {
+		dst[i] = std::max(-32768, std::min(dst[i] + src[i], 32767));
+	}
+}
+
+static void mix_float_tail(const float* src, float* dst, size_t i, size_t count) {
+	for (; i < count; i++) {
+		dst[i] += src[i];
+	}
+}
+
+
+static void mix_s16_scalar(const void* src, void* dst, size_t count) {
+	mix_s16_tail(reinterpret_cast<const int16_t*>(src), reinterpret_cast<int16_t*>(dst), 0, count);
+}
+
+static void mix_float_scalar(const void* src, void* dst, size_t count) {
+	mix_float_tail(reinterpret_cast<const float*>(src), reinterpret_cast<float*>(dst), 0, count);
+}
+
+
+__attribute__((target("sse2")))
+static void mix_s16_sse2(const void* src, void* dst, size_t count) {
+	const int16_t* s = reinterpret_cast<const int16_t*>(src);
+	int16_t* d = reinterpret_cast<int16_t*>(dst);
+
+	size_t i = 0;
+
+	for (; (i + 8) <= count; i += 8) {
+		const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&s[i]));
+		const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&d[i]));
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(&d[i]), _mm_adds_epi16(a, b));
+	}
+
+	mix_s16_tail(s, d, i, count);
+}
+
+__attribute__((target("sse2")))
+static void mix_float_sse2(const void* src, void* dst, size_t count) {
+	const float* s = reinterpret_cast<const float*>(src);
+	float* d = reinterpret_cast<float*>(dst);
+
+	size_t i = 0;
+
+	for (; (i + 4) <= count; i += 4) {
+		_mm_storeu_ps(&d[i], _mm_add_ps(_mm_loadu_ps(&s[i]), _mm_loadu_ps(&d[i])));
+	}
+
+	mix_float_tail(s, d, i, count);
+}
+
+
+__attribute__((target("avx2")))
+static void mix_s16_avx2(const void* src, void* dst, size_t count) {
+	const int16_t* s = reinterpret_cast<const int16_t*>(src);
+	int16_t* d = reinterpret_cast<int16_t*>(dst);
+
+	size_t i = 0;
+
+	for (; (i + 16) <= count; i += 16) {
+		const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&s[i]));
+		const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&d[i]));
+
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(&d[i]), _mm256_adds_epi16(a, b));
+	}
+
+	mix_s16_tail(s, d, i, count);
+}
+
+__attribute__((target("avx2")))
+static void mix_float_avx2(const void* src, void* dst, size_t count) {
+	const float* s = reinterpret_cast<const float*>(src);
+	float* d = reinterpret_cast<float*>(dst);
+
+	size_t i = 0;
+
+	for (; (i + 8) <= count; i += 8) {
+		_mm256_storeu_ps(&d[i], _mm256_add_ps(_mm256_loadu_ps(&s[i]), _mm256_loadu_ps(&d[i])));
+	}
+
+	mix_float_tail(s, d, i, count);
+}
+
+
+
+std::vector<audio_source_params> audio_source_params::from_config() {
+	std::vector<audio_source_params> sources;
+
+	const char* sources_env = get_config_value(audio_sources_env_var);
+	const std::string list = (sources_env != nullptr)? sources_env: "";
+
+	size_t pos = 0;
+
+	while (pos < list.size()) {
+		const size_t end = std::min(list.find(',', pos), list.size());
+		const std::string entry = list.substr(pos, end - pos);
+		const size_t sep = entry.find('=');
+
+		pos = end + 1;
+
+		audio_source_params params;
+		params.name = entry.substr(0, sep);
+
+		if (sep != std::string::npos)
+			params.gain = std::max(float(atof(entry.c_str() + sep + 1)), 0.0f);
+
+		if (!params.name.empty())
+			sources.push_back(params);
+	}
+
+	if (sources.empty())
+		sources.push_back(audio_source_params());
+
+	return sources;
+}
+
+
+
+audio_mixer::audio_mixer(int sample_rate, int channels, int sample_format, size_t frame_samples) {
+	this->frame_samples = frame_samples;
+	this->frame_size = audio_gain::get_sample_size(sample_format) * channels;
+	this->num_channels = channels;
+	this->max_wait = int64_t(MIX_MAX_WAIT * sample_rate);
+
+	mix_buffer.resize(frame_samples * frame_size);
+
+	// [s16, float] per instruction set
+	static const audio_mix_kernel kernels[3][2] = {
+		{mix_s16_avx2,   mix_float_avx2  },
+		{mix_s16_sse2,   mix_float_sse2  },
+		{mix_s16_scalar, mix_float_scalar},
+	};
+	static const char* kernel_names[3] = {"avx2", "sse2", "scalar"};
+
+	int isa = 2;
+
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2")) {
+		isa = 0;
+	} else if (__builtin_cpu_supports("sse2")) {
+		isa = 1;
+	}
+
+	kernel = kernels[isa][(sample_format == AUDIO_SAMPLE_FLOAT)? 1: 0];
+	kernel_name = kernel_names[isa];
+}
+
+
+bool audio_mixer::get_config_separate_tracks() {
+	const char* tracks = get_config_value(audio_tracks_env_var);
+
+	if (tracks == nullptr || strlen(tracks) == 0 || strcmp(tracks, "mix") == 0)
+		return false;
+	if (strcmp(tracks, "separate") == 0)
+		return true;
+
+	printf("[%s] unknown track mode \"%s\", mixing\n", __func__, tracks);
+	return false;
+}
+
+
+const void* audio_mixer::mix_frame(int64_t* pts, bool flush) {
+	int64_t max_end_pts = 0;
+	int64_t min_next_pts = 0;
+
+	bool any_anchored = false;
+
+	for (const audio_sync* s: sources) {
+		if (!s->is_anchored())
+			continue;
+
+		max_end_pts = any_anchored? std::max(max_end_pts, s->get_end_pts()): s->get_end_pts();
+		min_next_pts = any_anchored? std::min(min_next_pts, s->get_next_pts()): s->get_next_pts();
+		any_anchored = true;
+	}
+
+	if (!any_anchored)
+		return nullptr;
+
+	// output starts with the earliest source; sources that start later come in at their pts
+	if (!started) {
+		next_pts = min_next_pts;
+		started = true;
+	}
+
+	const int64_t frame_end_pts = next_pts + frame_samples;
+
+	if (flush) {
+		if (max_end_pts <= next_pts)
+			return nullptr;
+	} else {
+		for (const audio_sync* s: sources) {
+			// wait for sources that are merely behind, not for stalled ones
+			if (s->is_anchored() && s->get_end_pts() < frame_end_pts && (max_end_pts - s->get_end_pts()) < max_wait)
+				return nullptr;
+		}
+
+		if (max_end_pts < frame_end_pts)
+			return nullptr;
+	}
+
+	memset(mix_buffer.data(), 0, mix_buffer.size());
+
+	for (audio_sync* s: sources) {
+		if (!s->is_anchored())
+			continue;
+
+		// too late to be mixed in (a stalled source that came back)
+		if (s->get_next_pts() < next_pts)
+			s->pop_frame(next_pts - s->get_next_pts());
+
+		// nothing buffered for this frame
+		if (s->get_next_pts() < next_pts || s->get_next_pts() >= frame_end_pts)
+			continue;
+
+		const size_t offset = s->get_next_pts() - next_pts;
+		const size_t num_samples = std::min(size_t(s->get_end_pts() - s->get_next_pts()), frame_samples - offset);
+
+		kernel(s->get_samples(), &mix_buffer[offset * frame_size], num_samples * num_channels);
+		s->pop_frame(num_samples);
+	}
+
+	*pts = next_pts;
+	next_pts = frame_end_pts;
+
+	return mix_buffer.data();
+}
+
@@ -0,0 +1,73 @@
+#ifndef AUDIO_MIX_HDR
+#define AUDIO_MIX_HDR
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class audio_sync;
+
+typedef void (*audio_mix_kernel)(const void* src, void* dst, size_t count);
+
+
+struct audio_source_params {
+public:
+	// reads SNAPSHOT_AUDIO_SOURCES, a comma-separated list of PulseAudio
+	// source names, "monitor" (the default sink's monitor) or "mic" (the
+	// default source), each optionally followed by "=gain"; defaults to
+	// "monitor=0.8". gains above 1 are clamped if the audio path is s16
+	static std::vector<audio_source_params> from_config();
+
+public:
+	std::string name = "monitor";
+
+	float gain = 0.8f;
+};
+
+
+// sums the drift-corrected streams of several sources into one: output
+// frames are laid out on the common sample clock (pts since the epoch)
+// and every source is added in at its own pts, so sources that started
+// late or lost blocks stay aligned. a frame is only mixed once all live
+// sources cover it; a source more than MIX_MAX_WAIT behind the others
+// (suspended sink, unplugged microphone) is taken as silent meanwhile
+class audio_mixer {
+public:
+	audio_mixer(int sample_rate, int channels, int sample_format, size_t frame_samples);
+
+	// reads SNAPSHOT_AUDIO_TRACKS, "mix" (default) or "separate"
+	static bool get_config_separate_tracks();
+
+	// consumes from <clock>, which has to outlive the mixer
+	void add_source(audio_sync* clock) { sources.push_back(clock); }
+
+	// returns the next mixed frame and its pts, or nullptr if it is not
+	// complete yet; with <flush> set the remainder is mixed (and padded
+	// with silence) regardless
+	const void* mix_frame(int64_t* pts, bool flush);
+
+	const char* get_kernel_name() const { return kernel_name; }
+
+private:
+	std::vector<audio_sync*> sources;
+	std::vector<char> mix_buffer;
+
+	audio_mix_kernel kernel = nullptr;
+
+	const char* kernel_name = "";
+
+	size_t frame_samples = 0;
+	// bytes per sample of all channels
+	size_t frame_size = 0;
+
+	int64_t next_pts = 0;
+	int64_t max_wait = 0;
+
+	int num_channels = 0;
+
+	bool started = false;
+};
+
+#endif
+
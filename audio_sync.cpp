@@ -0,0 +1,144 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+#include "audio_sync.hpp"
+
+
+// smoothing factor of the offset average; blocks arrive every ~20ms
+#define SYNC_AVG_WEIGHT 0.02
+// offsets the smoothed average has to exceed before samples are touched
+#define SYNC_THRESHOLD 0.005
+// offsets this large are lost blocks, not drift; timestamps jump instead
+#define SYNC_RESYNC_THRESHOLD 0.1
+// at most one sample dropped or duplicated per this many (0.1%)
+#define SYNC_CORRECTION_INTERVAL 1000
+
+
+audio_sync::audio_sync(int sample_rate, int channels, size_t sample_size, double epoch) {
+	this->sample_rate = sample_rate;
+	this->frame_size = sample_size * channels;
+	this->clock_epoch = epoch;
+}
+
+
+void audio_sync::push_block(const void* block, size_t num_samples, double time) {
+	const char* samples = reinterpret_cast<const char*>(block);
+
+	// where the capture clock puts this block
+	double clock_pos = (time - clock_epoch) * sample_rate;
+
+	if (!anchored) {
+		// leave out what was captured before the epoch, timestamps start at zero
+		const size_t num_early = std::min(size_t(std::max(std::ceil(-clock_pos), 0.0)), num_samples);
+
+		samples += num_early * frame_size;
+		num_samples -= num_early;
+
+		if (num_samples == 0)
+			return;
+
+		clock_pos += num_early;
+		next_pts = std::llround(clock_pos);
+		anchored = true;
+	}
+
+	// and where the sample count does
+	const double offset = clock_pos - (next_pts + get_num_buffered());
+
+	if (std::fabs(offset) > (SYNC_RESYNC_THRESHOLD * sample_rate)) {
+		printf("[%s] audio is %.1fms off the capture clock, resyncing\n", __func__, offset * 1000.0 / sample_rate);
+
+		if (offset > 0.0) {
+			// a gap; also moves the (at most one frame of) samples still buffered
+			next_pts += std::llround(offset);
+		} else {
+			// the stream already ran past this block's time; pts never go
+			// back (encoded frames would overlap), so the overlapping samples
+			// are left out instead: the unencoded tail of the buffer first,
+			// then the front of this block
+			size_t num_late = size_t(std::llround(-offset));
+
+			const size_t num_tail = std::min(num_late, get_num_buffered());
+
+			fifo.resize(fifo.size() - num_tail * frame_size);
+			num_late -= num_tail;
+
+			const size_t num_front = std::min(num_late, num_samples);
+
+			samples += num_front * frame_size;
+			num_samples -= num_front;
+			num_dropped += (num_tail + num_front);
+
+			if (num_samples == 0)
+				return;
+		}
+
+		avg_offset = 0.0;
+		num_resyncs += 1;
+	} else {
+		avg_offset += ((offset - avg_offset) * SYNC_AVG_WEIGHT);
+		max_offset = std::max(max_offset, std::fabs(offset));
+	}
+
+	// spread the corrections evenly over the block
+	const size_t num_corrections = std::max(num_samples / SYNC_CORRECTION_INTERVAL, size_t(1));
+	const size_t step = num_samples / num_corrections;
+
+	int correction = 0;
+
+	if (avg_offset > (SYNC_THRESHOLD * sample_rate))
+		correction = 1;
+	if (avg_offset < (-SYNC_THRESHOLD * sample_rate))
+		correction = -1;
+
+	// reclaim the consumed front before growing
+	if (fifo_head > 0 && fifo_head >= (fifo.size() / 2)) {
+		fifo.erase(fifo.begin(), fifo.begin() + fifo_head);
+		fifo_head = 0;
+	}
+
+	for (size_t i = 0; i < num_samples; i++) {
+		const char* s = &samples[i * frame_size];
+
+		if (correction != 0 && (i % step) == (step - 1)) {
+			if (correction < 0) {
+				// audio runs ahead of the clock, leave this sample out
+				num_dropped += 1;
+				continue;
+			}
+
+			// audio lags the clock, play this sample twice
+			fifo.insert(fifo.end(), s, s + frame_size);
+			num_duplicated += 1;
+		}
+
+		fifo.insert(fifo.end(), s, s + frame_size);
+	}
+}
+
+
+const void* audio_sync::front_frame(size_t num_samples, int64_t* pts) const {
+	if (get_num_buffered() < num_samples)
+		return nullptr;
+
+	*pts = next_pts;
+	return &fifo[fifo_head];
+}
+
+void audio_sync::pop_frame(size_t num_samples) {
+	num_samples = std::min(num_samples, get_num_buffered());
+
+	fifo_head += num_samples * frame_size;
+	next_pts += num_samples;
+}
+
+void audio_sync::pad_frame(size_t num_samples) {
+	const size_t num_buffered = get_num_buffered();
+
+	if (num_buffered == 0 || num_buffered >= num_samples)
+		return;
+
+	fifo.resize(fifo.size() + (num_samples - num_buffered) * frame_size, 0);
+}
+
@@ -0,0 +1,77 @@
+#ifndef AUDIO_SYNC_HDR
+#define AUDIO_SYNC_HDR
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+// places captured audio on the shared capture clock: every block comes
+// with the (monotonic) time its first sample was captured, which is
+// compared with the position the sample count alone would give it. the
+// smoothed difference is the A/V offset; small offsets (clock drift) are
+// worked off by dropping or duplicating single samples, large ones (lost
+// blocks, stalled devices) by re-anchoring the timestamps. corrected
+// samples are buffered and taken out again in encoder-sized frames.
+// samples are handled as opaque <sample_size>-byte values, so any packed
+// format works (silence has to be all-zero bytes)
+class audio_sync {
+public:
+	audio_sync(int sample_rate, int channels, size_t sample_size, double epoch);
+
+	// <time> is the capture time of the block's first sample
+	void push_block(const void* samples, size_t num_samples, double time);
+
+	// returns the next <num_samples> samples and their pts (in samples since
+	// the epoch), or nullptr if fewer are buffered; pop_frame consumes them
+	const void* front_frame(size_t num_samples, int64_t* pts) const;
+	void pop_frame(size_t num_samples);
+	// fills the buffered remainder up to <num_samples> with silence
+	void pad_frame(size_t num_samples);
+
+	// pts of the first buffered sample and one past the last, valid once
+	// the first block was placed; get_samples points at the former
+	int64_t get_next_pts() const { return next_pts; }
+	int64_t get_end_pts() const { return (next_pts + get_num_buffered()); }
+	const void* get_samples() const { return (fifo.data() + fifo_head); }
+
+	bool is_anchored() const { return anchored; }
+
+	// smoothed and largest absolute offset, in seconds; positive means
+	// audio is behind the capture clock
+	double get_offset() const { return (avg_offset / sample_rate); }
+	double get_max_offset() const { return (max_offset / sample_rate); }
+
+	uint64_t get_num_dropped() const { return num_dropped; }
+	uint64_t get_num_duplicated() const { return num_duplicated; }
+	uint64_t get_num_resyncs() const { return num_resyncs; }
+
+private:
+	size_t get_num_buffered() const { return ((fifo.size() - fifo_head) / frame_size); }
+
+private:
+	std::vector<char> fifo;
+
+	// in bytes; frame_size covers all channels of one sample
+	size_t fifo_head = 0;
+	size_t frame_size = 0;
+
+	// pts of the first buffered sample
+	int64_t next_pts = 0;
+
+	double clock_epoch = 0.0;
+	// in samples
+	double avg_offset = 0.0;
+	double max_offset = 0.0;
+
+	uint64_t num_dropped = 0;
+	uint64_t num_duplicated = 0;
+	uint64_t num_resyncs = 0;
+
+	int sample_rate = 0;
+
+	bool anchored = false;
+};
+
+#endif
+
@@ -0,0 +1,75 @@
+#include <sys/mman.h>
+
+#include <cstdio>
+#include <cstring>
+
+#include "buffer_pool.hpp"
+
+
+bool buffer_pool::init(size_t capacity) {
+	kill();
+
+	arena_size = (capacity + (HUGE_PAGE_SIZE - 1)) & ~(HUGE_PAGE_SIZE - 1);
+	arena_used = 0;
+
+	void* mem = MAP_FAILED;
+
+	#ifdef MAP_HUGETLB
+	// explicit huge pages, only succeeds if the admin reserved enough of them
+	mem = mmap(nullptr, arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+	huge_pages = (mem != MAP_FAILED);
+	#endif
+
+	if (mem == MAP_FAILED) {
+		if ((mem = mmap(nullptr, arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+			fprintf(stderr, "[%s] could not map %lu bytes\n", __func__, arena_size);
+
+			arena_size = 0;
+			return false;
+		}
+
+		#ifdef MADV_HUGEPAGE
+		// transparent huge pages; must be requested before the first touch
+		huge_pages = (madvise(mem, arena_size, MADV_HUGEPAGE) == 0);
+		#endif
+
+		// fault everything in now rather than on the first captured frames
+		memset(mem, 0, arena_size);
+	}
+
+	arena_base = reinterpret_cast<char*>(mem);
+
+	printf("[%s] reserved %lu bytes (huge pages: %d)\n", __func__, arena_size, huge_pages);
+	return true;
+}
+
+void buffer_pool::kill() {
+	if (arena_base == nullptr)
+		return;
+
+	munmap(arena_base, arena_size);
+
+	arena_base = nullptr;
+	arena_size = 0;
+	arena_used = 0;
+	huge_pages = false;
+}
+
+
+void* buffer_pool::alloc(size_t size) {
+	const size_t block_size = align_size(size);
+	const size_t block_offset = arena_used.fetch_add(block_size);
+
+	if ((block_offset + block_size) > arena_size) {
+		fprintf(stderr, "[%s] pool exhausted (%lu of %lu bytes used, %lu requested)\n", __func__, block_offset, arena_size, size);
+		return nullptr;
+	}
+
+	return (arena_base + block_offset);
+}
+
+
+void buffer_pool::release(size_t mark) {
+	if (mark < arena_used)
+		arena_used = mark;
+}
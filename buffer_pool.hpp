@@ -0,0 +1,50 @@
+#ifndef BUFFER_POOL_HDR
+#define BUFFER_POOL_HDR
+
+#include <atomic>
+#include <cstddef>
+
+
+// single arena per recorder from which every frame, picture and audio
+// block is carved; mapped (and faulted in) once up front so
+// the capture and encode paths never touch the allocator, and backed
+// by 2MB pages where the kernel lets us have them
+class buffer_pool {
+public:
+	static constexpr size_t BLOCK_ALIGN = 64;
+	static constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+	buffer_pool() = default;
+	buffer_pool(const buffer_pool&) = delete;
+	~buffer_pool() { kill(); }
+
+	buffer_pool& operator = (const buffer_pool&) = delete;
+
+	static size_t align_size(size_t size) { return ((size + (BLOCK_ALIGN - 1)) & ~(BLOCK_ALIGN - 1)); }
+
+	bool init(size_t capacity);
+	void kill();
+
+	// returns nullptr once the arena is exhausted; blocks are never freed individually
+	void* alloc(size_t size);
+	// rewinds the arena to <mark> (an earlier get_used()), freeing every
+	// block allocated since; none of them may still be in use
+	void release(size_t mark);
+
+	size_t get_capacity() const { return arena_size; }
+	size_t get_used() const { return arena_used; }
+
+	bool have_huge_pages() const { return huge_pages; }
+
+private:
+	char* arena_base = nullptr;
+
+	size_t arena_size = 0;
+
+	std::atomic<size_t> arena_used = {0};
+
+	bool huge_pages = false;
+};
+
+#endif
+
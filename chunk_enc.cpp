@@ -0,0 +1,350 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "chunk_enc.hpp"
+#include "buffer_pool.hpp"
+#include "packet_mux.hpp"
+#include "rec_config.hpp"
+
+static const char* chunk_encoders_env_var = "SNAPSHOT_CHUNK_ENCODERS";
+static const char* chunk_frames_env_var = "SNAPSHOT_CHUNK_FRAMES";
+static const char* chunk_memory_env_var = "SNAPSHOT_CHUNK_MEMORY";
+
+
+static void* worker_thread_proc(void* arg) {
+	chunk_worker* worker = reinterpret_cast<chunk_worker*>(arg);
+	worker->owner->worker_thread_func(worker);
+	return nullptr;
+}
+
+
+chunk_encoder::chunk_encoder(
+	buffer_pool* pool,
+	const video_encoder_params& params,
+	AVFormatContext* format_ctx,
+	packet_muxer* muxer,
+	int width,
+	int height,
+	int time_base,
+	int color_space,
+	int color_range
+) {
+	this->format_ctx = format_ctx;
+	this->muxer = muxer;
+	this->frame_width = width;
+	this->frame_height = height;
+	this->time_base = time_base;
+	this->color_space = color_space;
+	this->color_range = color_range;
+
+	chunk_frames = get_config_chunk_frames();
+
+	// every chunk is one closed GOP, parallelism comes from the chunks
+	enc_params = params;
+	enc_params.gop_size = chunk_frames;
+	enc_params.thread_count = 1;
+
+	workers.resize(get_num_workers(width, height));
+
+	if (int(workers.size()) < get_config_num_workers())
+		printf("[%s] chunk frames limited to %dMB, using %lu of %d encoders\n", __func__, get_config_memory(), workers.size(), get_config_num_workers());
+
+	for (size_t i = 0; i < workers.size() && !failed; i++) {
+		chunk_worker& worker = workers[i];
+
+		worker.owner = this;
+		worker.frames.resize(chunk_frames, nullptr);
+		worker.packets.reserve(chunk_frames);
+
+		for (AVFrame*& frame: worker.frames) {
+			uint8_t* buf = reinterpret_cast<uint8_t*>(pool->alloc(avpicture_get_size(PIX_FMT_YUV420P, width, height)));
+
+			if (buf == nullptr || (frame = avcodec_alloc_frame()) == nullptr) {
+				fprintf(stderr, "[%s] could not allocate chunk frames\n", __func__);
+				failed = true;
+				break;
+			}
+
+			avpicture_fill((AVPicture*) frame, buf, PIX_FMT_YUV420P, width, height);
+			frame->width = width;
+			frame->height = height;
+		}
+
+		if (!failed && (worker.codec_ctx = open_video_encoder(enc_params, format_ctx, width, height, time_base, color_space, color_range)) == nullptr) {
+			fprintf(stderr, "[%s] could not open chunk encoder\n", __func__);
+			failed = true;
+		}
+
+		if (failed) {
+			// the buffers go back with the session's pool, the workers
+			// started so far are stopped by the destructor
+			for (AVFrame* frame: worker.frames)
+				av_free(frame);
+
+			workers.resize(i);
+			break;
+		}
+
+		pthread_mutex_init(&worker.mutex, nullptr);
+		pthread_cond_init(&worker.cond, nullptr);
+		pthread_create(&worker.thread, nullptr, worker_thread_proc, &worker);
+	}
+
+	printf("[%s] %lu encoders, %u frames per chunk\n", __func__, workers.size(), chunk_frames);
+}
+
+chunk_encoder::~chunk_encoder() {
+	for (chunk_worker& worker: workers) {
+		pthread_mutex_lock(&worker.mutex);
+		keep_running = false;
+		pthread_cond_broadcast(&worker.cond);
+		pthread_mutex_unlock(&worker.mutex);
+	}
+
+	for (chunk_worker& worker: workers) {
+		pthread_join(worker.thread, nullptr);
+
+		for (AVPacket& p: worker.packets) {
+			av_free_packet(&p);
+		}
+		for (AVFrame* frame: worker.frames) {
+			av_free(frame);
+		}
+
+		if (worker.codec_ctx != nullptr) {
+			avcodec_close(worker.codec_ctx);
+			av_free(worker.codec_ctx);
+		}
+
+		pthread_cond_destroy(&worker.cond);
+		pthread_mutex_destroy(&worker.mutex);
+	}
+}
+
+
+int chunk_encoder::get_config_num_workers() {
+	return (std::max(get_config_int(chunk_encoders_env_var, 0), 0));
+}
+
+int chunk_encoder::get_config_chunk_frames() {
+	return (std::max(get_config_int(chunk_frames_env_var, 30), 1));
+}
+
+int chunk_encoder::get_config_memory() {
+	return (std::max(get_config_int(chunk_memory_env_var, 2048), 1));
+}
+
+size_t chunk_encoder::get_chunk_size(int width, int height) {
+	return (buffer_pool::align_size(avpicture_get_size(PIX_FMT_YUV420P, width, height)) * get_config_chunk_frames());
+}
+
+int chunk_encoder::get_num_workers(int width, int height) {
+	// every worker holds a whole chunk of frames, so the memory limit
+	// bounds the number of chunks in flight (but always allows one)
+	const size_t max_memory = size_t(get_config_memory()) * 1024 * 1024;
+	const size_t max_workers = std::max(max_memory / get_chunk_size(width, height), size_t(1));
+
+	return (int(std::min(size_t(get_config_num_workers()), max_workers)));
+}
+
+size_t chunk_encoder::get_pool_size(int width, int height) {
+	return (get_num_workers(width, height) * get_chunk_size(width, height));
+}
+
+
+
+AVFrame* chunk_encoder::next_frame() {
+	chunk_worker& worker = get_worker(fill_chunk);
+
+	if (fill_frames == 0) {
+		// flush whatever finished meanwhile, then wait out this worker's previous chunk
+		write_chunks(false);
+
+		pthread_mutex_lock(&worker.mutex);
+
+		while (worker.state == CHUNK_STATE_FILLING || worker.state == CHUNK_STATE_CLOSED)
+			pthread_cond_wait(&worker.cond, &worker.mutex);
+
+		pthread_mutex_unlock(&worker.mutex);
+
+		// all older chunks were written before their workers were reused
+		if (worker.state == CHUNK_STATE_ENCODED)
+			write_chunks(false);
+
+		if (worker.state == CHUNK_STATE_FAILED) {
+			fprintf(stderr, "[%s] chunk encoder lost, stopping at chunk %lu\n", __func__, fill_chunk);
+			failed = true;
+			return nullptr;
+		}
+	}
+
+	return worker.frames[fill_frames];
+}
+
+void chunk_encoder::submit_frame(AVFrame* frame) {
+	chunk_worker& worker = get_worker(fill_chunk);
+
+	// the first frame of every chunk must not reference the previous one
+	frame->pict_type = (fill_frames == 0)? AV_PICTURE_TYPE_I: AV_PICTURE_TYPE_NONE;
+	frame->key_frame = (fill_frames == 0);
+
+	pthread_mutex_lock(&worker.mutex);
+
+	if (fill_frames == 0) {
+		worker.chunk_index = fill_chunk;
+		worker.num_frames = 0;
+		worker.num_encoded = 0;
+		worker.state = CHUNK_STATE_FILLING;
+	}
+
+	worker.num_frames = ++fill_frames;
+
+	if (fill_frames == chunk_frames)
+		worker.state = CHUNK_STATE_CLOSED;
+
+	pthread_cond_broadcast(&worker.cond);
+	pthread_mutex_unlock(&worker.mutex);
+
+	if (fill_frames == chunk_frames) {
+		fill_chunk += 1;
+		fill_frames = 0;
+	}
+}
+
+void chunk_encoder::finish() {
+	if (fill_frames != 0) {
+		chunk_worker& worker = get_worker(fill_chunk);
+
+		pthread_mutex_lock(&worker.mutex);
+		worker.state = CHUNK_STATE_CLOSED;
+		pthread_cond_broadcast(&worker.cond);
+		pthread_mutex_unlock(&worker.mutex);
+
+		fill_chunk += 1;
+		fill_frames = 0;
+	}
+
+	write_chunks(true);
+}
+
+
+
+void chunk_encoder::write_chunk(chunk_worker& worker) {
+	for (AVPacket& p: worker.packets) {
+		muxer->write_packet(&p);
+	}
+
+	worker.packets.clear();
+
+	pthread_mutex_lock(&worker.mutex);
+	worker.state = worker.failed? CHUNK_STATE_FAILED: CHUNK_STATE_IDLE;
+	pthread_mutex_unlock(&worker.mutex);
+}
+
+void chunk_encoder::write_chunks(bool wait) {
+	while (write_chunk_index < fill_chunk) {
+		chunk_worker& worker = get_worker(write_chunk_index);
+
+		pthread_mutex_lock(&worker.mutex);
+
+		while (wait && worker.state != CHUNK_STATE_ENCODED)
+			pthread_cond_wait(&worker.cond, &worker.mutex);
+
+		const bool encoded = (worker.state == CHUNK_STATE_ENCODED);
+
+		pthread_mutex_unlock(&worker.mutex);
+
+		if (!encoded)
+			break;
+
+		write_chunk(worker);
+		write_chunk_index += 1;
+	}
+}
+
+
+
+void chunk_encoder::worker_thread_func(chunk_worker* worker) {
+	pthread_mutex_lock(&worker->mutex);
+
+	while (true) {
+		while (keep_running && worker->num_encoded == worker->num_frames && worker->state != CHUNK_STATE_CLOSED)
+			pthread_cond_wait(&worker->cond, &worker->mutex);
+
+		if (!keep_running)
+			break;
+
+		if (worker->num_encoded < worker->num_frames) {
+			AVFrame* frame = worker->frames[worker->num_encoded];
+
+			// frames are encoded as they arrive, not once the chunk is full
+			pthread_mutex_unlock(&worker->mutex);
+
+			AVPacket p;
+			av_init_packet(&p);
+			p.data = nullptr;
+			p.size = 0;
+
+			int encode_status = 0;
+
+			if (avcodec_encode_video2(worker->codec_ctx, &p, frame, &encode_status) >= 0 && encode_status != 0) {
+				if (p.pts == AV_NOPTS_VALUE)
+					p.pts = frame->pts;
+				if (p.dts == AV_NOPTS_VALUE)
+					p.dts = p.pts;
+
+				p.stream_index = 0;
+				worker->packets.push_back(p);
+			}
+
+			pthread_mutex_lock(&worker->mutex);
+			worker->num_encoded += 1;
+			continue;
+		}
+
+		// chunk closed and every frame went in; collect what the encoder held back
+		pthread_mutex_unlock(&worker->mutex);
+
+		if (worker->packets.size() < worker->num_frames) {
+			while (true) {
+				AVPacket p;
+				av_init_packet(&p);
+				p.data = nullptr;
+				p.size = 0;
+
+				int encode_status = 0;
+
+				if (avcodec_encode_video2(worker->codec_ctx, &p, nullptr, &encode_status) < 0 || encode_status == 0)
+					break;
+
+				if (p.dts == AV_NOPTS_VALUE)
+					p.dts = p.pts;
+
+				p.stream_index = 0;
+				worker->packets.push_back(p);
+			}
+
+			// a flushed encoder can not take further input
+			avcodec_close(worker->codec_ctx);
+			av_free(worker->codec_ctx);
+
+			worker->codec_ctx = open_video_encoder(enc_params, format_ctx, frame_width, frame_height, time_base, color_space, color_range);
+		}
+
+		pthread_mutex_lock(&worker->mutex);
+
+		// the chunk itself is complete, only the next one is lost
+		if (worker->codec_ctx == nullptr && !worker->failed) {
+			fprintf(stderr, "[%s] could not reopen chunk encoder\n", __func__);
+			worker->failed = true;
+		}
+
+		worker->state = CHUNK_STATE_ENCODED;
+		pthread_cond_broadcast(&worker->cond);
+	}
+
+	pthread_mutex_unlock(&worker->mutex);
+}
+
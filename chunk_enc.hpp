@@ -0,0 +1,134 @@
+#ifndef CHUNK_ENC_HDR
+#define CHUNK_ENC_HDR
+
+extern "C" {
+#include <avcodec.h>
+#include <avformat.h>
+}
+
+#include <pthread.h>
+
+#include <cstdint>
+#include <vector>
+
+#include "frame_enc.hpp"
+
+class buffer_pool;
+class chunk_encoder;
+class packet_muxer;
+
+
+enum {
+	CHUNK_STATE_IDLE     = 0, // free to take the next chunk
+	CHUNK_STATE_FILLING  = 1, // receiving (and encoding) frames
+	CHUNK_STATE_CLOSED   = 2, // all frames received, still encoding
+	CHUNK_STATE_ENCODED  = 3, // packets ready to be written
+	CHUNK_STATE_FAILED   = 4, // packets written, but the encoder is lost
+};
+
+
+// one encoder instance plus the frames of the chunk it is working on
+struct chunk_worker {
+	chunk_encoder* owner = nullptr;
+
+	AVCodecContext* codec_ctx = nullptr;
+
+	std::vector<AVFrame*> frames;
+	std::vector<AVPacket> packets;
+
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	uint64_t chunk_index = 0;
+
+	// written by the dispatcher, read by the worker (under mutex)
+	unsigned int num_frames = 0;
+	unsigned int num_encoded = 0;
+
+	int state = CHUNK_STATE_IDLE;
+	// the encoder could not be reopened after the chunk
+	bool failed = false;
+};
+
+
+// GOP-parallel video encoding: consecutive runs of <chunk_frames> frames
+// are handed round-robin to independent encoders, each chunk starting on
+// a keyframe and closing its GOP, and the resulting packets are written
+// to the muxer in chunk order by the (single) dispatching thread
+class chunk_encoder {
+public:
+	chunk_encoder(
+		buffer_pool* pool,
+		const video_encoder_params& params,
+		AVFormatContext* format_ctx,
+		packet_muxer* muxer,
+		int width,
+		int height,
+		int time_base,
+		int color_space,
+		int color_range
+	);
+	~chunk_encoder();
+
+	// reads SNAPSHOT_CHUNK_ENCODERS (0 or 1 disables chunked encoding) and SNAPSHOT_CHUNK_FRAMES
+	static int get_config_num_workers();
+	static int get_config_chunk_frames();
+	// reads SNAPSHOT_CHUNK_MEMORY, the limit (MB) for the frames of all chunks in flight
+	static int get_config_memory();
+	// configured encoders, reduced to what the memory limit holds chunks for
+	static int get_num_workers(int width, int height);
+	static size_t get_pool_size(int width, int height);
+
+	// returns the picture to convert the next frame into; blocks while
+	// the worker due for it is still busy with its previous chunk, and
+	// returns nullptr once that worker has lost its encoder
+	AVFrame* next_frame();
+	// hands the picture returned by next_frame to its worker
+	void submit_frame(AVFrame* frame);
+
+	// closes the partial last chunk and writes all outstanding packets
+	void finish();
+
+	void worker_thread_func(chunk_worker* worker);
+
+	const video_encoder_params& get_params() const { return enc_params; }
+	// an encoder could not be opened; finish still writes the chunks encoded before
+	bool has_failed() const { return failed; }
+
+private:
+	static size_t get_chunk_size(int width, int height);
+
+	chunk_worker& get_worker(uint64_t chunk) { return workers[chunk % workers.size()]; }
+
+	void write_chunk(chunk_worker& worker);
+	// writes chunks in order as long as they are ready, or waits for them all
+	void write_chunks(bool wait);
+
+private:
+	std::vector<chunk_worker> workers;
+
+	video_encoder_params enc_params;
+
+	AVFormatContext* format_ctx = nullptr;
+	packet_muxer* muxer = nullptr;
+
+	int frame_width = 0;
+	int frame_height = 0;
+	int time_base = 0;
+	int color_space = 0;
+	int color_range = 0;
+
+	// chunk currently being filled and oldest chunk not yet written
+	uint64_t fill_chunk = 0;
+	uint64_t write_chunk_index = 0;
+
+	unsigned int chunk_frames = 0;
+	unsigned int fill_frames = 0;
+
+	bool keep_running = true;
+	bool failed = false;
+};
+
+#endif
+
@@ -0,0 +1,544 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "frame_enc.hpp"
+#include "rec_config.hpp"
+
+static const char* codec_env_var = "SNAPSHOT_CODEC";
+static const char* preset_env_var = "SNAPSHOT_PRESET";
+static const char* tune_env_var = "SNAPSHOT_TUNE";
+static const char* gop_env_var = "SNAPSHOT_GOP";
+static const char* threads_env_var = "SNAPSHOT_THREADS";
+static const char* bitrate_env_var = "SNAPSHOT_BITRATE";
+static const char* budget_env_var = "SNAPSHOT_ENCODE_BUDGET";
+static const char* audio_codec_env_var = "SNAPSHOT_AUDIO_CODEC";
+static const char* audio_bitrate_env_var = "SNAPSHOT_AUDIO_BITRATE";
+
+
+typedef void (*configure_encoder_func)(AVCodecContext* ctx, AVDictionary** opts, const video_encoder_params& params);
+
+struct video_encoder_backend {
+	const char* name;
+	// libavcodec encoder name
+	const char* encoder;
+
+	int def_gop_size;
+	int def_bit_rate;
+	// speed levels configure can make cheaper than the last
+	int max_speed_level;
+
+	configure_encoder_func configure;
+};
+
+
+// x264's presets from slowest to fastest
+static const char* x264_presets[] = {
+	"placebo", "veryslow", "slower", "slow", "medium", "fast", "faster", "veryfast", "superfast", "ultrafast",
+};
+
+static const char* get_x264_preset(const std::string& preset, int speed_level) {
+	const int num_presets = sizeof(x264_presets) / sizeof(x264_presets[0]);
+
+	for (int i = 0; i < num_presets; i++) {
+		if (preset == x264_presets[i])
+			return x264_presets[std::min(i + speed_level, num_presets - 1)];
+	}
+
+	return preset.c_str();
+}
+
+
+static void configure_mpeg4(AVCodecContext* ctx, AVDictionary** /*opts*/, const video_encoder_params& params) {
+	// motion search and MB decision are at their cheapest already, faster
+	// levels only quantize coarser (fewer coefficients to code)
+	ctx->qmin = 2 + params.speed_level * 2;
+	ctx->qmax = 31;
+	ctx->b_sensitivity = 100;
+	ctx->me_method = 1;
+	ctx->mb_decision = FF_MB_DECISION_SIMPLE;
+	ctx->global_quality = 100;
+	ctx->lowres = 0;
+	ctx->bit_rate_tolerance = 200000;
+}
+
+static void configure_x264(AVCodecContext* ctx, AVDictionary** opts, const video_encoder_params& params) {
+	// level 1 raises crf, level 2 also takes the next faster preset; a
+	// preset may change the SPS/PPS, which reopen_video_encoder refuses
+	// with global headers, crf does not as long as x264 keeps them stitchable
+	const char* preset = get_x264_preset(params.preset.empty()? "ultrafast": params.preset, std::max(params.speed_level - 1, 0));
+
+	// no lookahead or B-frames with zerolatency, packets come out one per frame
+	av_dict_set(opts, "preset", preset, 0);
+	av_dict_set(opts, "tune", params.tune.empty()? "zerolatency": params.tune.c_str(), 0);
+	av_dict_set(opts, "x264opts", "stitchable=1", 0);
+
+	if (ctx->bit_rate == 0)
+		av_dict_set(opts, "crf", std::to_string(20 + params.speed_level * 4).c_str(), 0);
+}
+
+static void configure_intra(AVCodecContext* ctx, AVDictionary** /*opts*/, const video_encoder_params& /*params*/) {
+	// lossless intra-only codecs parallelize over slices, not frames
+	ctx->thread_type = FF_THREAD_SLICE;
+}
+
+static void configure_raw(AVCodecContext* ctx, AVDictionary** /*opts*/, const video_encoder_params& /*params*/) {
+	ctx->thread_count = 1;
+}
+
+
+static const video_encoder_backend video_backends[] = {
+	{"mpeg4",   "mpeg4",    12, 6000 * 1000, 2, configure_mpeg4},
+	{"x264",    "libx264",  60,           0, 2, configure_x264 },
+	{"ffv1",    "ffv1",      1,           0, 0, configure_intra},
+	{"utvideo", "utvideo",   1,           0, 0, configure_intra},
+	{"raw",     "rawvideo",  1,           0, 0, configure_raw  },
+};
+
+static const video_encoder_backend* find_backend(const std::string& name) {
+	for (const video_encoder_backend& backend: video_backends) {
+		if (name == backend.name || name == backend.encoder)
+			return &backend;
+	}
+
+	return nullptr;
+}
+
+
+video_encoder_params video_encoder_params::from_config() {
+	video_encoder_params params;
+
+	const char* codec = get_config_value(codec_env_var);
+	const char* preset = get_config_value(preset_env_var);
+	const char* tune = get_config_value(tune_env_var);
+
+	if (codec != nullptr && strlen(codec) != 0)
+		params.codec = codec;
+	if (preset != nullptr)
+		params.preset = preset;
+	if (tune != nullptr)
+		params.tune = tune;
+
+	params.gop_size = std::max(get_config_int(gop_env_var, params.gop_size), 0);
+	params.thread_count = std::max(get_config_int(threads_env_var, params.thread_count), 1);
+	params.bit_rate = std::max(get_config_int(bitrate_env_var, params.bit_rate), 0);
+	return params;
+}
+
+
+static AVCodecContext* open_backend(
+	const video_encoder_backend* backend,
+	const video_encoder_params& params,
+	const AVFormatContext* format_ctx,
+	int width,
+	int height,
+	int time_base,
+	int color_space,
+	int color_range
+) {
+	AVCodec* codec = avcodec_find_encoder_by_name(backend->encoder);
+	AVDictionary* opts = nullptr;
+
+	if (codec == nullptr) {
+		fprintf(stderr, "[%s] encoder \"%s\" is not available\n", __func__, backend->encoder);
+		return nullptr;
+	}
+
+	AVCodecContext* ctx = avcodec_alloc_context3(codec);
+
+	avcodec_get_context_defaults3(ctx, codec);
+
+	ctx->width = width;
+	ctx->height = height;
+	ctx->time_base.den = time_base;
+	ctx->time_base.num = 1;
+	ctx->pix_fmt = PIX_FMT_YUV420P;
+	ctx->colorspace = static_cast<AVColorSpace>(color_space);
+	ctx->color_range = static_cast<AVColorRange>(color_range);
+
+	ctx->gop_size = (params.gop_size > 0)? params.gop_size: backend->def_gop_size;
+	ctx->bit_rate = (params.bit_rate > 0)? params.bit_rate: backend->def_bit_rate;
+	ctx->thread_count = params.thread_count;
+
+	// a quarter less per speed level for rate-controlled encoders
+	ctx->bit_rate -= int(int64_t(ctx->bit_rate) * std::min(params.speed_level, backend->max_speed_level) / 4);
+
+	// mp4 and mkv want codec extradata in the container header
+	if ((format_ctx->oformat->flags & AVFMT_GLOBALHEADER) != 0)
+		ctx->flags |= CODEC_FLAG_GLOBAL_HEADER;
+
+	backend->configure(ctx, &opts, params);
+
+	if (avcodec_open2(ctx, codec, &opts) < 0) {
+		fprintf(stderr, "[%s] could not open encoder \"%s\"\n", __func__, backend->encoder);
+
+		av_dict_free(&opts);
+		avcodec_close(ctx);
+		av_free(ctx);
+		return nullptr;
+	}
+
+	av_dict_free(&opts);
+
+	printf("[%s] using encoder \"%s\" (gop %d, %d threads, %d bps, speed level %d)\n", __func__, backend->encoder, ctx->gop_size, ctx->thread_count, ctx->bit_rate, params.speed_level);
+	return ctx;
+}
+
+AVCodecContext* open_video_encoder(
+	const video_encoder_params& params,
+	const AVFormatContext* format_ctx,
+	int width,
+	int height,
+	int time_base,
+	int color_space,
+	int color_range
+) {
+	const video_encoder_backend* backend = find_backend(params.codec);
+	AVCodecContext* ctx = nullptr;
+
+	if (backend == nullptr) {
+		fprintf(stderr, "[%s] unknown codec \"%s\"\n", __func__, params.codec.c_str());
+	} else {
+		ctx = open_backend(backend, params, format_ctx, width, height, time_base, color_space, color_range);
+	}
+
+	if (ctx != nullptr || backend == &video_backends[0])
+		return ctx;
+
+	printf("[%s] falling back to \"%s\"\n", __func__, video_backends[0].encoder);
+
+	// the fallback gets its own defaults, not those meant for another backend
+	video_encoder_params def_params;
+	def_params.thread_count = params.thread_count;
+
+	return (open_backend(&video_backends[0], def_params, format_ctx, width, height, time_base, color_space, color_range));
+}
+
+int get_max_speed_level(const video_encoder_params& params) {
+	const video_encoder_backend* backend = find_backend(params.codec);
+
+	return ((backend != nullptr)? backend->max_speed_level: 0);
+}
+
+AVCodecContext* reopen_video_encoder(
+	const video_encoder_params& params,
+	const AVCodecContext* stream_ctx,
+	const AVFormatContext* format_ctx
+) {
+	const video_encoder_backend* backend = find_backend(params.codec);
+
+	// no fallback, another codec would not fit the stream
+	if (backend == nullptr)
+		return nullptr;
+
+	AVCodecContext* ctx = open_backend(
+		backend,
+		params,
+		format_ctx,
+		stream_ctx->width,
+		stream_ctx->height,
+		stream_ctx->time_base.den,
+		stream_ctx->colorspace,
+		stream_ctx->color_range
+	);
+
+	if (ctx == nullptr)
+		return nullptr;
+
+	// the container header was written from <stream_ctx>
+	bool same_stream = (ctx->codec_id == stream_ctx->codec_id);
+
+	same_stream = same_stream && (ctx->extradata_size == stream_ctx->extradata_size);
+	same_stream = same_stream && (ctx->extradata_size == 0 || memcmp(ctx->extradata, stream_ctx->extradata, ctx->extradata_size) == 0);
+
+	if (!same_stream) {
+		printf("[%s] speed level %d changes the stream headers, not using it\n", __func__, params.speed_level);
+
+		avcodec_close(ctx);
+		av_free(ctx);
+		return nullptr;
+	}
+
+	return ctx;
+}
+
+
+
+
+struct audio_encoder_backend {
+	const char* name;
+	// libavcodec encoder names, in order of preference
+	const char* encoders[2];
+
+	int def_bit_rate;
+};
+
+static const audio_encoder_backend audio_backends[] = {
+	{"mp2",  {"mp2",        nullptr}, 128 * 1000},
+	{"aac",  {"libfdk_aac", "aac"  }, 160 * 1000},
+	{"opus", {"libopus",    nullptr}, 128 * 1000},
+	{"flac", {"flac",       nullptr},          0},
+	{"pcm",  {"pcm_s16le",  nullptr},          0},
+};
+
+
+audio_encoder_params audio_encoder_params::from_config() {
+	audio_encoder_params params;
+
+	const char* codec = get_config_value(audio_codec_env_var);
+
+	if (codec != nullptr && strlen(codec) != 0)
+		params.codec = codec;
+
+	params.bit_rate = std::max(get_config_int(audio_bitrate_env_var, params.bit_rate), 0);
+	return params;
+}
+
+
+static bool have_sample_fmt(const AVCodec* codec, AVSampleFormat fmt) {
+	// encoders that do not list their formats take s16
+	if (codec->sample_fmts == nullptr)
+		return (fmt == AV_SAMPLE_FMT_S16);
+
+	for (const AVSampleFormat* f = codec->sample_fmts; *f != AV_SAMPLE_FMT_NONE; f++) {
+		if (*f == fmt)
+			return true;
+	}
+
+	return false;
+}
+
+static int select_sample_rate(const AVCodec* codec, int sample_rate) {
+	if (codec->supported_samplerates == nullptr)
+		return sample_rate;
+
+	int best_rate = 0;
+
+	// opus only runs at 48kHz and its integer fractions
+	for (const int* r = codec->supported_samplerates; *r != 0; r++) {
+		if (*r == sample_rate)
+			return sample_rate;
+		if (best_rate == 0 || std::abs(*r - sample_rate) < std::abs(best_rate - sample_rate))
+			best_rate = *r;
+	}
+
+	return best_rate;
+}
+
+static AVCodecContext* open_audio_backend(
+	const audio_encoder_backend* backend,
+	const audio_encoder_params& params,
+	const AVOutputFormat* format,
+	int sample_rate,
+	int channels,
+	AVSampleFormat input_fmt
+) {
+	AVCodec* codec = nullptr;
+
+	for (const char* encoder: backend->encoders) {
+		if (encoder != nullptr && (codec = avcodec_find_encoder_by_name(encoder)) != nullptr)
+			break;
+	}
+
+	if (codec == nullptr) {
+		fprintf(stderr, "[%s] no encoder for \"%s\" is available\n", __func__, backend->name);
+		return nullptr;
+	}
+
+	// the capture format as is, else the cheapest conversion from it
+	const AVSampleFormat s16_fmts[] = {AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_NONE};
+	const AVSampleFormat flt_fmts[] = {AV_SAMPLE_FMT_FLT, AV_SAMPLE_FMT_FLTP, AV_SAMPLE_FMT_S16, AV_SAMPLE_FMT_NONE};
+
+	AVSampleFormat sample_fmt = AV_SAMPLE_FMT_NONE;
+
+	for (const AVSampleFormat* f = (input_fmt == AV_SAMPLE_FMT_FLT)? flt_fmts: s16_fmts; *f != AV_SAMPLE_FMT_NONE; f++) {
+		if (have_sample_fmt(codec, *f)) {
+			sample_fmt = *f;
+			break;
+		}
+	}
+
+	if (sample_fmt == AV_SAMPLE_FMT_NONE) {
+		fprintf(stderr, "[%s] encoder \"%s\" takes no %s-compatible sample format\n", __func__, codec->name, av_get_sample_fmt_name(input_fmt));
+		return nullptr;
+	}
+
+	AVCodecContext* ctx = avcodec_alloc_context3(codec);
+
+	avcodec_get_context_defaults3(ctx, codec);
+
+	ctx->sample_fmt = sample_fmt;
+	ctx->sample_rate = select_sample_rate(codec, sample_rate);
+	ctx->channels = channels;
+	ctx->channel_layout = av_get_default_channel_layout(channels);
+	ctx->time_base.den = ctx->sample_rate;
+	ctx->time_base.num = 1;
+	ctx->bit_rate = (params.bit_rate > 0)? params.bit_rate: backend->def_bit_rate;
+
+	// the native aac encoder is still marked experimental
+	ctx->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+
+	if ((format->flags & AVFMT_GLOBALHEADER) != 0)
+		ctx->flags |= CODEC_FLAG_GLOBAL_HEADER;
+
+	if (avcodec_open2(ctx, codec, nullptr) < 0) {
+		fprintf(stderr, "[%s] could not open encoder \"%s\"\n", __func__, codec->name);
+
+		avcodec_close(ctx);
+		av_free(ctx);
+		return nullptr;
+	}
+
+	printf("[%s] using encoder \"%s\" (%dHz, %s, %d samples per frame, %d bps)\n", __func__, codec->name, ctx->sample_rate, av_get_sample_fmt_name(ctx->sample_fmt), ctx->frame_size, ctx->bit_rate);
+	return ctx;
+}
+
+AVCodecContext* open_audio_encoder(
+	const audio_encoder_params& params,
+	const AVOutputFormat* format,
+	int sample_rate,
+	int channels,
+	AVSampleFormat input_fmt
+) {
+	const audio_encoder_backend* backend = nullptr;
+	AVCodecContext* ctx = nullptr;
+
+	for (const audio_encoder_backend& b: audio_backends) {
+		if (params.codec == b.name)
+			backend = &b;
+	}
+
+	if (backend == nullptr) {
+		fprintf(stderr, "[%s] unknown audio codec \"%s\"\n", __func__, params.codec.c_str());
+	} else {
+		ctx = open_audio_backend(backend, params, format, sample_rate, channels, input_fmt);
+	}
+
+	if (ctx != nullptr || backend == &audio_backends[0])
+		return ctx;
+
+	printf("[%s] falling back to \"%s\"\n", __func__, audio_backends[0].name);
+	return (open_audio_backend(&audio_backends[0], audio_encoder_params(), format, sample_rate, channels, input_fmt));
+}
+
+
+
+
+// cheaper encoder settings first, dropping frames only once those are exhausted
+static const encoder_speed_level speed_ladder[] = {
+	{"full",       0, 1},
+	{"fast",       1, 1},
+	{"faster",     2, 1},
+	{"half-rate",  2, 2},
+	{"third-rate", 2, 3},
+};
+
+// frames to wait after a step before judging its effect
+#define GOVERNOR_HOLD_FRAMES 30
+// smoothing factor of the encode-time average
+#define GOVERNOR_AVG_WEIGHT 0.1
+// step back up only once well under budget
+#define GOVERNOR_STEP_UP_RATIO 0.6
+
+
+encode_governor::encode_governor(double budget_ms, int max_encoder_level) {
+	budget = budget_ms / 1000.0;
+
+	ladder = &speed_ladder[0];
+	ladder_size = sizeof(speed_ladder) / sizeof(speed_ladder[0]);
+	level = 0;
+
+	this->max_encoder_level = std::max(max_encoder_level, 0);
+
+	if (budget > 0.0)
+		printf("[%s] holding encode time under %.2fms, starting at level %d (%s)\n", __func__, budget_ms, level, ladder[level].name);
+}
+
+double encode_governor::get_config_budget() {
+	const char* budget_env = get_config_value(budget_env_var);
+
+	if (budget_env == nullptr || strlen(budget_env) == 0)
+		return (1000.0 / 60.0);
+
+	return (std::max(atof(budget_env), 0.0));
+}
+
+
+bool encode_governor::admit_frame() {
+	if (((level_frames++) % ladder[level].frame_stride) == 0)
+		return true;
+
+	num_skipped += 1;
+	return false;
+}
+
+void encode_governor::update(double frame_time) {
+	if (budget <= 0.0)
+		return;
+
+	if (avg_time == 0.0) {
+		avg_time = frame_time;
+	} else {
+		avg_time += ((frame_time - avg_time) * GOVERNOR_AVG_WEIGHT);
+	}
+
+	level_updates += 1;
+
+	// skipped frames free up time too, judge the per-frame average
+	const double eff_time = avg_time / ladder[level].frame_stride;
+
+	if (level_updates < GOVERNOR_HOLD_FRAMES)
+		return;
+
+	const int down_level = find_level(1);
+
+	if (eff_time > budget && down_level != level) {
+		printf("[%s] %.2fms > %.2fms, stepping down\n", __func__, eff_time * 1000.0, budget * 1000.0);
+		apply_level(down_level);
+		return;
+	}
+
+	const int up_level = find_level(-1);
+
+	if (up_level == level || level_updates < (GOVERNOR_HOLD_FRAMES * 4))
+		return;
+
+	// judged by the cost at the level stepped to, which skips fewer
+	// frames; a more expensive level must get longer to prove itself affordable
+	const double up_time = avg_time / ladder[up_level].frame_stride;
+
+	if (up_time < (budget * GOVERNOR_STEP_UP_RATIO)) {
+		printf("[%s] %.2fms < %.2fms, stepping up\n", __func__, up_time * 1000.0, budget * GOVERNOR_STEP_UP_RATIO * 1000.0);
+		apply_level(up_level);
+	}
+}
+
+void encode_governor::limit_encoder_level(int max_level) {
+	max_encoder_level = std::max(std::min(max_level, max_encoder_level), 0);
+
+	printf("[%s] encoder levels limited to %d\n", __func__, max_encoder_level);
+}
+
+
+int encode_governor::find_level(int step) const {
+	// rungs the encoder can not go along with are the same as the one before
+	for (int i = level + step; i >= 0 && i < ladder_size; i += step) {
+		if (std::min(ladder[i].encoder_level, max_encoder_level) != get_encoder_level() || ladder[i].frame_stride != ladder[level].frame_stride)
+			return i;
+	}
+
+	return level;
+}
+
+
+void encode_governor::apply_level(int new_level) {
+	const encoder_speed_level& l = ladder[new_level];
+
+	printf("[%s] level %d (%s) -> %d (%s) [encoder level=%d, stride=%d]\n", __func__, level, ladder[level].name, new_level, l.name, std::min(l.encoder_level, max_encoder_level), l.frame_stride);
+
+	level = new_level;
+	level_frames = 0;
+	level_updates = 0;
+}
+
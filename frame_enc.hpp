@@ -0,0 +1,158 @@
+#ifndef FRAME_ENC_HDR
+#define FRAME_ENC_HDR
+
+extern "C" {
+#include <avcodec.h>
+#include <avformat.h>
+}
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+
+
+// settings shared by every video backend; fields left at their
+// defaults are filled in per backend by open_video_encoder
+struct video_encoder_params {
+public:
+	// reads SNAPSHOT_CODEC, _PRESET, _TUNE, _GOP, _THREADS and _BITRATE
+	static video_encoder_params from_config();
+
+public:
+	// mpeg4, x264, ffv1, utvideo or raw
+	std::string codec = "mpeg4";
+	std::string preset;
+	std::string tune;
+
+	// frames between keyframes; 0 means backend default
+	int gop_size = 0;
+	int thread_count = 4;
+	// bits per second; 0 means backend default (constant quality for x264)
+	int bit_rate = 0;
+	// 0 for the configured settings; each level up trades quality for
+	// encode time (set by the encode governor, up to get_max_speed_level)
+	int speed_level = 0;
+};
+
+
+// allocates and opens the encoder selected by <params>, falling back to
+// mpeg4 if that backend is unavailable in the linked libavcodec; input
+// is always YUV420P with the given dimensions and time-base denominator
+AVCodecContext* open_video_encoder(
+	const video_encoder_params& params,
+	const AVFormatContext* format_ctx,
+	int width,
+	int height,
+	int time_base,
+	int color_space,
+	int color_range
+);
+
+// highest speed_level the backend of <params> has cheaper settings for
+int get_max_speed_level(const video_encoder_params& params);
+
+// opens the encoder of <params> for the stream <stream_ctx> was opened
+// for; nullptr if it can not be opened, or if its stream headers
+// (extradata) would differ from those already written for <stream_ctx>
+AVCodecContext* reopen_video_encoder(
+	const video_encoder_params& params,
+	const AVCodecContext* stream_ctx,
+	const AVFormatContext* format_ctx
+);
+
+
+
+struct audio_encoder_params {
+public:
+	// reads SNAPSHOT_AUDIO_CODEC and SNAPSHOT_AUDIO_BITRATE
+	static audio_encoder_params from_config();
+
+public:
+	// mp2, aac, opus, flac or pcm
+	std::string codec = "mp2";
+
+	// bits per second; 0 means backend default (ignored by lossless codecs)
+	int bit_rate = 0;
+};
+
+
+// allocates and opens the audio encoder selected by <params>, falling
+// back to mp2; input is <channels> channels at <sample_rate>, unless the
+// encoder does not support that rate, in which case the context holds
+// the nearest one it does and capture has to match it. the encoder takes
+// <input_fmt> (s16 or float) if it can, else planar float, else (float
+// input only) s16; ctx->sample_fmt tells which
+AVCodecContext* open_audio_encoder(
+	const audio_encoder_params& params,
+	const AVOutputFormat* format,
+	int sample_rate,
+	int channels,
+	AVSampleFormat input_fmt
+);
+
+
+
+// one rung of the speed ladder; encoders take their settings at open
+// time only, so a rung with another encoder level has the recorder
+// reopen its encoder (at a keyframe)
+struct encoder_speed_level {
+	const char* name;
+
+	// video_encoder_params::speed_level to encode at
+	int encoder_level;
+	// encode every n-th frame
+	int frame_stride;
+};
+
+
+// feedback controller that keeps the per-frame encode time under a
+// budget by stepping along a ladder of cheaper (higher index: cheaper
+// encoder settings first, fewer frames encoded last) or more expensive
+// levels; reacts to a smoothed average so single slow frames do not
+// cause a step
+class encode_governor {
+public:
+	// a budget of 0ms disables the governor; rungs beyond
+	// <max_encoder_level> keep the encoder at that level
+	encode_governor(double budget_ms, int max_encoder_level);
+
+	// reads SNAPSHOT_ENCODE_BUDGET (milliseconds, default one 60Hz frame)
+	static double get_config_budget();
+
+	// returns false if the current level skips this frame
+	bool admit_frame();
+	// feeds back the time (in seconds) spent converting and encoding a frame
+	void update(double frame_time);
+
+	int get_level() const { return level; }
+	// video_encoder_params::speed_level the current rung encodes at
+	int get_encoder_level() const { return std::min(ladder[level].encoder_level, max_encoder_level); }
+	uint64_t get_num_skipped() const { return num_skipped; }
+
+	// called when the encoder could not be reopened at get_encoder_level
+	void limit_encoder_level(int max_level);
+
+private:
+	// next rung in direction <step> that differs from the current one
+	int find_level(int step) const;
+	void apply_level(int new_level);
+
+private:
+	const encoder_speed_level* ladder = nullptr;
+
+	int ladder_size = 0;
+	int level = 0;
+	int max_encoder_level = 0;
+
+	// frames seen and encoded since the last step
+	int level_frames = 0;
+	int level_updates = 0;
+
+	double budget = 0.0;
+	double avg_time = 0.0;
+
+	uint64_t num_skipped = 0;
+};
+
+#endif
+
@@ -0,0 +1,197 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "frame_queue.hpp"
+#include "buffer_pool.hpp"
+
+
+frame_queue::frame_queue(buffer_pool* pool, size_t num_slots, size_t slot_size, int policy) {
+	this->slot_size = slot_size;
+	this->drop_policy = policy;
+
+	// one slot can be held by each side, at least one more must be queueable
+	slots.resize(get_num_slots(num_slots));
+	ready_ring.resize(slots.size());
+	free_ring.resize(slots.size());
+
+	pthread_mutex_init(&ready_mutex, nullptr);
+	pthread_cond_init(&ready_cond, nullptr);
+	pthread_mutex_init(&free_mutex, nullptr);
+	pthread_cond_init(&free_cond, nullptr);
+
+	for (size_t i = 0; i < slots.size(); i++) {
+		void* mem = pool->alloc(slot_size);
+
+		if (mem == nullptr) {
+			fprintf(stderr, "[%s] could not allocate frame slot %lu (%lu bytes)\n", __func__, i, slot_size);
+			exit(1);
+		}
+
+		slots[i].data = reinterpret_cast<char*>(mem);
+		slots[i].index = i;
+
+		free_ring.push(i);
+	}
+}
+
+frame_queue::~frame_queue() {
+	pthread_cond_destroy(&free_cond);
+	pthread_mutex_destroy(&free_mutex);
+	pthread_cond_destroy(&ready_cond);
+	pthread_mutex_destroy(&ready_mutex);
+}
+
+
+int frame_queue::parse_policy(const char* str) {
+	if (str == nullptr || strlen(str) == 0)
+		return FRAME_QUEUE_DROP_OLDEST;
+
+	if (strcmp(str, "drop-oldest") == 0)
+		return FRAME_QUEUE_DROP_OLDEST;
+	if (strcmp(str, "drop-newest") == 0)
+		return FRAME_QUEUE_DROP_NEWEST;
+	if (strcmp(str, "block") == 0)
+		return FRAME_QUEUE_BLOCK;
+
+	printf("[%s] unknown policy \"%s\", dropping oldest frames\n", __func__, str);
+	return FRAME_QUEUE_DROP_OLDEST;
+}
+
+
+
+frame_slot* frame_queue::acquire_slot() {
+	int idx = -1;
+
+	if (free_ring.pop(idx))
+		return &slots[idx];
+
+	switch (drop_policy) {
+		case FRAME_QUEUE_DROP_OLDEST: {
+			// the consumer may claim the same frame concurrently; whoever
+			// wins the CAS owns it, and if that was the consumer there is
+			// nothing left to evict and the incoming frame is dropped
+			if (ready_ring.pop(idx)) {
+				num_evicted += 1;
+				return &slots[idx];
+			}
+		} break;
+
+		case FRAME_QUEUE_DROP_NEWEST: {
+		} break;
+
+		case FRAME_QUEUE_BLOCK: {
+			pthread_mutex_lock(&free_mutex);
+			producer_waiting = true;
+
+			// recheck after publishing the flag, free_slot only signals if it sees it
+			while (free_ring.empty() && !producer_aborted)
+				pthread_cond_wait(&free_cond, &free_mutex);
+
+			producer_waiting = false;
+			pthread_mutex_unlock(&free_mutex);
+
+			// only the producer pops free slots
+			if (free_ring.pop(idx))
+				return &slots[idx];
+		} break;
+	}
+
+	num_dropped += 1;
+	return nullptr;
+}
+
+void frame_queue::commit_slot(frame_slot* slot) {
+	ready_ring.push(slot->index);
+	// pairs with the flag store in front_slot
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	if (!consumer_waiting)
+		return;
+
+	pthread_mutex_lock(&ready_mutex);
+	pthread_cond_signal(&ready_cond);
+	pthread_mutex_unlock(&ready_mutex);
+}
+
+void frame_queue::cancel_slot(frame_slot* slot) {
+	// slot goes back to the producer's end of the free ring; only
+	// the consumer pushes there, so requeue it as a ready frame of
+	// zero size which front_slot skips over
+	slot->size = 0;
+	ready_ring.push(slot->index);
+}
+
+
+
+frame_slot* frame_queue::front_slot(const std::atomic<bool>& wait) {
+	frame_slot* slot = nullptr;
+
+	while (true) {
+		if ((slot = poll_slot()) != nullptr)
+			return slot;
+
+		if (!wait)
+			return nullptr;
+
+		pthread_mutex_lock(&ready_mutex);
+		consumer_waiting = true;
+
+		// recheck after publishing the flag, commit_slot only signals if it sees it
+		while (ready_ring.empty() && wait)
+			pthread_cond_wait(&ready_cond, &ready_mutex);
+
+		consumer_waiting = false;
+		pthread_mutex_unlock(&ready_mutex);
+	}
+
+	return nullptr;
+}
+
+frame_slot* frame_queue::poll_slot() {
+	int idx = -1;
+
+	while (ready_ring.pop(idx)) {
+		if (slots[idx].size != 0)
+			return &slots[idx];
+
+		free_slot(idx);
+	}
+
+	return nullptr;
+}
+
+void frame_queue::release_slot(frame_slot* slot) {
+	free_slot(slot->index);
+}
+
+void frame_queue::free_slot(int idx) {
+	free_ring.push(idx);
+	// pairs with the flag store in acquire_slot
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	if (!producer_waiting)
+		return;
+
+	pthread_mutex_lock(&free_mutex);
+	pthread_cond_signal(&free_cond);
+	pthread_mutex_unlock(&free_mutex);
+}
+
+void frame_queue::wake_consumer() {
+	pthread_mutex_lock(&ready_mutex);
+	pthread_cond_broadcast(&ready_cond);
+	pthread_mutex_unlock(&ready_mutex);
+}
+
+void frame_queue::abort_producer() {
+	pthread_mutex_lock(&free_mutex);
+	producer_aborted = true;
+	pthread_cond_broadcast(&free_cond);
+	pthread_mutex_unlock(&free_mutex);
+}
+
+void frame_queue::resume_producer() {
+	producer_aborted = false;
+}
+
@@ -0,0 +1,140 @@
+#ifndef FRAME_QUEUE_HDR
+#define FRAME_QUEUE_HDR
+
+#include <pthread.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class buffer_pool;
+
+
+enum {
+	FRAME_QUEUE_DROP_OLDEST = 0, // evict the oldest queued frame to make room
+	FRAME_QUEUE_DROP_NEWEST = 1, // reject the incoming frame, queued frames are kept
+	FRAME_QUEUE_BLOCK       = 2, // wait for the consumer to free a slot, nothing is dropped
+};
+
+
+struct frame_slot {
+	char* data = nullptr;
+	size_t size = 0;
+
+	// capture (swap) time in seconds
+	double time = 0.0;
+
+	int width = 0;
+	int height = 0;
+	int index = -1;
+	// audio blocks: which capture source filled the slot
+	int source = 0;
+};
+
+
+// bounded queue of slot indices; elements are only ever popped through
+// a CAS on the tail so the producer can also evict the oldest entry
+struct frame_index_ring {
+public:
+	void resize(size_t n) { elems = std::vector< std::atomic<int> >(n); }
+
+	void push(int idx) {
+		const uint32_t h = head.load(std::memory_order_relaxed);
+
+		elems[h % elems.size()].store(idx, std::memory_order_relaxed);
+		head.store(h + 1, std::memory_order_release);
+	}
+
+	bool pop(int& idx) {
+		uint32_t t = tail.load(std::memory_order_acquire);
+
+		do {
+			if (t == head.load(std::memory_order_acquire))
+				return false;
+
+			idx = elems[t % elems.size()].load(std::memory_order_relaxed);
+		} while (!tail.compare_exchange_weak(t, t + 1, std::memory_order_acq_rel, std::memory_order_acquire));
+
+		return true;
+	}
+
+	bool empty() const { return (tail.load() == head.load()); }
+	size_t size() const { return (head.load() - tail.load()); }
+
+private:
+	std::vector< std::atomic<int> > elems;
+
+	std::atomic<uint32_t> head = {0};
+	std::atomic<uint32_t> tail = {0};
+};
+
+
+// single-producer (swap hook) single-consumer (encoder) queue of
+// preallocated frame slots; a slot is owned by exactly one side at
+// a time, the producer fills it in place and the consumer reads it
+// in place until release_slot
+class frame_queue {
+public:
+	// slot memory is carved from <pool> and lives as long as it does
+	frame_queue(buffer_pool* pool, size_t num_slots, size_t slot_size, int policy);
+	~frame_queue();
+
+	static int parse_policy(const char* str);
+	static size_t get_num_slots(size_t num_slots) { return std::max(num_slots, size_t(3)); }
+
+	// producer side; acquire returns nullptr if the frame must be dropped
+	// (when blocking only once aborted, else it waits for the consumer to
+	// release a slot)
+	frame_slot* acquire_slot();
+	void commit_slot(frame_slot* slot);
+	void cancel_slot(frame_slot* slot);
+
+	// consumer side; blocks while the queue is empty and <wait> is set
+	frame_slot* front_slot(const std::atomic<bool>& wait);
+	// same, but returns nullptr instead of blocking
+	frame_slot* poll_slot();
+	void release_slot(frame_slot* slot);
+
+	void wake_consumer();
+	// the consumer stopped (session end, encoder failure); a blocked or
+	// later acquire_slot drops its frame until resume_producer
+	void abort_producer();
+	void resume_producer();
+
+	size_t get_slot_size() const { return slot_size; }
+	size_t get_num_queued() const { return ready_ring.size(); }
+	uint64_t get_num_dropped() const { return num_dropped; }
+	uint64_t get_num_evicted() const { return num_evicted; }
+
+private:
+	// hands a slot back to the producer, waking it if it blocks on a full queue
+	void free_slot(int idx);
+
+private:
+	std::vector<frame_slot> slots;
+
+	frame_index_ring ready_ring;
+	frame_index_ring free_ring;
+
+	pthread_mutex_t ready_mutex;
+	pthread_cond_t ready_cond;
+	pthread_mutex_t free_mutex;
+	pthread_cond_t free_cond;
+
+	size_t slot_size = 0;
+
+	int drop_policy = FRAME_QUEUE_DROP_OLDEST;
+
+	// rejected incoming frames and evicted queued frames
+	std::atomic<uint64_t> num_dropped = {0};
+	std::atomic<uint64_t> num_evicted = {0};
+
+	std::atomic<bool> consumer_waiting = {false};
+	std::atomic<bool> producer_waiting = {false};
+	std::atomic<bool> producer_aborted = {false};
+};
+
+#endif
+
@@ -2,17 +2,23 @@
 #include <unistd.h>
 #include <sys/time.h>
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
 #include <string>
 
 #include "frame_rec.hpp"
+#include "game_clock.hpp"
+#include "rec_config.hpp"
 
-#ifndef AV_CODEC_ID_MPEG4
-#define AV_CODEC_ID_MPEG4 CODEC_ID_MPEG4
-#endif
 
 #define TIMEBASE 600.0
 
+static const char* queue_depth_env_var = "SNAPSHOT_QUEUE_DEPTH";
+static const char* queue_policy_env_var = "SNAPSHOT_QUEUE_POLICY";
+static const char* converter_env_var = "SNAPSHOT_CONVERTER";
+static const char* convert_threads_env_var = "SNAPSHOT_CONVERT_THREADS";
+
 
 extern double get_current_time();
 
@@ -24,14 +30,14 @@ static constexpr pa_sample_spec ss = {
 
 
 
-static AVFrame* alloc_picture(int pix_fmt, int width, int height) {
+static AVFrame* alloc_picture(buffer_pool* pool, int pix_fmt, int width, int height) {
 	AVFrame* video_frame = avcodec_alloc_frame();
 	uint8_t* picture_buf = nullptr;
 
 	if (video_frame == nullptr)
 		return nullptr;
 
-    if ((picture_buf = av_malloc(avpicture_get_size(pix_fmt, width, height))) == nullptr) {
+    if ((picture_buf = reinterpret_cast<uint8_t*>(pool->alloc(avpicture_get_size(pix_fmt, width, height)))) == nullptr) {
 		av_free(video_frame);
 		return nullptr;
 	}
@@ -44,191 +50,510 @@ static AVFrame* alloc_picture(int pix_fmt, int width, int height) {
 
 
 
-frame_recorder::frame_recorder(const char* out_file, int width, int height) {
+frame_recorder::frame_recorder(
+	int width,
+	int height,
+	int pix_fmt,
+	int color_space,
+	int color_range
+) {
 	this->frame_width = width;
 	this->frame_height = height;
+	this->frame_format = pix_fmt;
+	this->frame_color_space = color_space;
+	this->frame_color_range = color_range;
 
-	pthread_mutex_init(&encode_mutex, nullptr);
-	pthread_cond_init(&encode_cond, nullptr);
-	pthread_create(&encode_video_thread, nullptr, (void*(*)(void*)) &frame_recorder::encoding_thread_func, this);
+	// replay mode keeps encoded packets in memory instead of writing a file
+	const double replay_seconds = replay_ring::get_config_seconds();
 
+	{
+		const char* depth_env = get_config_value(queue_depth_env_var);
+		const char* policy_env = get_config_value(queue_policy_env_var);
 
-	av_log_set_level(AV_LOG_DEBUG);
-	format_ctx = avformat_alloc_context();
-
-	format_ctx->oformat = av_guess_format(nullptr, out_file, nullptr);
-	snprintf(format_ctx->filename, sizeof(format_ctx->filename), "%s", out_file);
-
-	video_codec = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
-	video_ctx = avcodec_alloc_context3(video_codec);
-
-	avcodec_get_context_defaults3(video_ctx, video_codec);
-
-	video_ctx->width = width;
-	video_ctx->height = height;
-	video_ctx->bit_rate = 6000 * 1000;
-	video_ctx->time_base.den = TIMEBASE;
-	video_ctx->time_base.num = 1;
-	video_ctx->thread_count = 4;
-	video_ctx->qmin = 2;
-	video_ctx->qmax = 31;
-	video_ctx->b_sensitivity = 100;
-	video_ctx->gop_size = 1;
-	video_ctx->me_method = 1;
-	video_ctx->global_quality = 100;
-	video_ctx->lowres = 0;
-	video_ctx->bit_rate_tolerance = 200000;
-
-    #if 0
-	video_ctx->compression_level = 0;
-	video_ctx->trellis = 0;
-	video_ctx->gop_size = 1; // emit one intra-frame every ten frames
-
-	video_ctx->me_pre_cmp = 0;
-	video_ctx->me_cmp = 0;
-	video_ctx->me_sub_cmp = 0;
-	video_ctx->mb_cmp = 2;
-	video_ctx->pre_dia_size = 0;
-	video_ctx->dia_size = 1;
-
-	video_ctx->quantizer_noise_shaping = 0; // qns=0
-	video_ctx->noise_reduction = 0; // nr=0
-	video_ctx->mb_decision = 0; // mbd=0 ("realtime" encoding)
-
-	video_ctx->flags &= ~CODEC_FLAG_QPEL;
-	video_ctx->flags &= ~CODEC_FLAG_4MV;
-	video_ctx->trellis = 0;
-	video_ctx->flags &= ~CODEC_FLAG_CBP_RD;
-	video_ctx->flags &= ~CODEC_FLAG_QP_RD;
-	video_ctx->flags &= ~CODEC_FLAG_MV0;
-	#endif
-	video_ctx->pix_fmt = PIX_FMT_YUV420P;
-
-
-	if (avcodec_open2(video_ctx, video_codec, nullptr) < 0)
-		fprintf(stderr, "[%s] could not open video codec\n", __func__);
+		const size_t queue_depth = (depth_env != nullptr)? std::max(atoi(depth_env), 0): 6;
+		const size_t frame_size = (pix_fmt == PIX_FMT_YUV420P)? (width * height * 3 / 2): (width * height * 4);
 
-	{
-		// create output video stream
-		AVStream* vs = av_new_stream(format_ctx, 0);
+		size_t pool_size = frame_queue::get_num_slots(queue_depth) * buffer_pool::align_size(frame_size);
 
-		vs->codec = video_ctx;
-		vs->r_frame_rate.den = TIMEBASE;
-		vs->r_frame_rate.num = 1;
-	}
+		if (pix_fmt != PIX_FMT_YUV420P) {
+			pool_size += buffer_pool::align_size(avpicture_get_size(PIX_FMT_YUV420P, width, height));
+		}
 
+		// per-session parts, released again by stop_session
+		if (chunk_encoder::get_config_num_workers() > 1 && replay_seconds <= 0.0) {
+			pool_size += chunk_encoder::get_pool_size(width, height);
+		}
 
-	if ((yuv_picture = alloc_picture(PIX_FMT_YUV420P, video_ctx->width, video_ctx->height)) == nullptr) {
-		fprintf(stderr, "[%s] could not allocate picture\n", __func__);
-		exit(1);
-	}
+		if (replay_seconds > 0.0) {
+			pool_size += replay_ring::get_pool_size();
+		}
+
+		if (!frame_pool.init(pool_size)) {
+			fprintf(stderr, "[%s] could not allocate frame pool\n", __func__);
+			exit(1);
+		}
+
+		// offline (fixed-timestep) captures wait for the encoder instead of dropping frames
+		const int queue_policy = is_game_clock_fixed()? FRAME_QUEUE_BLOCK: frame_queue::parse_policy(policy_env);
 
-	if ((rgb_picture = alloc_picture(PIX_FMT_RGBA, video_ctx->width, video_ctx->height)) == nullptr) {
-		fprintf(stderr, "[%s] could not allocate temporary picture\n", __func__);
-		exit(1);
+		video_queue = new frame_queue(&frame_pool, queue_depth, frame_size, queue_policy);
 	}
 
-	// turn RGB frames into YUV
-	img_convert_ctx = sws_getContext(
-		video_ctx->width, video_ctx->height, PIX_FMT_RGBA,
-		video_ctx->width, video_ctx->height, PIX_FMT_YUV420P,
-		SWS_FAST_BILINEAR, nullptr, nullptr, nullptr
-	);
+	if (frame_format == PIX_FMT_YUV420P) {
+		// planes are pointed at each incoming frame, no buffer of our own
+		if ((yuv_picture = avcodec_alloc_frame()) == nullptr) {
+			fprintf(stderr, "[%s] could not allocate yuv_picture\n", __func__);
+			exit(1);
+		}
+
+		yuv_picture->width = width;
+		yuv_picture->height = height;
+	} else {
+		if ((yuv_picture = alloc_picture(&frame_pool, PIX_FMT_YUV420P, width, height)) == nullptr) {
+			fprintf(stderr, "[%s] could not allocate picture\n", __func__);
+			exit(1);
+		}
 
-	if (img_convert_ctx == nullptr) {
-		fprintf(stderr, "[%s] could not initialize image-conversion context\n", __func__);
-		exit(1);
+		const char* converter_env = get_config_value(converter_env_var);
+		const char* threads_env = get_config_value(convert_threads_env_var);
+
+		if (converter_env == nullptr || strcmp(converter_env, "swscale") != 0) {
+			// same BT.601 limited-range matrix swscale applies by default
+			rgb_converter = new yuv_converter(
+				width,
+				height,
+				(threads_env != nullptr)? std::max(atoi(threads_env), 1): 2,
+				0.299f,
+				0.114f,
+				false
+			);
+		} else {
+			// turn RGB frames into YUV
+			img_convert_ctx = sws_getContext(
+				width, height, PIX_FMT_RGBA,
+				width, height, PIX_FMT_YUV420P,
+				SWS_FAST_BILINEAR, nullptr, nullptr, nullptr
+			);
+
+			if (img_convert_ctx == nullptr) {
+				fprintf(stderr, "[%s] could not initialize image-conversion context\n", __func__);
+				exit(1);
+			}
+		}
 	}
 
-	av_dump_format(format_ctx, 0, out_file, 1);
-	avio_open2(&format_ctx->pb, out_file, AVIO_FLAG_WRITE, nullptr, nullptr);
-	avformat_write_header(format_ctx, nullptr);
+	// everything allocated from here on belongs to a session
+	session_pool_mark = frame_pool.get_used();
+
+	pthread_mutex_init(&session_mutex, nullptr);
+	pthread_cond_init(&session_cond, nullptr);
+
+	// idle until the first session starts
+	pthread_create(&encode_video_thread, nullptr, (void*(*)(void*)) &frame_recorder::encoding_thread_func, this);
 }
 
 frame_recorder::~frame_recorder() {
-	keep_running = false;
-	allow_append = false;
+	if (session_active)
+		stop_session();
+
+	pthread_mutex_lock(&session_mutex);
+	engine_running = false;
+	pthread_cond_broadcast(&session_cond);
+	pthread_mutex_unlock(&session_mutex);
 
-	pthread_cond_broadcast(&encode_cond);
 	printf("[%s] joining encoder thread\n", __func__);
 	pthread_join(encode_video_thread, nullptr);
 
-	av_write_trailer(format_ctx);
+	if (frames_converted > 0) {
+		const char* converter_name = (rgb_converter != nullptr)? rgb_converter->get_kernel_name(): "swscale";
+		printf("[%s] %s conversion took %.3fms per frame\n", __func__, converter_name, (convert_time * 1000.0) / frames_converted);
+	}
+
+	// the picture's planes are in frame_pool (or in queued frames)
 	av_free(yuv_picture);
-	avformat_free_context(format_ctx);
+	sws_freeContext(img_convert_ctx);
+
+	delete rgb_converter;
+	delete video_queue;
+	frame_pool.kill();
+
+	pthread_cond_destroy(&session_cond);
+	pthread_mutex_destroy(&session_mutex);
 }
 
 
 
+bool frame_recorder::start_session(const char* out_file) {
+	init_time = -1.0;
 
-void frame_recorder::append_frame(float /*time*/, int width, int height, char* data) {
-	if (!allow_append)
-		return;
+	// replay mode keeps encoded packets in memory instead of writing a file
+	const double replay_seconds = replay_ring::get_config_seconds();
 
-	printf("[%s]\n", __func__);
-	curr_time = getcurrenttime2();
+	// stale frames of the previous session, the encoding thread is idle
+	discard_queued_slots();
+	video_queue->resume_producer();
 
-	if (init_time < 0.0)
-		init_time = getcurrenttime2();
+	if (spool_writer::get_config_enabled() && replay_seconds <= 0.0) {
+		spool_file_header header;
+		header.codec = spool_writer::get_config_codec();
+		header.width = frame_width;
+		header.height = frame_height;
+		header.pix_fmt = frame_format;
+		header.color_space = frame_color_space;
+		header.color_range = frame_color_range;
+		header.tile_size = spool_writer::get_config_tile_size();
 
-	this->frame_width = width;
-	this->frame_height = height;
+		// frames are stored as captured, snapshot_transcode encodes them later
+		video_spool = new spool_writer((std::string(out_file) + ".spool").c_str(), header, video_queue->get_slot_size(), spool_writer::get_config_num_threads());
+	} else {
+		av_log_set_level(AV_LOG_DEBUG);
+		format_ctx = avformat_alloc_context();
+
+		// mp4 or mpegts instead of <out_file>'s container when writing segments
+		format_ctx->oformat = packet_muxer::get_config_format(out_file);
+		snprintf(format_ctx->filename, sizeof(format_ctx->filename), "%s", out_file);
+
+		{
+			video_encoder_params params = video_encoder_params::from_config();
+
+			if (replay_seconds <= 0.0) {
+				video_muxer = new packet_muxer(format_ctx);
+			}
 
-	frame_data = data;
-	pthread_cond_broadcast(&encode_cond);
+			if (chunk_encoder::get_config_num_workers() > 1 && replay_seconds <= 0.0) {
+				video_chunks = new chunk_encoder(&frame_pool, params, format_ctx, video_muxer, frame_width, frame_height, TIMEBASE, frame_color_space, frame_color_range);
+				// only describes the stream, chunk encoders share its settings
+				params = video_chunks->get_params();
+			}
 
-    // memcpy(rgb_picture->data[0], data, width * height * 4);
-	allow_append = false;
+			video_ctx = open_video_encoder(params, format_ctx, frame_width, frame_height, TIMEBASE, frame_color_space, frame_color_range);
+			video_params = params;
+		}
+
+		if (video_ctx == nullptr || (video_chunks != nullptr && video_chunks->has_failed())) {
+			fprintf(stderr, "[%s] could not open video codec\n", __func__);
+			close_session();
+			return false;
+		}
+
+		// chunked encoding scales with cores instead of trading off quality,
+		// and offline captures have no real-time budget to keep
+		const bool governed = (video_chunks == nullptr && !is_game_clock_fixed());
+
+		video_governor = new encode_governor(governed? encode_governor::get_config_budget(): 0.0, get_max_speed_level(video_params));
+
+		encode_ctx = video_ctx;
+		encoder_level = 0;
+
+		{
+			// create output video stream
+			AVStream* vs = av_new_stream(format_ctx, 0);
+
+			vs->codec = video_ctx;
+			vs->r_frame_rate.den = TIMEBASE;
+			vs->r_frame_rate.num = 1;
+		}
+
+		if (replay_seconds > 0.0) {
+			video_replay = new replay_ring(&frame_pool, replay_seconds, video_ctx, std::vector<AVCodecContext*>());
+		} else if (!video_muxer->open(out_file)) {
+			fprintf(stderr, "[%s] could not open \"%s\"\n", __func__, out_file);
+			close_session();
+			return false;
+		}
+	}
+
+	// hand the session to the encoding thread
+	pthread_mutex_lock(&session_mutex);
+	keep_running = true;
+	session_active = true;
+	session_index += 1;
+	num_threads_done = 0;
+	pthread_cond_broadcast(&session_cond);
+	pthread_mutex_unlock(&session_mutex);
+	return true;
 }
 
+void frame_recorder::stop_session() {
+	keep_running = false;
 
+	// drains what is still queued and flushes the encoder
+	video_queue->wake_consumer();
+	// a swap blocked on a full (fixed-timestep) queue must not outlive the encoder
+	video_queue->abort_producer();
 
-void frame_recorder::encoding_thread_func() {
-	while (keep_running) {
-		allow_append = true;
-		pthread_cond_wait(&encode_cond, &encode_mutex);
+	printf("[%s] waiting for the encoder thread\n", __func__);
+	pthread_mutex_lock(&session_mutex);
 
-		if (!keep_running) {
-			printf("[%s] exiting\n", __func__);
-			break;
+	while (num_threads_done < 1)
+		pthread_cond_wait(&session_cond, &session_mutex);
+
+	session_active = false;
+	pthread_mutex_unlock(&session_mutex);
+
+	printf("[%s] %lu frames dropped, %lu evicted\n", __func__, video_queue->get_num_dropped(), video_queue->get_num_evicted());
+
+	if (video_governor != nullptr)
+		printf("[%s] %lu frames skipped by the encode governor (final level %d)\n", __func__, video_governor->get_num_skipped(), video_governor->get_level());
+
+	close_session();
+}
+
+// frees what start_session opened, after the encoding thread let go of it
+// (or before it was handed anything, when starting failed)
+void frame_recorder::close_session() {
+	if (video_spool != nullptr) {
+		delete video_spool;
+	} else {
+		if (video_replay != nullptr) {
+			// pending dumps still read the codec context freed along with format_ctx
+			delete video_replay;
+		} else {
+			// drains the mux queue and writes the trailer
+			delete video_muxer;
 		}
 
+		// a stream's own context is freed along with format_ctx, not this one
+		if (encode_ctx != nullptr && encode_ctx != video_ctx) {
+			avcodec_close(encode_ctx);
+			av_free(encode_ctx);
+		}
+
+		// the stream owns the context, but leaves it open
+		if (video_ctx != nullptr)
+			avcodec_close(video_ctx);
+		avformat_free_context(format_ctx);
+	}
+
+	delete video_chunks;
+	delete video_governor;
+
+	video_ctx = nullptr;
+	encode_ctx = nullptr;
+	video_governor = nullptr;
+	video_chunks = nullptr;
+	video_spool = nullptr;
+	video_replay = nullptr;
+	video_muxer = nullptr;
+	format_ctx = nullptr;
+
+	// chunk encoder and replay ring buffers
+	frame_pool.release(session_pool_mark);
+}
+
+bool frame_recorder::wait_for_session(uint64_t* session) {
+	pthread_mutex_lock(&session_mutex);
 
-		for (int y = 0; y < height; y++) {
-			const int old_idx = (                    y) * frame_width ;
-			const int new_idx = ((frame_height - 1 - y) * frame_width);
+	while (engine_running && session_index == *session)
+		pthread_cond_wait(&session_cond, &session_mutex);
 
-	        memcpy(&rgb_picture->data[0][new_idx * 4], &frame_data[old_idx * 4], frame_width * 4);
+	*session = session_index;
+
+	const bool running = engine_running;
+	pthread_mutex_unlock(&session_mutex);
+	return running;
+}
+
+void frame_recorder::finish_session() {
+	pthread_mutex_lock(&session_mutex);
+	num_threads_done += 1;
+	pthread_cond_broadcast(&session_cond);
+	pthread_mutex_unlock(&session_mutex);
+}
+
+void frame_recorder::discard_queued_slots() {
+	frame_slot* slot = nullptr;
+
+	while ((slot = video_queue->poll_slot()) != nullptr)
+		video_queue->release_slot(slot);
+}
+
+
+
+
+void frame_recorder::append_frame(frame_slot* slot, double time, int width, int height) {
+	slot->time = time;
+	slot->width = width;
+	slot->height = height;
+	slot->size = video_queue->get_slot_size();
+
+	video_queue->commit_slot(slot);
+}
+
+
+
+int frame_recorder::encode_video_frame(AVFrame* frame) {
+	AVPacket p;
+	av_init_packet(&p);
+	p.data = nullptr;
+	p.size = 0;
+
+	int encode_status = 0;
+
+	if (avcodec_encode_video2(encode_ctx, &p, frame, &encode_status) < 0)
+		return -1;
+	if (encode_status == 0)
+		return 0;
+
+	// container is "mp4"; encoders that reorder or delay frames set their
+	// own timestamps, the rest output each packet at its input frame's pts
+	if (p.pts == AV_NOPTS_VALUE && frame != nullptr)
+		p.pts = frame->pts;
+	if (p.dts == AV_NOPTS_VALUE)
+		p.dts = p.pts;
+
+	p.stream_index = 0;
+	write_packet(&p);
+	av_free_packet(&p);
+	return 1;
+}
+
+void frame_recorder::set_encoder_level(int speed_level) {
+	video_encoder_params params = video_params;
+	params.speed_level = speed_level;
+
+	AVCodecContext* ctx = reopen_video_encoder(params, video_ctx, format_ctx);
+
+	if (ctx == nullptr) {
+		// stays at the current settings, further rungs only drop frames
+		video_governor->limit_encoder_level(std::min(speed_level - 1, encoder_level));
+		return;
+	}
+
+	// a flushed encoder can not take further input; the new one starts
+	// with a keyframe, so nothing references frames of the old one
+	if ((encode_ctx->codec->capabilities & CODEC_CAP_DELAY) != 0)
+		while (encode_video_frame(nullptr) > 0);
+
+	if (encode_ctx != video_ctx) {
+		avcodec_close(encode_ctx);
+		av_free(encode_ctx);
+	}
+
+	encode_ctx = ctx;
+	encoder_level = speed_level;
+}
+
+void frame_recorder::write_packet(AVPacket* p) {
+	if (video_replay != nullptr) {
+		video_replay->push_packet(*p);
+	} else {
+		video_muxer->write_packet(p);
+	}
+}
+
+void frame_recorder::dump_replay(const char* file_name) {
+	if (video_replay == nullptr) {
+		printf("[%s] not in replay mode\n", __func__);
+		return;
+	}
+
+	video_replay->request_dump(file_name);
+}
+
+void frame_recorder::encoding_thread_func() {
+	uint64_t session = 0;
+
+	// one pass per session, until the recorder is deleted
+	while (wait_for_session(&session)) {
+		encode_video_session();
+		finish_session();
+	}
+
+	printf("[%s] exiting\n", __func__);
+}
+
+void frame_recorder::encode_video_session() {
+	frame_slot* slot = nullptr;
+
+	// keeps draining queued frames after keep_running is cleared
+	while ((slot = video_queue->front_slot(keep_running)) != nullptr) {
+		char* frame_data = slot->data;
+
+		if (init_time < 0.0)
+			init_time = slot->time;
+
+		if (video_spool != nullptr) {
+			video_spool->write_video_frame(frame_data, slot->size, slot->time);
+			video_queue->release_slot(slot);
+			continue;
 		}
 
-        sws_scale(img_convert_ctx, rgb_picture->data, rgb_picture->linesize, 0, height, yuv_picture->data, yuv_picture->linesize);
+		if (!video_governor->admit_frame()) {
+			video_queue->release_slot(slot);
+			continue;
+		}
 
-		AVPacket p;
-		av_init_packet(&p);
-		p.data = nullptr;
-		p.size = 0;
-		// set time-index
-		yuv_picture->pts = int64_t((curr_time - init_time) * TIMEBASE);
+		const double frame_start_time = get_current_time();
 
-		const uint64_t vpts = yuv_picture->pts;
-		int encode_status = 0;
+		AVFrame* picture = (video_chunks != nullptr)? video_chunks->next_frame(): yuv_picture;
 
-		assert(video_ctx != nullptr);
-		assert(yuv_picture != nullptr);
+		if (picture == nullptr) {
+			// a chunk encoder was lost; finish still writes what the others encoded,
+			// but nothing drains the queue past here, so the swap hook must not wait on it
+			video_queue->abort_producer();
+			video_queue->release_slot(slot);
+			break;
+		}
 
-		if (avcodec_encode_video2(video_ctx, &p, yuv_picture, &encode_status) < 0)
-			return;
+		if (frame_format == PIX_FMT_YUV420P) {
+			// already converted and flipped on the GPU
+			if (video_chunks != nullptr) {
+				memcpy(picture->data[0], frame_data, slot->size);
+			} else {
+				avpicture_fill((AVPicture*) picture, reinterpret_cast<uint8_t*>(frame_data), PIX_FMT_YUV420P, frame_width, frame_height);
+			}
+		} else {
+			const double t0 = get_current_time();
+
+			if (rgb_converter != nullptr) {
+				// flips the bottom-up rows as part of the conversion
+				rgb_converter->convert(reinterpret_cast<const uint8_t*>(frame_data), picture->data, picture->linesize);
+			} else {
+				// walk the bottom-up rows in reverse through a negative stride
+				uint8_t* src_planes[4] = {reinterpret_cast<uint8_t*>(&frame_data[(frame_height - 1) * frame_width * 4]), nullptr, nullptr, nullptr};
+				int src_strides[4] = {-frame_width * 4, 0, 0, 0};
+
+				sws_scale(img_convert_ctx, src_planes, src_strides, 0, frame_height, picture->data, picture->linesize);
+			}
+
+			convert_time += (get_current_time() - t0);
+			frames_converted += 1;
+		}
 
-		if (encode_status != 0) {
-			// container is "mp4"
-			p.pts = vpts;
-			p.dts = AV_NOPTS_VALUE;
+		// set time-index
+		picture->pts = int64_t((slot->time - init_time) * TIMEBASE);
 
-			av_write_frame(format_ctx, &p);
-			av_free_packet(&p);
+		assert(video_ctx != nullptr);
+		assert(picture != nullptr);
+
+		if (video_chunks != nullptr) {
+			video_chunks->submit_frame(picture);
+		} else {
+			if (encode_video_frame(picture) < 0) {
+				// nothing drains the queue past here, so the swap hook must not wait on it
+				video_queue->abort_producer();
+				video_queue->release_slot(slot);
+				return;
+			}
+
+			video_governor->update(get_current_time() - frame_start_time);
+
+			if (video_governor->get_encoder_level() != encoder_level)
+				set_encoder_level(video_governor->get_encoder_level());
 		}
 
 		printf("[%s] video-frame encoded\n", __func__);
+		video_queue->release_slot(slot);
 	}
+
+	if (video_chunks != nullptr) {
+		video_chunks->finish();
+	} else if (video_spool == nullptr && (encode_ctx->codec->capabilities & CODEC_CAP_DELAY) != 0) {
+		// drain frames still buffered inside the encoder (x264 lookahead)
+		while (encode_video_frame(nullptr) > 0);
+	}
+
+	printf("[%s] session finished\n", __func__);
 }
 
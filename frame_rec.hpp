@@ -13,43 +13,141 @@ extern "C" {
 #include <atomic>
 #include <string>
 
-
+#include "buffer_pool.hpp"
+#include "chunk_enc.hpp"
+#include "frame_enc.hpp"
+#include "frame_queue.hpp"
+#include "packet_mux.hpp"
+#include "replay_ring.hpp"
+#include "spool_file.hpp"
+#include "yuv_convert.hpp"
+
+
+// recording engine for one capture size and format: its buffers, the
+// RGBA conversion and the encoding thread live as long as it does, so
+// toggling a recording only opens (and closes) the encoder and the output
 class frame_recorder {
 public:
-    frame_recorder(const char* out_file, int width, int height);
+    frame_recorder(
+        int width,
+        int height,
+        int pix_fmt = PIX_FMT_RGBA,
+        int color_space = AVCOL_SPC_UNSPECIFIED,
+        int color_range = AVCOL_RANGE_UNSPECIFIED
+    );
     ~frame_recorder();
 
-    void append_frame(float time, int width, int height, char* data);
-    bool is_ready() const { return allow_append; }
+    // opens the encoder and <out_file> and hands them to the encoding
+    // thread; not called again before stop_session. false if either could
+    // not be opened, nothing is left open then and stop_session must not
+    // be called
+    bool start_session(const char* out_file);
+    // flushes the encoder, writes the trailer and closes everything
+    // start_session opened; the engine stays ready for the next session
+    void stop_session();
+
+    // nothing to discover without audio
+    static void start_device_discovery() {}
+
+    // returns nullptr if the frame has to be dropped
+    frame_slot* acquire_frame() { return video_queue->acquire_slot(); }
+
+    void append_frame(frame_slot* slot, double time, int width, int height);
+    void cancel_frame(frame_slot* slot) { video_queue->cancel_slot(slot); }
+
+    int get_frame_width() const { return frame_width; }
+    int get_frame_height() const { return frame_height; }
+    int get_frame_format() const { return frame_format; }
+
+    // returns 1 if a packet was written, 0 if the encoder buffered the
+    // frame, -1 on error; a null frame flushes buffered ones
+    int encode_video_frame(AVFrame* frame);
+    // drains the current encoder and continues (at a keyframe) with one
+    // opened at <speed_level>; the governor is told if there is none
+    void set_encoder_level(int speed_level);
+    // to the replay ring in replay mode, otherwise queued for the muxer thread
+    void write_packet(AVPacket* p);
+
+    // writes the replay ring to <file_name> in the background
+    void dump_replay(const char* file_name);
 
     void encoding_thread_func();
     void recording_thread_func() {}
 
 private:
-	AVFrame* rgb_picture = nullptr;
+    // blocks until the next session starts, false once the recorder is deleted
+    bool wait_for_session(uint64_t* session);
+    // called by the encoding thread when it has flushed the session's encoder
+    void finish_session();
+    // frees the encoder and outputs of the session
+    void close_session();
+    void discard_queued_slots();
+
+    void encode_video_session();
+
+private:
 	AVFrame* yuv_picture = nullptr;
-	AVCodec* video_codec = nullptr;
 
+	// describes the video stream and encodes it at the configured settings
 	AVCodecContext* video_ctx = nullptr;
+	// video_ctx, or the encoder that took over at another speed level
+	AVCodecContext* encode_ctx = nullptr;
+	video_encoder_params video_params;
+	// steps encode_ctx along cheaper settings to hold the per-frame encode budget
+	encode_governor* video_governor = nullptr;
+	// GOP-parallel encoders, used instead of video_ctx if SNAPSHOT_CHUNK_ENCODERS > 1
+	chunk_encoder* video_chunks = nullptr;
+	// replaces all of the above if SNAPSHOT_SPOOL is set
+	spool_writer* video_spool = nullptr;
+	// holds the last SNAPSHOT_REPLAY seconds of packets instead of writing format_ctx
+	replay_ring* video_replay = nullptr;
+	// writes format_ctx on a thread of its own unless in replay mode
+	packet_muxer* video_muxer = nullptr;
 	AVFormatContext* format_ctx = nullptr;
 
 	SwsContext* img_convert_ctx = nullptr;
+	// used instead of img_convert_ctx unless SNAPSHOT_CONVERTER=swscale
+	yuv_converter* rgb_converter = nullptr;
 
 	pthread_t encode_video_thread;
-	pthread_mutex_t encode_mutex;
-	pthread_cond_t encode_cond;
+
+	pthread_mutex_t session_mutex;
+	// signalled when a session starts, when the thread is done with it, and on deletion
+	pthread_cond_t session_cond;
+
+	// backs the queued frames and the YUV picture, and past session_pool_mark
+	// the current session's chunk encoder or replay ring
+	buffer_pool frame_pool;
+	frame_queue* video_queue = nullptr;
 
 private:
-	char* frame_data = nullptr;
+	size_t session_pool_mark = 0;
+
+	// counts started sessions; guarded by session_mutex, like the two below
+	uint64_t session_index = 0;
+	// encoding threads done with the current session
+	int num_threads_done = 0;
+	bool engine_running = true;
 
 	double init_time = -1.0;
-	double curr_time = -1.0;
+	// total time spent in RGBA to YUV conversion
+	double convert_time = 0.0;
+
+	uint64_t frames_converted = 0;
 
 	int frame_width = 0;
 	int frame_height = 0;
+	// PIX_FMT_RGBA (bottom-up) or PIX_FMT_YUV420P (top-down, converted on the GPU)
+	int frame_format = PIX_FMT_RGBA;
+	int frame_color_space = AVCOL_SPC_UNSPECIFIED;
+	int frame_color_range = AVCOL_RANGE_UNSPECIFIED;
+	// speed level encode_ctx was opened at
+	int encoder_level = 0;
+
+	// cleared to make the encoding thread drain and flush the session
+	std::atomic<bool> keep_running = {false};
 
-	std::atomic<bool> allow_append = {false};
-	std::atomic<bool> keep_running = {true};
+	bool session_active = false;
 };
 
 #endif
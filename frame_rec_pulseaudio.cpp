@@ -2,414 +2,932 @@
 #include <unistd.h>
 #include <sys/time.h>
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
 #include <string>
 
 #include "frame_rec_pulseaudio.hpp"
+#include "game_clock.hpp"
+#include "rec_config.hpp"
 
-#ifndef AV_CODEC_ID_MPEG4
-#define AV_CODEC_ID_MPEG4 CODEC_ID_MPEG4
-#endif
 
 #define TIMEBASE 600.0
+// samples per block for encoders without a frame size of their own (pcm)
+#define AUDIO_FRAME_SIZE 1024
+// upper bound on any encoder's frame size (flac uses up to 4608)
+#define MAX_AUDIO_FRAME_SIZE 8192
+#define NUM_AUDIO_BLOCKS 32
+// seconds between A/V offset reports
+#define SYNC_REPORT_INTERVAL 60.0
+// longest a recorder waits for the first device listing
+#define DEVICE_WAIT_TIMEOUT 2.0
+
+static const char* queue_depth_env_var = "SNAPSHOT_QUEUE_DEPTH";
+static const char* queue_policy_env_var = "SNAPSHOT_QUEUE_POLICY";
+static const char* converter_env_var = "SNAPSHOT_CONVERTER";
+static const char* convert_threads_env_var = "SNAPSHOT_CONVERT_THREADS";
 
 
 extern double get_current_time();
 
 static FILE* pa_dbg_samples_out = nullptr;
-static pa_mainloop_api* pa_global_api = nullptr;
+// lists the server's devices from library load on, see start_device_discovery
+static pulse_device_list* audio_devices = nullptr;
 
-static constexpr pa_sample_spec ss = {
-	.format = PA_SAMPLE_S16LE,
-	.rate = 44100,
-	.channels = 2
-};
 
 
+static AVFrame* alloc_picture(buffer_pool* pool, int pix_fmt, int width, int height) {
+	AVFrame* video_frame = avcodec_alloc_frame();
+	uint8_t* picture_buf = nullptr;
 
-// PulseAudio callbacks
-static void pa_get_server_info_callback(pa_context* c, const pa_server_info* i, void* userdata) {
-	frame_recorder* fr = reinterpret_cast<frame_recorder*>(userdata);
+	if (video_frame == nullptr)
+		return nullptr;
+
+    if ((picture_buf = reinterpret_cast<uint8_t*>(pool->alloc(avpicture_get_size(pix_fmt, width, height)))) == nullptr) {
+		av_free(video_frame);
+		return nullptr;
+	}
 
-	printf("[%s] PA default sink name=\"%s\"\n", __func__, i->default_sink_name);
-	fr->default_sink = i->default_sink_name;
-	pa_global_api->quit(pa_global_api, 1);
+	avpicture_fill((AVPicture*) video_frame, picture_buf, pix_fmt, width, height);
+	video_frame->width = width;
+	video_frame->height = height;
+	return video_frame;
 }
 
-static void pa_get_sink_info_callback(pa_context* c, const pa_sink_info* i, int is_last, void* userdata) {
-	if (is_last) {
-		pa_operation_unref(pa_context_get_server_info(c, pa_get_server_info_callback, userdata));
+
+
+void frame_recorder::start_device_discovery() {
+	if (audio_devices != nullptr)
 		return;
-	}
 
-	printf("[%s] PA sink name=\"%s\" descr=\"%s\"\n", __func__, i->name, i->description);
+	// lives as long as the process
+	audio_devices = new pulse_device_list();
+	audio_devices->start();
 }
 
-static void pa_get_source_info_callback(pa_context* c, const pa_source_info* i, int is_last, void* userdata) {
-	frame_recorder* fr = reinterpret_cast<frame_recorder*>(userdata);
 
-	if (is_last != 0) {
-		pa_operation_unref(pa_context_get_sink_info_list(c, pa_get_sink_info_callback, userdata));
-		return;
+frame_recorder::frame_recorder(
+	int width,
+	int height,
+	int pix_fmt,
+	int color_space,
+	int color_range
+) {
+	this->frame_width = width;
+	this->frame_height = height;
+	this->frame_format = pix_fmt;
+	this->frame_color_space = color_space;
+	this->frame_color_range = color_range;
+
+	// sessions may record fewer sources than configured now, never more
+	max_audio_sources = audio_source_params::from_config().size();
+
+	// replay mode keeps encoded packets in memory instead of writing a file
+	const double replay_seconds = replay_ring::get_config_seconds();
+	// interleaved stereo block of the largest encoder frame, whatever the
+	// encoder and sample format of a session turn out to be
+	const size_t audio_block_size = MAX_AUDIO_FRAME_SIZE * 2 * sizeof(float);
+
+	{
+		const char* depth_env = get_config_value(queue_depth_env_var);
+		const char* policy_env = get_config_value(queue_policy_env_var);
+
+		const size_t queue_depth = (depth_env != nullptr)? std::max(atoi(depth_env), 0): 6;
+		const size_t frame_size = (pix_fmt == PIX_FMT_YUV420P)? (width * height * 3 / 2): (width * height * 4);
+
+		size_t pool_size = frame_queue::get_num_slots(queue_depth) * buffer_pool::align_size(frame_size);
+
+		if (pix_fmt != PIX_FMT_YUV420P) {
+			pool_size += buffer_pool::align_size(avpicture_get_size(PIX_FMT_YUV420P, width, height));
+		}
+
+		// per-session parts, released again by stop_session
+		if (chunk_encoder::get_config_num_workers() > 1 && replay_seconds <= 0.0) {
+			pool_size += chunk_encoder::get_pool_size(width, height);
+		}
+
+		if (replay_seconds > 0.0) {
+			pool_size += replay_ring::get_pool_size();
+		}
+
+		// one extra block to read into (and discard) when all others are queued
+		pool_size += (frame_queue::get_num_slots(NUM_AUDIO_BLOCKS * max_audio_sources) + 1) * buffer_pool::align_size(audio_block_size);
+
+		if (!frame_pool.init(pool_size)) {
+			fprintf(stderr, "[%s] could not allocate frame pool\n", __func__);
+			exit(1);
+		}
+
+		// offline (fixed-timestep) captures wait for the encoder instead of dropping frames
+		const int queue_policy = is_game_clock_fixed()? FRAME_QUEUE_BLOCK: frame_queue::parse_policy(policy_env);
+
+		video_queue = new frame_queue(&frame_pool, queue_depth, frame_size, queue_policy);
+		// a late encoder costs the newest audio, never an unbounded backlog
+		audio_queue = new frame_queue(&frame_pool, NUM_AUDIO_BLOCKS * max_audio_sources, audio_block_size, FRAME_QUEUE_DROP_NEWEST);
+		audio_scratch = reinterpret_cast<char*>(frame_pool.alloc(audio_block_size));
 	}
 
-	printf("[%s] PA source name=\"%s\" descr=\"%s\"\n", __func__, i->name, i->description);
+	if (frame_format == PIX_FMT_YUV420P) {
+		// planes are pointed at each incoming frame, no buffer of our own
+		if ((yuv_picture = avcodec_alloc_frame()) == nullptr) {
+			fprintf(stderr, "[%s] could not allocate yuv_picture\n", __func__);
+			exit(1);
+		}
 
-	if (i->monitor_of_sink == PA_INVALID_INDEX)
-		return;
+		yuv_picture->width = width;
+		yuv_picture->height = height;
+	} else {
+		if ((yuv_picture = alloc_picture(&frame_pool, PIX_FMT_YUV420P, width, height)) == nullptr) {
+			fprintf(stderr, "[%s] could not allocate yuv_picture\n", __func__);
+			exit(1);
+		}
 
-	printf("\tsink monitor name=\"%s\"\n", i->monitor_of_sink_name);
-	fr->monitor_sources.insert(std::pair<std::string, std::string>(i->monitor_of_sink_name, i->name));
-}
+		const char* converter_env = get_config_value(converter_env_var);
+		const char* threads_env = get_config_value(convert_threads_env_var);
+
+		if (converter_env == nullptr || strcmp(converter_env, "swscale") != 0) {
+			// same BT.601 limited-range matrix swscale applies by default
+			rgb_converter = new yuv_converter(
+				width,
+				height,
+				(threads_env != nullptr)? std::max(atoi(threads_env), 1): 2,
+				0.299f,
+				0.114f,
+				false
+			);
+		} else {
+			// turn RGB frames into YUV
+			img_convert_ctx = sws_getContext(
+				width, height, PIX_FMT_RGBA,
+				width, height, PIX_FMT_YUV420P,
+				SWS_FAST_BILINEAR, nullptr, nullptr, nullptr
+			);
+
+			if (img_convert_ctx == nullptr) {
+				fprintf(stderr, "[%s] could not initialize image-conversion context\n", __func__);
+				exit(1);
+			}
+		}
+	}
 
-static void pa_context_state_callback(pa_context* c, void* userdata) {
-	if (pa_context_get_state(c) != PA_CONTEXT_READY)
-		return;
+	// everything allocated from here on belongs to a session
+	session_pool_mark = frame_pool.get_used();
 
-	pa_operation_unref(pa_context_get_source_info_list(c, pa_get_source_info_callback, userdata));
-}
+	pthread_mutex_init(&session_mutex, nullptr);
+	pthread_cond_init(&session_cond, nullptr);
 
+	// both idle until the first session starts
+	pthread_create(&encode_video_thread, nullptr, (void*(*)(void*)) &frame_recorder::encoding_thread_func, this);
+	pthread_create(&encode_audio_thread, nullptr, (void*(*)(void*)) &frame_recorder::audio_encoding_thread_func, this);
+}
 
+frame_recorder::~frame_recorder() {
+	if (session_active)
+		stop_session();
 
-static AVFrame* alloc_picture(int pix_fmt, int width, int height) {
-	AVFrame* video_frame = avcodec_alloc_frame();
-	uint8_t* picture_buf = nullptr;
+	pthread_mutex_lock(&session_mutex);
+	engine_running = false;
+	pthread_cond_broadcast(&session_cond);
+	pthread_mutex_unlock(&session_mutex);
 
-	if (video_frame == nullptr)
-		return nullptr;
+	printf("[%s] joining encoder threads\n", __func__);
+	pthread_join(encode_video_thread, nullptr);
+	pthread_join(encode_audio_thread, nullptr);
 
-    if ((picture_buf = av_malloc(avpicture_get_size(pix_fmt, width, height))) == nullptr) {
-		av_free(video_frame);
-		return nullptr;
+	if (frames_converted > 0) {
+		const char* converter_name = (rgb_converter != nullptr)? rgb_converter->get_kernel_name(): "swscale";
+		printf("[%s] %s conversion took %.3fms per frame\n", __func__, converter_name, (convert_time * 1000.0) / frames_converted);
 	}
 
-	avpicture_fill((AVPicture*) video_frame, picture_buf, pix_fmt, width, height);
-	video_frame->width = width;
-	video_frame->height = height;
-	return video_frame;
+	// the picture's planes are in frame_pool (or in queued frames)
+	av_free(yuv_picture);
+	sws_freeContext(img_convert_ctx);
+
+	delete rgb_converter;
+	delete audio_queue;
+	delete video_queue;
+	frame_pool.kill();
+
+	pthread_cond_destroy(&session_cond);
+	pthread_mutex_destroy(&session_mutex);
+
+	// fclose(pa_dbg_samples_out);
 }
 
 
 
-frame_recorder::frame_recorder(const char* out_file, int width, int height) {
+bool frame_recorder::start_session(const char* out_file) {
 	// pa_dbg_samples_out = fopen("audiosamples.s16", "wb");
 	audio_samples_written = 0;
+	// video and audio timestamps both count from here
+	clock_epoch = get_game_time();
 
-	{
-		pa_mainloop* pa_loop = pa_mainloop_new();
-		pa_context* pa_ctx = pa_context_new((pa_global_api = pa_mainloop_get_api(pa_loop)), "Rec1");
+	audio_sample_rate = 44100;
+	audio_frame_samples = AUDIO_FRAME_SIZE;
+	audio_sample_format = AUDIO_SAMPLE_S16;
+	audio_failed = false;
+
+	// already listed in the background unless the library was loaded just now
+	pulse_device_info devices;
+
+	if (audio_devices != nullptr)
+		devices = audio_devices->get_devices(DEVICE_WAIT_TIMEOUT);
 
-		if (pa_context_connect(pa_ctx, nullptr, (pa_context_flags_t) 0, nullptr) < 0)
-			printf("[%s] could not connect to PA-server\n", __func__);
+	// replay mode keeps encoded packets in memory instead of writing a file
+	const double replay_seconds = replay_ring::get_config_seconds();
+	// spools store s16 audio whatever the source delivers
+	const bool spool_audio = (spool_writer::get_config_enabled() && replay_seconds <= 0.0);
 
-		int ret = 0;
+	std::vector<audio_source_params> sources = audio_source_params::from_config();
 
-		pa_context_set_state_callback(pa_ctx, pa_context_state_callback, this);
-		pa_mainloop_run(pa_loop, &ret);
-		printf("[%s] using PA source \"%s\"\n", __func__, monitor_sources[default_sink].c_str());
-		pa_context_disconnect(pa_ctx);
+	if (spool_audio && sources.size() > 1) {
+		printf("[%s] spools hold a single audio track, recording \"%s\" only\n", __func__, sources[0].name.c_str());
+		sources.resize(1);
+	}
+	if (sources.size() > max_audio_sources) {
+		// audio_queue was sized for the sources configured at setup
+		printf("[%s] recording the first %lu of %lu audio sources\n", __func__, max_audio_sources, sources.size());
+		sources.resize(max_audio_sources);
+	}
+	if (is_game_clock_fixed() && !sources.empty()) {
+		// devices capture in real time, which no longer matches the game's
+		printf("[%s] fixed-timestep mode, not recording audio\n", __func__);
+		sources.clear();
+		audio_failed = true;
 	}
 
-	int error = 0;
-	audio_stream = pa_simple_new(nullptr, "SnapShot Record", PA_STREAM_RECORD, monitor_sources[default_sink].c_str(), "record", &ss, nullptr, nullptr , &error);
+	// capture in each source's own format, so the server does not convert;
+	// float sources (most sinks) stay float up to the encoder if it takes
+	// float, else everything is converted to s16 once. all sources share
+	// the first one's rate, only the others may get resampled
+	std::vector<pa_sample_spec> source_specs_used;
 
-	if (audio_stream == nullptr)
-		printf("[%s] could not create audio-stream (error %d)\n", __func__, error);
+	for (const audio_source_params& source: sources) {
+		// aliases follow the server's current defaults
+		std::string source_name = source.name;
 
+		if (source_name == "monitor")
+			source_name = devices.monitor_sources[devices.default_sink];
+		if (source_name == "mic")
+			source_name = devices.default_source;
 
-	this->frame_width = width;
-	this->frame_height = height;
+		pa_sample_spec source_spec = {PA_SAMPLE_S16LE, 44100, 2};
 
-	pthread_mutex_init(&encode_mutex, nullptr);
-	pthread_mutex_init(&sound_buffer_lock, nullptr);
-	pthread_cond_init(&encode_cond, nullptr);
-	pthread_create(&encode_video_thread, nullptr, (void*(*)(void*)) &frame_recorder::encoding_thread_func, this);
+		if (devices.source_specs.find(source_name) != devices.source_specs.end())
+			source_spec = devices.source_specs[source_name];
 
+		printf("[%s] using PA source \"%s\" (gain %.2f)\n", __func__, source_name.c_str(), source.gain);
 
-	av_log_set_level(AV_LOG_DEBUG);
-	format_ctx = avformat_alloc_context();
-
-	format_ctx->oformat = av_guess_format(nullptr, out_file, nullptr);
-	snprintf(format_ctx->filename, sizeof(format_ctx->filename), "%s", out_file);
-
-	video_codec = avcodec_find_encoder(AV_CODEC_ID_MPEG4);
-	audio_codec = avcodec_find_encoder(AV_CODEC_ID_MP2);
-	video_ctx = avcodec_alloc_context3(video_codec);
-	audio_ctx = avcodec_alloc_context3(audio_codec);
-
-	avcodec_get_context_defaults3(audio_ctx, audio_codec);
-	avcodec_get_context_defaults3(video_ctx, video_codec);
-
-	video_ctx->width = width;
-	video_ctx->height = height;
-	video_ctx->bit_rate = 6000 * 1000;
-	video_ctx->time_base.den = TIMEBASE;
-	video_ctx->time_base.num = 1;
-	video_ctx->thread_count = 4;
-	video_ctx->qmin = 2;
-	video_ctx->qmax = 31;
-	video_ctx->b_sensitivity = 100;
-	video_ctx->gop_size = 1;
-	video_ctx->me_method = 1;
-	video_ctx->global_quality = 100;
-	video_ctx->lowres = 0;
-	video_ctx->bit_rate_tolerance = 200000;
-
-	audio_ctx->sample_fmt = AV_SAMPLE_FMT_S16;
-	audio_ctx->sample_rate = 44100;
-	audio_ctx->channels = 2;
-	audio_ctx->time_base.den = 44100;
-	audio_ctx->time_base.num = 1;
-	audio_ctx->bit_rate = 128000;
-
-	audio_ctx->frame_size = 8192;
-	audio_ctx->channel_layout = 3;
-
-    #if 0
-	video_ctx->compression_level = 0;
-	video_ctx->trellis = 0;
-	video_ctx->gop_size = 1; // emit one intra-frame every ten frames
-
-	video_ctx->me_pre_cmp = 0;
-	video_ctx->me_cmp = 0;
-	video_ctx->me_sub_cmp = 0;
-	video_ctx->mb_cmp = 2;
-	video_ctx->pre_dia_size = 0;
-	video_ctx->dia_size = 1;
-
-	video_ctx->quantizer_noise_shaping = 0; // qns=0
-	video_ctx->noise_reduction = 0; // nr=0
-	video_ctx->mb_decision = 0; // mbd=0 ("realtime" encoding)
-
-	video_ctx->flags &= ~CODEC_FLAG_QPEL;
-	video_ctx->flags &= ~CODEC_FLAG_4MV;
-	video_ctx->trellis = 0;
-	video_ctx->flags &= ~CODEC_FLAG_CBP_RD;
-	video_ctx->flags &= ~CODEC_FLAG_QP_RD;
-	video_ctx->flags &= ~CODEC_FLAG_MV0;
-	#endif
-	video_ctx->pix_fmt = PIX_FMT_YUV420P;
-
-
-	if (avcodec_open2(video_ctx, video_codec, nullptr) < 0)
-		fprintf(stderr, "[%s] could not open video codec\n", __func__);
-
-	if ((audio_failed = (avcodec_open2(audio_ctx, audio_codec, nullptr) < 0)))
-		fprintf(stderr, "[%s] could not open audio codec\n", __func__);
-
-	pthread_create(&record_sound_thread, nullptr, (void*(*)(void*)) &frame_recorder::recording_thread_func, this);
+		audio_source_names.push_back(source_name);
+		source_specs_used.push_back(source_spec);
+	}
 
+	bool source_float = false;
 
-	{
-		// create output video&audio streams
-		AVStream* vs =                  av_new_stream(format_ctx, 0);
-		AVStream* as = (!audio_failed)? av_new_stream(format_ctx, 1): nullptr;
-
-		vs->codec = video_ctx;
-		vs->r_frame_rate.den = TIMEBASE;
-		vs->r_frame_rate.num = 1;
-
-		if (as != nullptr) {
-			as->codec = audio_ctx;
-			as->r_frame_rate.den = 44100;
-			as->r_frame_rate.num = 1;
+	// anything but s16 (s24/s32 sinks) is captured as float, at no loss
+	for (const pa_sample_spec& spec: source_specs_used)
+		source_float |= (spec.format != PA_SAMPLE_S16LE);
+
+	const AVSampleFormat input_fmt = (source_float && !spool_audio)? AV_SAMPLE_FMT_FLT: AV_SAMPLE_FMT_S16;
+	const bool separate_tracks = (sources.size() > 1 && audio_mixer::get_config_separate_tracks());
+
+	// one encoder per track; the encoder settles the capture rate if it cannot take the source's (opus only takes 48kHz)
+	for (size_t i = 0; i < (separate_tracks? sources.size(): 1) && !audio_failed; i++) {
+		AVCodecContext* ctx = open_audio_encoder(audio_encoder_params::from_config(), packet_muxer::get_config_format(out_file), source_specs_used[0].rate, 2, input_fmt);
+
+		if ((audio_failed = (ctx == nullptr))) {
+			fprintf(stderr, "[%s] could not open audio codec\n", __func__);
+		} else {
+			audio_ctxs.push_back(ctx);
 		}
 	}
 
+	if (audio_failed) {
+		for (AVCodecContext* ctx: audio_ctxs) {
+			avcodec_close(ctx);
+			av_free(ctx);
+		}
+
+		audio_ctxs.clear();
+	} else {
+		audio_sample_rate = audio_ctxs[0]->sample_rate;
+		audio_frame_samples = (audio_ctxs[0]->frame_size > 0)? std::min(audio_ctxs[0]->frame_size, MAX_AUDIO_FRAME_SIZE): AUDIO_FRAME_SIZE;
 
-	if ((yuv_picture = alloc_picture(PIX_FMT_YUV420P, video_ctx->width, video_ctx->height)) == nullptr) {
-		fprintf(stderr, "[%s] could not allocate yuv_picture\n", __func__);
-		exit(1);
+		if (input_fmt == AV_SAMPLE_FMT_FLT && audio_ctxs[0]->sample_fmt != AV_SAMPLE_FMT_S16)
+			audio_sample_format = AUDIO_SAMPLE_FLOAT;
 	}
 
-	if ((rgb_picture = alloc_picture(PIX_FMT_RGBA, video_ctx->width, video_ctx->height)) == nullptr) {
-		fprintf(stderr, "[%s] could not allocate rgb_picture\n", __func__);
-		exit(1);
+	// stale blocks (and frames) of the previous session, the encoding threads are idle
+	discard_queued_slots();
+	video_queue->resume_producer();
+
+	if (spool_audio) {
+		spool_file_header header;
+		header.codec = spool_writer::get_config_codec();
+		header.width = frame_width;
+		header.height = frame_height;
+		header.pix_fmt = frame_format;
+		header.color_space = frame_color_space;
+		header.color_range = frame_color_range;
+		header.tile_size = spool_writer::get_config_tile_size();
+		header.sample_rate = audio_sample_rate;
+		header.channels = 2;
+
+		// frames (and audio) are stored as captured, snapshot_transcode encodes them later
+		video_spool = new spool_writer((std::string(out_file) + ".spool").c_str(), header, video_queue->get_slot_size(), spool_writer::get_config_num_threads());
+	} else {
+		av_log_set_level(AV_LOG_DEBUG);
+		format_ctx = avformat_alloc_context();
+
+		// mp4 or mpegts instead of <out_file>'s container when writing segments
+		format_ctx->oformat = packet_muxer::get_config_format(out_file);
+		snprintf(format_ctx->filename, sizeof(format_ctx->filename), "%s", out_file);
+
+		{
+			video_encoder_params params = video_encoder_params::from_config();
+
+			if (replay_seconds <= 0.0) {
+				video_muxer = new packet_muxer(format_ctx);
+			}
+
+			if (chunk_encoder::get_config_num_workers() > 1 && replay_seconds <= 0.0) {
+				video_chunks = new chunk_encoder(&frame_pool, params, format_ctx, video_muxer, frame_width, frame_height, TIMEBASE, frame_color_space, frame_color_range);
+				// only describes the stream, chunk encoders share its settings
+				params = video_chunks->get_params();
+			}
+
+			video_ctx = open_video_encoder(params, format_ctx, frame_width, frame_height, TIMEBASE, frame_color_space, frame_color_range);
+			video_params = params;
+		}
+
+		if (video_ctx == nullptr || (video_chunks != nullptr && video_chunks->has_failed())) {
+			fprintf(stderr, "[%s] could not open video codec\n", __func__);
+			close_session();
+			return false;
+		}
+
+		// chunked encoding scales with cores instead of trading off quality,
+		// and offline captures have no real-time budget to keep
+		const bool governed = (video_chunks == nullptr && !is_game_clock_fixed());
+
+		video_governor = new encode_governor(governed? encode_governor::get_config_budget(): 0.0, get_max_speed_level(video_params));
+
+		encode_ctx = video_ctx;
+		encoder_level = 0;
+
+		{
+			// create output video&audio streams, one audio stream per track
+			AVStream* vs = av_new_stream(format_ctx, 0);
+
+			vs->codec = video_ctx;
+			vs->r_frame_rate.den = TIMEBASE;
+			vs->r_frame_rate.num = 1;
+
+			for (size_t i = 0; i < audio_ctxs.size(); i++) {
+				AVStream* as = av_new_stream(format_ctx, 1 + i);
+
+				as->codec = audio_ctxs[i];
+				as->r_frame_rate.den = audio_sample_rate;
+				as->r_frame_rate.num = 1;
+
+				if (audio_ctxs.size() > 1)
+					av_dict_set(&as->metadata, "title", audio_source_names[i].c_str(), 0);
+			}
+		}
+
+		if (replay_seconds > 0.0) {
+			video_replay = new replay_ring(&frame_pool, replay_seconds, video_ctx, audio_ctxs);
+		} else if (!video_muxer->open(out_file)) {
+			fprintf(stderr, "[%s] could not open \"%s\"\n", __func__, out_file);
+			close_session();
+			return false;
+		}
+
+		// audio keeps its own cadence, independent of the game's frame rate
+		if ((audio_encoding = !audio_failed)) {
+			for (size_t i = 0; i < sources.size(); i++)
+				audio_clocks.push_back(new audio_sync(audio_sample_rate, 2, audio_gain::get_sample_size(audio_sample_format), clock_epoch));
+
+			// one track of several sources, aligned by their timestamps
+			if (audio_ctxs.size() < audio_clocks.size()) {
+				audio_mix = new audio_mixer(audio_sample_rate, 2, audio_sample_format, audio_frame_samples);
+
+				for (audio_sync* clock: audio_clocks)
+					audio_mix->add_source(clock);
+
+				printf("[%s] mixing %lu sources into one track (%s kernel)\n", __func__, audio_clocks.size(), audio_mix->get_kernel_name());
+			}
+		}
 	}
 
-	// turn RGB frames into YUV
-	img_convert_ctx = sws_getContext(
-		video_ctx->width, video_ctx->height, PIX_FMT_RGBA,
-		video_ctx->width, video_ctx->height, PIX_FMT_YUV420P,
-		SWS_FAST_BILINEAR, nullptr, nullptr, nullptr
-	);
+	// fills audio_queue from PulseAudio's own thread
+	audio_capture = new pulse_capture(audio_queue, audio_scratch);
 
-	if (img_convert_ctx == nullptr) {
-		fprintf(stderr, "[%s] could not initialize image-conversion context\n", __func__);
-		exit(1);
+	for (size_t i = 0; i < sources.size(); i++) {
+		const int source_format = (source_specs_used[i].format == PA_SAMPLE_S16LE)? AUDIO_SAMPLE_S16: AUDIO_SAMPLE_FLOAT;
+
+		// also the only conversion between capture and encoder formats
+		audio_volumes.push_back(new audio_gain(sources[i].gain, source_format, audio_sample_format));
+		audio_capture->add_source(audio_source_names[i].c_str(), audio_volumes[i]);
 	}
 
-	av_dump_format(format_ctx, 0, out_file, 1);
-	avio_open2(&format_ctx->pb, out_file, AVIO_FLAG_WRITE, nullptr, nullptr);
-	avformat_write_header(format_ctx, nullptr);
+	audio_capture->start(audio_sample_rate, 2, audio_frame_samples);
+
+	// hand the session to the encoding threads
+	pthread_mutex_lock(&session_mutex);
+	keep_running = true;
+	session_active = true;
+	session_index += 1;
+	num_threads_done = 0;
+	pthread_cond_broadcast(&session_cond);
+	pthread_mutex_unlock(&session_mutex);
+	return true;
 }
 
-frame_recorder::~frame_recorder() {
+void frame_recorder::stop_session() {
+	// first, so the (spooling) encoder thread still drains the last blocks
+	printf("[%s] stopping audio capture (latency up to %.1fms)\n", __func__, audio_capture->get_latency() * 1000.0);
+	audio_capture->stop();
+
 	keep_running = false;
-	allow_append = false;
 
-	pthread_cond_broadcast(&encode_cond);
-	printf("[%s] joining encoder thread\n", __func__);
-	pthread_join(encode_video_thread, nullptr);
-	printf("[%s] joining recorder thread\n", __func__);
-	pthread_join(record_sound_thread, nullptr);
+	// both threads drain what is still queued and flush their encoders
+	video_queue->wake_consumer();
+	// a swap blocked on a full (fixed-timestep) queue must not outlive the encoder
+	video_queue->abort_producer();
+	audio_queue->wake_consumer();
 
-	av_write_trailer(format_ctx);
-	av_free(yuv_picture);
-	avformat_free_context(format_ctx);
-	pa_simple_free(audio_stream);
+	printf("[%s] waiting for the encoder threads\n", __func__);
+	pthread_mutex_lock(&session_mutex);
+
+	while (num_threads_done < 2)
+		pthread_cond_wait(&session_cond, &session_mutex);
+
+	session_active = false;
+	pthread_mutex_unlock(&session_mutex);
+
+	printf("[%s] %lu frames dropped, %lu evicted\n", __func__, video_queue->get_num_dropped(), video_queue->get_num_evicted());
+
+	if (audio_encoding)
+		print_sync_stats(__func__);
+
+	printf("[%s] %lu audio blocks dropped\n", __func__, audio_queue->get_num_dropped());
+
+	if (video_governor != nullptr)
+		printf("[%s] %lu frames skipped by the encode governor (final level %d)\n", __func__, video_governor->get_num_skipped(), video_governor->get_level());
+
+	close_session();
 
 	// fclose(pa_dbg_samples_out);
 }
 
+// frees what start_session opened, after the encoding threads let go of it
+// (or before they were handed anything, when starting failed)
+void frame_recorder::close_session() {
+	if (video_spool != nullptr) {
+		delete video_spool;
+	} else {
+		if (video_replay != nullptr) {
+			// pending dumps still read the codec contexts freed along with format_ctx
+			delete video_replay;
+		} else {
+			// drains the mux queue and writes the trailer
+			delete video_muxer;
+		}
+
+		// a stream's own context is freed along with format_ctx, not this one
+		if (encode_ctx != nullptr && encode_ctx != video_ctx) {
+			avcodec_close(encode_ctx);
+			av_free(encode_ctx);
+		}
+
+		if (video_ctx != nullptr)
+			avcodec_close(video_ctx);
+	}
+
+	// the streams own their contexts, but leave them open
+	for (AVCodecContext* ctx: audio_ctxs) {
+		avcodec_close(ctx);
+
+		if (format_ctx == nullptr || format_ctx->nb_streams == 0)
+			av_free(ctx);
+	}
+
+	if (format_ctx != nullptr)
+		avformat_free_context(format_ctx);
+
+	delete video_chunks;
+	delete video_governor;
+	delete audio_capture;
+	delete audio_mix;
+
+	for (audio_sync* clock: audio_clocks)
+		delete clock;
+	for (audio_gain* volume: audio_volumes)
+		delete volume;
+
+	video_ctx = nullptr;
+	encode_ctx = nullptr;
+	video_governor = nullptr;
+	video_chunks = nullptr;
+	video_spool = nullptr;
+	video_replay = nullptr;
+	video_muxer = nullptr;
+	format_ctx = nullptr;
+	audio_capture = nullptr;
+	audio_mix = nullptr;
+	audio_encoding = false;
+
+	audio_ctxs.clear();
+	audio_volumes.clear();
+	audio_clocks.clear();
+	audio_source_names.clear();
+
+	// chunk encoder and replay ring buffers
+	frame_pool.release(session_pool_mark);
+}
+
+bool frame_recorder::wait_for_session(uint64_t* session) {
+	pthread_mutex_lock(&session_mutex);
+
+	while (engine_running && session_index == *session)
+		pthread_cond_wait(&session_cond, &session_mutex);
+
+	*session = session_index;
+
+	const bool running = engine_running;
+	pthread_mutex_unlock(&session_mutex);
+	return running;
+}
+
+void frame_recorder::finish_session() {
+	pthread_mutex_lock(&session_mutex);
+	num_threads_done += 1;
+	pthread_cond_broadcast(&session_cond);
+	pthread_mutex_unlock(&session_mutex);
+}
+
+void frame_recorder::discard_queued_slots() {
+	frame_slot* slot = nullptr;
 
+	while ((slot = video_queue->poll_slot()) != nullptr)
+		video_queue->release_slot(slot);
+	while ((slot = audio_queue->poll_slot()) != nullptr)
+		audio_queue->release_slot(slot);
+}
 
 
-void frame_recorder::append_frame(float /*time*/, int width, int height, char* data) {
-	if (!allow_append)
+
+
+void frame_recorder::append_frame(frame_slot* slot, double time, int width, int height) {
+	slot->time = time;
+	slot->width = width;
+	slot->height = height;
+	slot->size = video_queue->get_slot_size();
+
+	video_queue->commit_slot(slot);
+}
+
+
+
+void frame_recorder::spool_sound_buffers() {
+	frame_slot* block = nullptr;
+
+	while ((block = audio_queue->poll_slot()) != nullptr) {
+		video_spool->write_audio_block(reinterpret_cast<const short*>(block->data), block->size, audio_samples_written / double(audio_sample_rate));
+		audio_samples_written += audio_frame_samples;
+
+		audio_queue->release_slot(block);
+	}
+}
+
+int frame_recorder::encode_video_frame(AVFrame* frame) {
+	AVPacket p;
+	av_init_packet(&p);
+	p.data = nullptr;
+	p.size = 0;
+
+	int encode_status = 0;
+
+	if (avcodec_encode_video2(encode_ctx, &p, frame, &encode_status) < 0)
+		return -1;
+	if (encode_status == 0)
+		return 0;
+
+	// container is "mp4"; encoders that reorder or delay frames set their
+	// own timestamps, the rest output each packet at its input frame's pts
+	if (p.pts == AV_NOPTS_VALUE && frame != nullptr)
+		p.pts = frame->pts;
+	if (p.dts == AV_NOPTS_VALUE)
+		p.dts = p.pts;
+
+	p.stream_index = 0;
+	write_packet(&p);
+	av_free_packet(&p);
+	return 1;
+}
+
+int frame_recorder::encode_audio_frame(size_t track, AVFrame* frame) {
+	AVPacket p;
+	av_init_packet(&p);
+	p.data = nullptr;
+	p.size = 0;
+
+	int encode_status = 0;
+
+	if (avcodec_encode_audio2(audio_ctxs[track], &p, frame, &encode_status) < 0)
+		return -1;
+	if (encode_status == 0)
+		return 0;
+
+	p.stream_index = 1 + track;
+	p.flags |= AV_PKT_FLAG_KEY;
+
+	write_packet(&p);
+	av_free_packet(&p);
+	return 1;
+}
+
+void frame_recorder::set_encoder_level(int speed_level) {
+	video_encoder_params params = video_params;
+	params.speed_level = speed_level;
+
+	AVCodecContext* ctx = reopen_video_encoder(params, video_ctx, format_ctx);
+
+	if (ctx == nullptr) {
+		// stays at the current settings, further rungs only drop frames
+		video_governor->limit_encoder_level(std::min(speed_level - 1, encoder_level));
 		return;
+	}
 
-	printf("[%s]\n", __func__);
-	curr_time = getcurrenttime2();
+	// a flushed encoder can not take further input; the new one starts
+	// with a keyframe, so nothing references frames of the old one
+	if ((encode_ctx->codec->capabilities & CODEC_CAP_DELAY) != 0)
+		while (encode_video_frame(nullptr) > 0);
 
-	if (init_time < 0.0)
-		init_time = getcurrenttime2();
+	if (encode_ctx != video_ctx) {
+		avcodec_close(encode_ctx);
+		av_free(encode_ctx);
+	}
 
-	this->frame_width = width;
-	this->frame_height = height;
+	encode_ctx = ctx;
+	encoder_level = speed_level;
+}
 
-	frame_data = data;
-	pthread_cond_broadcast(&encode_cond);
+void frame_recorder::write_packet(AVPacket* p) {
+	if (video_replay != nullptr) {
+		video_replay->push_packet(*p);
+	} else {
+		video_muxer->write_packet(p);
+	}
+}
 
-    // memcpy(rgb_picture->data[0], data, width * height * 4);
-	allow_append = false;
+void frame_recorder::dump_replay(const char* file_name) {
+	if (video_replay == nullptr) {
+		printf("[%s] not in replay mode\n", __func__);
+		return;
+	}
+
+	video_replay->request_dump(file_name);
 }
 
+void frame_recorder::encoding_thread_func() {
+	uint64_t session = 0;
 
+	// one pass per session, until the recorder is deleted
+	while (wait_for_session(&session)) {
+		encode_video_session();
+		finish_session();
+	}
 
-void frame_recorder::recording_thread_func() {
-	int error = 0;
+	printf("[%s] exiting\n", __func__);
+}
 
-	while (keep_running) {
-		printf("[%s] reading %d audio-samples\n", __func__, audio_ctx->frame_size * 2);
+void frame_recorder::encode_video_session() {
+	frame_slot* slot = nullptr;
 
-		short* buf = new short[audio_ctx->frame_size * 2];
+	// keeps draining queued frames after keep_running is cleared
+	while ((slot = video_queue->front_slot(keep_running)) != nullptr) {
+		char* frame_data = slot->data;
 
-		if (pa_simple_read(audio_stream, buf, audio_ctx->frame_size * 4, &error) < 0) {
-			printf("[%s] error %d reading audio-stream\n", __func__, error);
-			delete[] buf;
-			break;
+		if (video_spool != nullptr) {
+			video_spool->write_video_frame(frame_data, slot->size, slot->time);
+			spool_sound_buffers();
+			video_queue->release_slot(slot);
+			continue;
 		}
 
-		for (int i = 0; i < audio_ctx->frame_size * 2; i++) {
-			buf[i] = short(float(buf[i]) * 0.8f);
+		if (!video_governor->admit_frame()) {
+			video_queue->release_slot(slot);
+			continue;
 		}
 
-		// fwrite(buf, sizeof(short) * audio_ctx->frame_size * 2, 1, pa_dbg_samples_out);
+		const double frame_start_time = get_current_time();
 
-		{
-			pthread_mutex_lock(&sound_buffer_lock);
-			sound_buffers.push_back(buf);
-			pthread_mutex_unlock(&sound_buffer_lock);
+		AVFrame* picture = (video_chunks != nullptr)? video_chunks->next_frame(): yuv_picture;
+
+		if (picture == nullptr) {
+			// a chunk encoder was lost; finish still writes what the others encoded,
+			// but nothing drains the queue past here, so the swap hook must not wait on it
+			video_queue->abort_producer();
+			video_queue->release_slot(slot);
+			break;
 		}
-    }
-}
 
-void frame_recorder::encoding_thread_func() {
-	while (keep_running) {
-		allow_append = true;
-		pthread_cond_wait(&encode_cond, &encode_mutex);
+		if (frame_format == PIX_FMT_YUV420P) {
+			// already converted and flipped on the GPU
+			if (video_chunks != nullptr) {
+				memcpy(picture->data[0], frame_data, slot->size);
+			} else {
+				avpicture_fill((AVPicture*) picture, reinterpret_cast<uint8_t*>(frame_data), PIX_FMT_YUV420P, frame_width, frame_height);
+			}
+		} else {
+			const double t0 = get_current_time();
+
+			if (rgb_converter != nullptr) {
+				// flips the bottom-up rows as part of the conversion
+				rgb_converter->convert(reinterpret_cast<const uint8_t*>(frame_data), picture->data, picture->linesize);
+			} else {
+				// walk the bottom-up rows in reverse through a negative stride
+				uint8_t* src_planes[4] = {reinterpret_cast<uint8_t*>(&frame_data[(frame_height - 1) * frame_width * 4]), nullptr, nullptr, nullptr};
+				int src_strides[4] = {-frame_width * 4, 0, 0, 0};
+
+				sws_scale(img_convert_ctx, src_planes, src_strides, 0, frame_height, picture->data, picture->linesize);
+			}
 
-		if (!keep_running) {
-			printf("[%s] exiting\n", __func__);
-			break;
+			convert_time += (get_current_time() - t0);
+			frames_converted += 1;
 		}
 
+		// set time-index
+		picture->pts = int64_t(std::max(slot->time - clock_epoch, 0.0) * TIMEBASE);
+
+		assert(video_ctx != nullptr);
+		assert(picture != nullptr);
+
+		if (video_chunks != nullptr) {
+			video_chunks->submit_frame(picture);
+		} else {
+			if (encode_video_frame(picture) < 0) {
+				// nothing drains the queue past here, so the swap hook must not wait on it
+				video_queue->abort_producer();
+				video_queue->release_slot(slot);
+				return;
+			}
 
-		for (int y = 0; y < height; y++) {
-			const int old_idx = (                    y) * frame_width ;
-			const int new_idx = ((frame_height - 1 - y) * frame_width);
+			video_governor->update(get_current_time() - frame_start_time);
 
-	        memcpy(&rgb_picture->data[0][new_idx * 4], &frame_data[old_idx * 4], frame_width * 4);
+			if (video_governor->get_encoder_level() != encoder_level)
+				set_encoder_level(video_governor->get_encoder_level());
 		}
 
-        sws_scale(img_convert_ctx, rgb_picture->data, rgb_picture->linesize, 0, height, yuv_picture->data, yuv_picture->linesize);
+		printf("[%s] video-frame encoded\n", __func__);
 
-		AVPacket p;
-		av_init_packet(&p);
-		p.data = nullptr;
-		p.size = 0;
-		// set time-index
-		yuv_picture->pts = int64_t((curr_time - init_time) * TIMEBASE);
+		video_queue->release_slot(slot);
+	}
 
-		const uint64_t vpts = yuv_picture->pts;
-		int encode_status = 0;
+	if (video_chunks != nullptr) {
+		video_chunks->finish();
+	} else if (video_spool == nullptr && (encode_ctx->codec->capabilities & CODEC_CAP_DELAY) != 0) {
+		// drain frames still buffered inside the encoder (x264 lookahead)
+		while (encode_video_frame(nullptr) > 0);
+	}
 
-		assert(video_ctx != nullptr);
-		assert(yuv_picture != nullptr);
+	printf("[%s] session finished\n", __func__);
+}
 
-		if (avcodec_encode_video2(video_ctx, &p, yuv_picture, &encode_status) < 0)
-			return;
+void frame_recorder::audio_encoding_thread_func() {
+	AVFrame* audio_frame = avcodec_alloc_frame();
+	uint64_t session = 0;
 
-		if (encode_status != 0) {
-			// container is "mp4"
-			p.pts = vpts;
-			p.dts = AV_NOPTS_VALUE;
+	while (wait_for_session(&session)) {
+		// spooled sessions have their audio written by the video thread
+		if (audio_encoding)
+			encode_audio_session(audio_frame);
 
-			av_write_frame(format_ctx, &p);
-			av_free_packet(&p);
+		finish_session();
+	}
+
+	avcodec_free_frame(&audio_frame);
+	printf("[%s] exiting\n", __func__);
+}
+
+void frame_recorder::encode_audio_session(AVFrame* audio_frame) {
+	frame_slot* block = nullptr;
+
+	// deinterleaved copy of a frame for encoders that only take planar float (native aac, opus)
+	std::vector<float> planar_samples((audio_ctxs[0]->sample_fmt == AV_SAMPLE_FMT_FLTP)? audio_frame_samples * 2: 0);
+
+	double report_time = get_current_time();
+	int ret = 0;
+
+	// keeps draining queued blocks after keep_running is cleared
+	while ((block = audio_queue->front_slot(keep_running)) != nullptr) {
+		audio_clocks[block->source]->push_block(block->data, block->size / (2 * audio_gain::get_sample_size(audio_sample_format)), block->time);
+		audio_queue->release_slot(block);
+
+		if ((ret = encode_audio_frames(audio_frame, planar_samples, false)) < 0)
+			break;
+
+		if ((get_current_time() - report_time) >= SYNC_REPORT_INTERVAL) {
+			report_time = get_current_time();
+			print_sync_stats(__func__);
 		}
+	}
 
-		printf("[%s] video-frame encoded\n", __func__);
+	if (ret >= 0)
+		ret = encode_audio_frames(audio_frame, planar_samples, true);
 
+	if (ret < 0) {
+		fprintf(stderr, "[%s] could not encode audio\n", __func__);
+	} else {
+		for (size_t i = 0; i < audio_ctxs.size(); i++) {
+			// opus and aac hold back a frame or two
+			if ((audio_ctxs[i]->codec->capabilities & CODEC_CAP_DELAY) != 0)
+				while (encode_audio_frame(i, nullptr) > 0);
+		}
+	}
 
-		AVFrame* audio_frame = avcodec_alloc_frame();
+	printf("[%s] session finished\n", __func__);
+}
 
-		{
-			pthread_mutex_lock(&sound_buffer_lock);
+int frame_recorder::encode_audio_frames(AVFrame* audio_frame, std::vector<float>& planar_samples, bool flush) {
+	const void* samples = nullptr;
 
-			for (size_t i = 0, n = sound_buffers.size(); i < n; i++) {
-				const uint64_t apts = audio_samples_written;
+	int64_t pts = 0;
 
-				if (!audio_failed) {
-					avcodec_get_frame_defaults(audio_frame);
+	if (audio_mix != nullptr) {
+		while ((samples = audio_mix->mix_frame(&pts, flush)) != nullptr) {
+			if (encode_audio_samples(0, audio_frame, samples, pts, planar_samples) < 0)
+				return -1;
+		}
 
-					audio_frame->data[0] = reinterpret_cast<char*>(sound_buffers[i]);
-					audio_frame->nb_samples = audio_ctx->frame_size;
-					audio_frame->sample_rate = 44100;
-					audio_frame->channels = 2;
-					audio_frame->channel_layout = audio_ctx->channel_layout;
-					audio_frame->format = AV_SAMPLE_FMT_S16;
+		return 0;
+	}
 
-					audio_frame->pkt_pos = -1;
-					audio_frame->pts = apts;
+	for (size_t i = 0; i < audio_clocks.size(); i++) {
+		// fixed-size encoders get the last partial frame padded
+		if (flush)
+			audio_clocks[i]->pad_frame(audio_frame_samples);
 
-					av_init_packet(&p);
-					p.data = nullptr;
-					p.size = 0;
+		while ((samples = audio_clocks[i]->front_frame(audio_frame_samples, &pts)) != nullptr) {
+			if (encode_audio_samples(i, audio_frame, samples, pts, planar_samples) < 0)
+				return -1;
 
-					audio_samples_written += audio_ctx->frame_size;
-					avcodec_encode_audio2(audio_ctx, &p, audio_frame, &encode_status);
+			audio_clocks[i]->pop_frame(audio_frame_samples);
+		}
+	}
 
-					if (encode_status != 0) {
-						p.stream_index = 1;
-						p.flags |= AV_PKT_FLAG_KEY;
+	return 0;
+}
 
-						av_write_frame(format_ctx, &p);
-						av_free_packet(&p);
-					}
+int frame_recorder::encode_audio_samples(size_t track, AVFrame* audio_frame, const void* samples, int64_t pts, std::vector<float>& planar_samples) {
+	const size_t num_samples = audio_frame_samples;
+	const size_t sample_size = audio_gain::get_sample_size(audio_sample_format);
 
-					audio_samples_written += audio_ctx->frame_size;
-				}
+	avcodec_get_frame_defaults(audio_frame);
 
-				delete[] buf;
+	audio_frame->nb_samples = num_samples;
+	audio_frame->format = audio_ctxs[track]->sample_fmt;
+	audio_frame->channel_layout = audio_ctxs[track]->channel_layout;
+	audio_frame->pts = pts;
+
+	if (planar_samples.empty()) {
+		// queued in the encoder's own (packed) format
+		avcodec_fill_audio_frame(audio_frame, 2, audio_ctxs[track]->sample_fmt, reinterpret_cast<const uint8_t*>(samples), num_samples * 2 * sample_size, 1);
+	} else {
+		if (audio_sample_format == AUDIO_SAMPLE_FLOAT) {
+			const float* s = reinterpret_cast<const float*>(samples);
+
+			for (size_t i = 0; i < num_samples; i++) {
+				planar_samples[i              ] = s[i * 2 + 0];
+				planar_samples[i + num_samples] = s[i * 2 + 1];
 			}
+		} else {
+			const short* s = reinterpret_cast<const short*>(samples);
 
-			sound_buffers.clear();
+			for (size_t i = 0; i < num_samples; i++) {
+				planar_samples[i              ] = s[i * 2 + 0] * (1.0f / 32768.0f);
+				planar_samples[i + num_samples] = s[i * 2 + 1] * (1.0f / 32768.0f);
+			}
 		}
 
-		pthread_mutex_unlock(&sound_buffer_lock);
-		avcodec_free_frame(&audio_frame);
+		avcodec_fill_audio_frame(audio_frame, 2, AV_SAMPLE_FMT_FLTP, reinterpret_cast<const uint8_t*>(planar_samples.data()), num_samples * 2 * sizeof(float), 1);
 	}
+
+	return encode_audio_frame(track, audio_frame);
 }
 
+void frame_recorder::print_sync_stats(const char* caller) const {
+	for (size_t i = 0; i < audio_clocks.size(); i++) {
+		printf("[%s] \"%s\": A/V offset %+.2fms (max %.2fms), %lu samples dropped, %lu duplicated, %lu resyncs\n", caller,
+			audio_source_names[i].c_str(),
+			audio_clocks[i]->get_offset() * 1000.0,
+			audio_clocks[i]->get_max_offset() * 1000.0,
+			audio_clocks[i]->get_num_dropped(),
+			audio_clocks[i]->get_num_duplicated(),
+			audio_clocks[i]->get_num_resyncs()
+		);
+	}
+}
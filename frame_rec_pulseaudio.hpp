@@ -12,64 +12,190 @@ extern "C" {
 
 #include <atomic>
 #include <string>
-#include <unordered_map>
 #include <vector>
 
 #include <pulse/pulseaudio.h>
-#include <pulse/simple.h>
-
 
+#include "audio_gain.hpp"
+#include "audio_mix.hpp"
+#include "audio_sync.hpp"
+#include "buffer_pool.hpp"
+#include "chunk_enc.hpp"
+#include "frame_enc.hpp"
+#include "frame_queue.hpp"
+#include "packet_mux.hpp"
+#include "pulse_capture.hpp"
+#include "pulse_devices.hpp"
+#include "replay_ring.hpp"
+#include "spool_file.hpp"
+#include "yuv_convert.hpp"
+
+
+// recording engine for one capture size and format: its buffers, the
+// RGBA conversion and both encoding threads live as long as it does, so
+// toggling a recording only opens (and closes) encoders and the output
 class frame_recorder {
 public:
-    frame_recorder(const char* out_file, int width, int height);
+    frame_recorder(
+        int width,
+        int height,
+        int pix_fmt = PIX_FMT_RGBA,
+        int color_space = AVCOL_SPC_UNSPECIFIED,
+        int color_range = AVCOL_RANGE_UNSPECIFIED
+    );
     ~frame_recorder();
 
-    void append_frame(float time, int width, int height, char* data);
-    bool is_ready() const { return allow_append; }
+    // opens the encoders, <out_file> and the audio sources and hands them
+    // to the encoding threads; not called again before stop_session. false
+    // if the video encoder or <out_file> could not be opened, nothing is
+    // left open then and stop_session must not be called
+    bool start_session(const char* out_file);
+    // flushes the encoders, writes the trailer and closes everything
+    // start_session opened; the engine stays ready for the next session
+    void stop_session();
+
+    // called once at library load; keeps the PulseAudio device list current from then on
+    static void start_device_discovery();
+
+    // returns nullptr if the frame has to be dropped
+    frame_slot* acquire_frame() { return video_queue->acquire_slot(); }
+
+    void append_frame(frame_slot* slot, double time, int width, int height);
+    void cancel_frame(frame_slot* slot) { video_queue->cancel_slot(slot); }
+
+    int get_frame_width() const { return frame_width; }
+    int get_frame_height() const { return frame_height; }
+    int get_frame_format() const { return frame_format; }
+
+    // returns 1 if a packet was written, 0 if the encoder buffered the
+    // frame, -1 on error; a null frame flushes buffered ones
+    int encode_video_frame(AVFrame* frame);
+    // drains the current encoder and continues (at a keyframe) with one
+    // opened at <speed_level>; the governor is told if there is none
+    void set_encoder_level(int speed_level);
+    // same for audio track <track>, called from the audio encoding thread
+    int encode_audio_frame(size_t track, AVFrame* frame);
+    // encodes every full frame buffered in audio_clocks (or mixed by
+    // audio_mix); <flush> also encodes the padded remainder
+    int encode_audio_frames(AVFrame* frame, std::vector<float>& planar_samples, bool flush);
+    int encode_audio_samples(size_t track, AVFrame* frame, const void* samples, int64_t pts, std::vector<float>& planar_samples);
+    void print_sync_stats(const char* caller) const;
+    // to the replay ring in replay mode, otherwise queued for the muxer thread;
+    // called from both encoding threads
+    void write_packet(AVPacket* p);
+
+    // writes the replay ring to <file_name> in the background
+    void dump_replay(const char* file_name);
+    // writes queued audio blocks to video_spool as-is
+    void spool_sound_buffers();
 
     void encoding_thread_func();
-    void recording_thread_func();
+    void audio_encoding_thread_func();
 
 private:
-	pa_simple* audio_stream = nullptr;
+    // blocks until the next session starts, false once the recorder is deleted
+    bool wait_for_session(uint64_t* session);
+    // called by each encoding thread when it has flushed the session's encoders
+    void finish_session();
+    // frees the encoders, outputs and audio sources of the session
+    void close_session();
+    void discard_queued_slots();
+
+    void encode_video_session();
+    void encode_audio_session(AVFrame* audio_frame);
 
-	AVFrame* rgb_picture = nullptr;
+private:
 	AVFrame* yuv_picture = nullptr;
-	AVCodec* video_codec = nullptr;
-	AVCodec* audio_codec = nullptr;
 
+	// describes the video stream and encodes it at the configured settings
 	AVCodecContext* video_ctx = nullptr;
-	AVCodecContext* audio_ctx = nullptr;
+	// video_ctx, or the encoder that took over at another speed level
+	AVCodecContext* encode_ctx = nullptr;
+	video_encoder_params video_params;
+	// steps encode_ctx along cheaper settings to hold the per-frame encode budget
+	encode_governor* video_governor = nullptr;
+	// GOP-parallel encoders, used instead of video_ctx if SNAPSHOT_CHUNK_ENCODERS > 1
+	chunk_encoder* video_chunks = nullptr;
+	// replaces all of the above if SNAPSHOT_SPOOL is set
+	spool_writer* video_spool = nullptr;
+	// holds the last SNAPSHOT_REPLAY seconds of packets instead of writing format_ctx
+	replay_ring* video_replay = nullptr;
+	// writes format_ctx on a thread of its own unless in replay mode
+	packet_muxer* video_muxer = nullptr;
+	// one per track: a single one if sources are mixed, else one per source
+	std::vector<AVCodecContext*> audio_ctxs;
 	AVFormatContext* format_ctx = nullptr;
 
 	SwsContext* img_convert_ctx = nullptr;
+	// used instead of img_convert_ctx unless SNAPSHOT_CONVERTER=swscale
+	yuv_converter* rgb_converter = nullptr;
 
 	pthread_t encode_video_thread;
-	pthread_t record_sound_thread;
+	pthread_t encode_audio_thread;
+
+	pthread_mutex_t session_mutex;
+	// signalled when a session starts, when a thread is done with it, and on deletion
+	pthread_cond_t session_cond;
+
+	// backs the queued frames, the YUV picture and the audio blocks, and
+	// past session_pool_mark the current session's chunk encoder or replay ring
+	buffer_pool frame_pool;
+	frame_queue* video_queue = nullptr;
+	// blocks of audio_frame_samples interleaved stereo samples (in audio_sample_format)
+	// of every source, filled in place by audio_capture and tagged with their source
+	frame_queue* audio_queue = nullptr;
+	// read into (and discarded) when every block is queued
+	char* audio_scratch = nullptr;
+
+	pulse_capture* audio_capture = nullptr;
+	// combines audio_clocks into audio_ctxs[0] if there are more sources than tracks
+	audio_mixer* audio_mix = nullptr;
+
+	// per source: its gain, and the timestamping and drift correction of its blocks against clock_epoch
+	std::vector<audio_gain*> audio_volumes;
+	std::vector<audio_sync*> audio_clocks;
+	std::vector<std::string> audio_source_names;
 
-	pthread_mutex_t encode_mutex;
-	pthread_mutex_t sound_buffer_lock;
-	pthread_cond_t encode_cond;
+	size_t audio_samples_written = 0;
+	// audio_queue holds blocks of this many sources
+	size_t max_audio_sources = 1;
+	size_t session_pool_mark = 0;
 
-public:
-	std::vector<short*> sound_buffers;
-	std::unordered_map<std::string, std::string> monitor_sources;
-	std::string default_sink;
+	// counts started sessions; guarded by session_mutex, like the two below
+	uint64_t session_index = 0;
+	// encoding threads done with the current session
+	int num_threads_done = 0;
+	bool engine_running = true;
 
-private:
-	char* frame_data = nullptr;
+	// capture rate and samples per block, both set by the audio encoder
+	int audio_sample_rate = 44100;
+	int audio_frame_samples = 1024;
+	// of queued blocks: float if any source and the encoder are, else s16
+	int audio_sample_format = AUDIO_SAMPLE_S16;
 
-	size_t audio_samples_written = 0;
+	// capture (monotonic) time at which timestamps start
+	double clock_epoch = 0.0;
+	// total time spent in RGBA to YUV conversion
+	double convert_time = 0.0;
 
-	double init_time = -1.0;
-	double curr_time = -1.0;
+	uint64_t frames_converted = 0;
 
 	int frame_width = 0;
 	int frame_height = 0;
-
-	std::atomic<bool> allow_append = {false};
-	std::atomic<bool> keep_running = { true};
+	// PIX_FMT_RGBA (bottom-up) or PIX_FMT_YUV420P (top-down, converted on the GPU)
+	int frame_format = PIX_FMT_RGBA;
+	int frame_color_space = AVCOL_SPC_UNSPECIFIED;
+	int frame_color_range = AVCOL_RANGE_UNSPECIFIED;
+	// speed level encode_ctx was opened at
+	int encoder_level = 0;
+
+	// cleared to make the encoding threads drain and flush the session
+	std::atomic<bool> keep_running = {false};
 	std::atomic<bool> audio_failed = {false};
+
+	// set if encode_audio_thread encodes this session (not when spooling)
+	bool audio_encoding = false;
+	bool session_active = false;
 };
 
 #endif
@@ -0,0 +1,180 @@
+#include <dlfcn.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include "game_clock.hpp"
+#include "rec_config.hpp"
+
+static const char* fixed_fps_env_var = "SNAPSHOT_FIXED_FPS";
+
+typedef int (*clock_gettime_func)(clockid_t, struct timespec*);
+
+// the real dlsym, found by lib_main's initialize
+extern void* (*dlsymPtr)(void*, const char*);
+
+// libc's clock_gettime behind our own; nullptr until init_game_clock
+static clock_gettime_func real_clock_gettime_ptr = nullptr;
+
+// swaps since the clock was fixed; all virtual clocks derive from it
+static std::atomic<uint64_t> game_steps = {0};
+
+static int game_fps = 0;
+static bool game_clock_fixed = false;
+
+// real clocks (ns) at the time the clock was fixed
+static int64_t monotonic_base = 0;
+static int64_t realtime_base = 0;
+
+
+
+static int64_t timespec_to_ns(const struct timespec& t) {
+	return (int64_t(t.tv_sec) * 1000000000LL + t.tv_nsec);
+}
+
+static int64_t real_clock_ns(clockid_t clock_id) {
+	struct timespec t;
+	real_clock_gettime(clock_id, &t);
+
+	return (timespec_to_ns(t));
+}
+
+// exact multiple of 1/fps, so no rounding error accumulates over a recording
+static int64_t game_elapsed_ns() {
+	return (int64_t(game_steps.load(std::memory_order_acquire) * 1000000000ULL / game_fps));
+}
+
+// the virtual time of <clock_id>, false for clocks that are not virtualized (CPU time)
+static bool game_clock_ns(clockid_t clock_id, int64_t* ns) {
+	switch (clock_id) {
+		case CLOCK_MONOTONIC:
+		case CLOCK_MONOTONIC_RAW:
+		case CLOCK_MONOTONIC_COARSE:
+		case CLOCK_BOOTTIME:
+			*ns = monotonic_base + game_elapsed_ns();
+			return true;
+
+		case CLOCK_REALTIME:
+		case CLOCK_REALTIME_COARSE:
+		case CLOCK_TAI:
+			*ns = realtime_base + game_elapsed_ns();
+			return true;
+
+		default:
+			break;
+	}
+
+	return false;
+}
+
+
+
+int get_config_fixed_fps() {
+	return (std::max(get_config_int(fixed_fps_env_var, 0), 0));
+}
+
+void init_game_clock(int fps) {
+	if (dlsymPtr != nullptr)
+		real_clock_gettime_ptr = reinterpret_cast<clock_gettime_func>(dlsymPtr(RTLD_NEXT, "clock_gettime"));
+
+	if (fps <= 0)
+		return;
+
+	monotonic_base = real_clock_ns(CLOCK_MONOTONIC);
+	realtime_base = real_clock_ns(CLOCK_REALTIME);
+
+	game_fps = fps;
+	game_clock_fixed = true;
+
+	printf("[%s] fixed-timestep mode, game time advances %.3fms per frame\n", __func__, 1000.0 / fps);
+}
+
+bool is_game_clock_fixed() {
+	return game_clock_fixed;
+}
+
+void step_game_clock() {
+	if (game_clock_fixed)
+		game_steps.fetch_add(1, std::memory_order_release);
+}
+
+double get_game_time() {
+	const int64_t ns = game_clock_fixed? (monotonic_base + game_elapsed_ns()): real_clock_ns(CLOCK_MONOTONIC);
+
+	return (ns / 1000000000.0);
+}
+
+int real_clock_gettime(clockid_t clock_id, struct timespec* t) {
+	if (real_clock_gettime_ptr != nullptr)
+		return (real_clock_gettime_ptr(clock_id, t));
+
+	// only before the library is initialized
+	return (syscall(SYS_clock_gettime, clock_id, t));
+}
+
+
+
+extern "C" {
+	__attribute__((visibility("default")))
+	int clock_gettime(clockid_t clock_id, struct timespec* t) {
+		int64_t ns = 0;
+
+		if (!game_clock_fixed || !game_clock_ns(clock_id, &ns))
+			return (real_clock_gettime(clock_id, t));
+
+		t->tv_sec = ns / 1000000000LL;
+		t->tv_nsec = ns % 1000000000LL;
+		return 0;
+	}
+
+	__attribute__((visibility("default")))
+	int gettimeofday(struct timeval* tv, void* /*tz*/) {
+		// the time zone argument is obsolete, glibc ignores it as well
+		const int64_t ns = game_clock_fixed? (realtime_base + game_elapsed_ns()): real_clock_ns(CLOCK_REALTIME);
+
+		if (tv != nullptr) {
+			tv->tv_sec = ns / 1000000000LL;
+			tv->tv_usec = (ns % 1000000000LL) / 1000;
+		}
+
+		return 0;
+	}
+
+	__attribute__((visibility("default")))
+	time_t time(time_t* t) {
+		const int64_t ns = game_clock_fixed? (realtime_base + game_elapsed_ns()): real_clock_ns(CLOCK_REALTIME);
+		const time_t secs = ns / 1000000000LL;
+
+		if (t != nullptr)
+			*t = secs;
+
+		return secs;
+	}
+}
+
+
+void* get_game_clock_hook(const char* name) {
+	if (!game_clock_fixed)
+		return nullptr;
+
+	// SDL_GetTicks, SDL_GetPerformanceCounter (and most engines' timers)
+	// read CLOCK_MONOTONIC(_RAW) through libc, so they follow the clocks
+	// above without hooks of their own, on the same epoch SDL stamps its
+	// events with
+	if (strcmp(name, "clock_gettime") == 0)
+		return reinterpret_cast<void*>(&clock_gettime);
+	if (strcmp(name, "gettimeofday") == 0)
+		return reinterpret_cast<void*>(&gettimeofday);
+	if (strcmp(name, "time") == 0)
+		return reinterpret_cast<void*>(&time);
+
+	return nullptr;
+}
+
@@ -0,0 +1,38 @@
+#ifndef GAME_CLOCK_HDR
+#define GAME_CLOCK_HDR
+
+#include <ctime>
+
+
+// fixed-timestep (offline) rendering: with SNAPSHOT_FIXED_FPS set, the
+// process's clocks (clock_gettime, gettimeofday and time, and through
+// them SDL's tick and performance counters) are virtualized and advance
+// by exactly 1/fps per glXSwapBuffers, however long the frame took to
+// render and record. games that busy-wait on the clock for a frame
+// limiter set below that rate never see it advance, so limiters must be
+// off (or above the fixed rate)
+
+// reads SNAPSHOT_FIXED_FPS (0 disables)
+int get_config_fixed_fps();
+
+// called once at library load, before any hook is handed out
+void init_game_clock(int fps);
+
+bool is_game_clock_fixed();
+
+// called once per swap, after the frame was captured
+void step_game_clock();
+
+// capture time in seconds on the monotonic clock; the game's (virtual)
+// time in fixed-timestep mode, the real time otherwise
+double get_game_time();
+
+// the real clock, for our own timing (never virtualized)
+int real_clock_gettime(clockid_t clock_id, struct timespec* t);
+
+// hook for the time source <name>, or nullptr if it is none (or the
+// clock is not fixed); for dlsym lookups of the game
+void* get_game_clock_hook(const char* name);
+
+#endif
+
@@ -1,5 +1,9 @@
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <vector>
 
+#include <cstddef>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -22,6 +26,7 @@
 #undef XNextEvent
 
 #include "frame_recorder.hpp"
+#include "game_clock.hpp"
 
 
 #define DL_DECLSYM(s) if (strcmp(__name, #s) == 0) { return &s; }
@@ -32,6 +37,9 @@
 
 static const char* gl_lib_name = "libGL.so.1";
 static const char* dir_env_var = "SNAPSHOT_DIR";
+static const char* pbo_env_var = "SNAPSHOT_PBO_RING";
+static const char* yuv_env_var = "SNAPSHOT_YUV";
+static const char* scale_env_var = "SNAPSHOT_SCALE";
 static const char* output_file = "snapshot.out";
 
 static frame_recorder* curr_recorder = nullptr;
@@ -40,27 +48,252 @@ extern char* program_invocation_name;
 
 static void* gl_lib = nullptr;
 
-static char* frame_data = nullptr;
-
 static GLint cap_tex = 0;
 static GLint render_tex = 0;
-static GLint program = 0;
-static GLint viewport[4] = {0, 0, 0, 0};
 
 
+// game state changed by a frame's capture passes and overlay, saved by
+// enter_overlay_context and put back by leave_overlay_context
+struct overlay_saved_state {
+	GLint viewport[4];
+	GLint program;
+	GLint active_texture;
+	GLint texture_2d;
+	GLint pack_alignment;
+	GLint pack_buffer;
+	GLint draw_framebuffer;
+	GLint read_framebuffer;
+	// negative if not saved (and not changed) this frame
+	GLint vertex_array;
+	GLint array_buffer;
+
+	GLboolean color_mask[4];
+	// front and back, if glPolygonMode is available
+	GLint polygon_mode[2];
+	// by pass_caps index
+	GLboolean caps[5];
+
+	// set if the capture (or pass) state above was saved
+	bool capture;
+	bool pass;
+};
+
+static overlay_saved_state saved_state;
+
+// switched off for the capture passes and the overlay (if on), and
+// back on after them
+static const std::array<GLenum, 5> pass_caps = {{
+	GL_DEPTH_TEST,
+	GL_STENCIL_TEST,
+	GL_SCISSOR_TEST,
+	GL_CULL_FACE,
+	GL_BLEND,
+}};
+
+
+// framerate overlay: seven-segment digits as colored triangles in a VBO,
+// rebuilt only when the number changes and drawn in a single call
+struct overlay_vertex {
+	float x, y;
+	float r, g, b;
+};
+
+static std::vector<overlay_vertex> overlay_vertices;
+
+static GLuint overlay_program = 0;
+static GLuint overlay_vao = 0;
+static GLuint overlay_vbo = 0;
+
+// what overlay_vbo currently holds
+static int overlay_fps = -1;
+static int overlay_width = 0;
+static int overlay_height = 0;
+static bool overlay_recording = false;
+
+#define SEGW 10.0f
+#define SEGH 30.0f
+
+// x, y, width and height of segments A (top left) to G (bottom right) at scale 1
+static const float overlay_segments[7][4] = {
+	{0.0f, 0.0f                , SEGW       , SEGH},
+	{0.0f, 0.0f                , SEGH + SEGW, SEGW},
+	{SEGH, 0.0f                , SEGW       , SEGH},
+	{0.0f, SEGH - SEGW * 0.5f  , SEGH + SEGW, SEGW},
+	{0.0f, SEGH                , SEGW       , SEGH},
+	{0.0f, SEGH * 2.0f - SEGW  , SEGH + SEGW, SEGW},
+	{SEGH, SEGH                , SEGW       , SEGH},
+};
+
+// lit segments per digit, bit i for segment A + i
+static const uint8_t overlay_digit_segments[10] = {
+	0x77, 0x44, 0x3E, 0x6E, 0x4D, 0x6B, 0x7B, 0x47, 0x7F, 0x6F,
+};
+
+static const char* overlay_vert_shader_src =
+	"#version 130\n"
+	"in vec2 position;\n"
+	"in vec3 color;\n"
+	"out vec3 frag_rgb;\n"
+	"\n"
+	"void main() {\n"
+	"	frag_rgb = color;\n"
+	"	gl_Position = vec4(position, 0.0, 1.0);\n"
+	"}\n";
+
+static const char* overlay_frag_shader_src =
+	"#version 130\n"
+	"in vec3 frag_rgb;\n"
+	"out vec4 frag_color;\n"
+	"\n"
+	"void main() {\n"
+	"	frag_color = vec4(frag_rgb, 1.0);\n"
+	"}\n";
+
+
+// asynchronous readback; each slot holds one frame in flight
+// between glGetTexImage (into the PBO) and its CPU-side mapping
+struct pbo_slot {
+	GLuint pbo;
+	GLsync fence;
+
+	size_t size;
+
+	// swap time of the frame in flight
+	double time;
+
+	int width;
+	int height;
+};
+
+static std::array<pbo_slot, 8> pbo_ring;
+
+// zero selects the synchronous glGetTexImage path
+static unsigned int pbo_ring_size = 3;
+static unsigned int pbo_ring_head = 0; // next slot to issue a readback into
+static unsigned int pbo_ring_tail = 0; // oldest slot with a readback in flight
+
+// nanoseconds per fence wait when a fixed-timestep capture waits for a readback
+#define PBO_WAIT_TIMEOUT 100000000ULL
+
+
+// downscaling blit target; cap_tex is attached when the
+// capture size differs from the drawable size
+static GLuint scale_fbo = 0;
+
+static int cap_tex_width = 0;
+static int cap_tex_height = 0;
+
+// fixed output size ("WxH") or a factor applied to the drawable size
+static int scale_width = 0;
+static int scale_height = 0;
+static float scale_factor = 1.0f;
+
+
+// RGBA to planar YUV420 conversion pass; the R8 target holds the
+// Y, U and V planes back to back (top-down) as the encoder expects
+static GLuint yuv_fbo = 0;
+static GLuint yuv_tex = 0;
+static GLuint yuv_program = 0;
+
+static GLint yuv_src_size_loc = -1;
+
+static int yuv_tex_width = 0;
+static int yuv_tex_height = 0;
+static int yuv_color_space = AVCOL_SPC_UNSPECIFIED;
+static int yuv_color_range = AVCOL_RANGE_UNSPECIFIED;
+
+// luma weights of the selected matrix
+static float yuv_kr = 0.0f;
+static float yuv_kb = 0.0f;
+
+static bool yuv_capture = false;
+
+// one triangle covering the viewport, made up from gl_VertexID alone
+static const char* fullscreen_vert_shader_src =
+	"#version 130\n"
+	"\n"
+	"void main() {\n"
+	"	vec2 p = vec2(float((gl_VertexID & 1) << 2), float((gl_VertexID & 2) << 1));\n"
+	"	gl_Position = vec4(p - 1.0, 0.0, 1.0);\n"
+	"}\n";
+
+// bound (without any arrays) for the vertex-less YUV pass
+static GLuint fullscreen_vao = 0;
+
+static const char* yuv_frag_shader_src =
+	"#version 130\n"
+	"uniform sampler2D src_tex;\n"
+	"uniform ivec2 src_size;\n"
+	"uniform vec4 y_coeffs;\n"
+	"uniform vec4 u_coeffs;\n"
+	"uniform vec4 v_coeffs;\n"
+	"\n"
+	"vec3 fetch_rgb(int x, int y) {\n"
+	"	// source is bottom-up, output planes are top-down\n"
+	"	return (texelFetch(src_tex, ivec2(x, src_size.y - 1 - y), 0).rgb);\n"
+	"}\n"
+	"\n"
+	"void main() {\n"
+	"	int w = src_size.x;\n"
+	"	int h = src_size.y;\n"
+	"	int cw = w / 2;\n"
+	"	int y_size = w * h;\n"
+	"	int c_size = y_size / 4;\n"
+	"	int ofs = int(gl_FragCoord.y) * w + int(gl_FragCoord.x);\n"
+	"\n"
+	"	vec3 rgb;\n"
+	"	vec4 coeffs;\n"
+	"\n"
+	"	if (ofs < y_size) {\n"
+	"		rgb = fetch_rgb(ofs % w, ofs / w);\n"
+	"		coeffs = y_coeffs;\n"
+	"	} else {\n"
+	"		int c = ofs - y_size;\n"
+	"		bool v = (c >= c_size);\n"
+	"\n"
+	"		c -= (v? c_size: 0);\n"
+	"\n"
+	"		int x = (c % cw) * 2;\n"
+	"		int y = (c / cw) * 2;\n"
+	"\n"
+	"		rgb  = fetch_rgb(x, y    ) + fetch_rgb(x + 1, y    );\n"
+	"		rgb += fetch_rgb(x, y + 1) + fetch_rgb(x + 1, y + 1);\n"
+	"		rgb *= 0.25;\n"
+	"		coeffs = (v? v_coeffs: u_coeffs);\n"
+	"	}\n"
+	"\n"
+	"	gl_FragColor = vec4(dot(rgb, coeffs.rgb) + coeffs.a, 0.0, 0.0, 1.0);\n"
+	"}\n";
+
+
+// drawables are re-queried at least this often, for games whose event
+// loop never sees (or never selects) ConfigureNotify
+#define DRAWABLE_REFRESH_FRAMES 120
 
 static int frame_width = 0;
 static int frame_height = 0;
 
+// the drawable frame_width and frame_height were queried for, and when
+static void* sized_drawable = nullptr;
+static uint64_t drawable_query_frame = 0;
+// set by XNextEvent on ConfigureNotify, possibly on another thread
+static std::atomic<bool> drawable_size_stale = {true};
+
 static uint64_t frame_counter = 0;
 static uint64_t last_event_frame = 0;
 
 static double last_frame_time = 0.0;
+// capture time of the frame being swapped
+static double swap_time = 0.0;
 
 static bool recording = false;
 static bool lib_inited = false;
 static bool first_frame = true;
 
+// size of the frames handed to the recorder
+static int capture_width = 0;
+static int capture_height = 0;
+
 
 static std::array<double, 16> framerate_hist = {{
 	0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
@@ -69,6 +302,34 @@ static std::array<double, 16> framerate_hist = {{
 
 static pthread_mutex_t record_mutex;
 
+// sessions are started (device lookup, codecs, container header) and
+// stopped (encoder flush, trailer) on a thread of their own; the hooks only
+// queue requests and pick up a started recorder, so F12 never stalls the
+// render thread. the recorder itself is kept across sessions and only
+// rebuilt when the capture size or format changes
+static pthread_t session_thread;
+static pthread_mutex_t session_mutex;
+static pthread_cond_t session_cond;
+
+// requests, guarded by session_mutex
+static bool session_start = false;
+static int session_width = 0;
+static int session_height = 0;
+static std::vector<frame_recorder*> session_stops;
+
+// owned by session_thread
+static frame_recorder* session_recorder = nullptr;
+
+// set by session_thread, installed as curr_recorder by the next glXSwapBuffers
+static std::atomic<frame_recorder*> ready_recorder = {nullptr};
+// a start was requested and its recorder not installed yet
+static std::atomic<bool> session_starting = {false};
+// the replay session could not be started, so it is not retried every frame
+static std::atomic<bool> replay_start_failed = {false};
+
+// SNAPSHOT_REPLAY; if set the recorder runs from the first frame on and F12 dumps its replay ring
+static double replay_seconds = 0.0;
+
 
 
 size_t strftime_c(char* s, const char* format, size_t max)
@@ -78,11 +339,119 @@ size_t strftime_c(char* s, const char* format, size_t max)
 	return strftime(s, max, format, tmp);
 }
 
+static void make_output_filename(char* filename, size_t size, const char* suffix) {
+	const char* output_dir = getenv(dir_env_var);
+	char filedate[512];
+
+	strftime_c(filedate, "%F %r", sizeof(filedate) - 1);
+
+	if (output_dir != nullptr && strlen(output_dir) > 0)
+		snprintf(filename, size, "%s/%s-%s%s.avi", output_dir, output_file, filedate, suffix);
+	else
+		snprintf(filename, size, "./%s-%s%s.avi", output_file, filedate, suffix);
+}
+
+// nullptr if the session could not be started
+static frame_recorder* start_recorder_session(int width, int height) {
+	const int pix_fmt = yuv_capture? PIX_FMT_YUV420P: PIX_FMT_RGBA;
+
+	bool same_format = (session_recorder != nullptr);
+
+	same_format = same_format && (session_recorder->get_frame_width() == width);
+	same_format = same_format && (session_recorder->get_frame_height() == height);
+	same_format = same_format && (session_recorder->get_frame_format() == pix_fmt);
+
+	if (!same_format) {
+		delete session_recorder;
+
+		session_recorder = new frame_recorder(
+			width,
+			height,
+			pix_fmt,
+			yuv_color_space,
+			yuv_color_range
+		);
+	}
+
+	char filename[1024];
+
+	make_output_filename(filename, sizeof(filename), "");
+	if (!session_recorder->start_session(filename))
+		return nullptr;
+
+	return session_recorder;
+}
+
+// the capture clock every frame and audio block is stamped with; monotonic
+// so wall-clock adjustments (NTP, suspend) never shift one against the other.
+// always the real clock, even when the game's is virtualized
 double get_current_time() {
-	struct timeval t;
-	gettimeofday(&t, nullptr);
+	struct timespec t;
+	real_clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return (t.tv_sec + t.tv_nsec / 1000000000.0);
+}
+
+
+static void* session_thread_func(void*) {
+	pthread_mutex_lock(&session_mutex);
+
+	while (true) {
+		while (!session_start && session_stops.empty())
+			pthread_cond_wait(&session_cond, &session_mutex);
+
+		std::vector<frame_recorder*> stops;
+		stops.swap(session_stops);
+
+		const bool start = session_start;
+		const int width = session_width;
+		const int height = session_height;
+
+		session_start = false;
+		pthread_mutex_unlock(&session_mutex);
+
+		// the previous session lets go of its devices and file first
+		for (frame_recorder* recorder: stops)
+			recorder->stop_session();
+
+		if (start) {
+			const double start_time = get_current_time();
 
-	return (t.tv_sec + t.tv_usec / 1000000.0);
+			frame_recorder* recorder = start_recorder_session(width, height);
+
+			if (recorder != nullptr) {
+				ready_recorder = recorder;
+				printf("[%s] session started in %.1fms\n", __func__, (get_current_time() - start_time) * 1000.0);
+			} else {
+				fprintf(stderr, "[%s] could not start session\n", __func__);
+				replay_start_failed = (replay_seconds > 0.0);
+				// nothing to install; outside replay mode F12 may try again
+				session_starting = false;
+			}
+		}
+
+		pthread_mutex_lock(&session_mutex);
+	}
+
+	return nullptr;
+}
+
+static void request_session_start() {
+	session_starting = true;
+
+	pthread_mutex_lock(&session_mutex);
+	session_start = true;
+	session_width = capture_width;
+	session_height = capture_height;
+	pthread_cond_signal(&session_cond);
+	pthread_mutex_unlock(&session_mutex);
+}
+
+static void request_session_stop(frame_recorder* recorder) {
+	pthread_mutex_lock(&session_mutex);
+	session_stops.push_back(recorder);
+	pthread_cond_signal(&session_cond);
+	pthread_mutex_unlock(&session_mutex);
 }
 
 
@@ -98,10 +467,6 @@ void (*glCreateProgramObjectPtr)() = nullptr;
 void (*glCompileShaderPtr)(int) = nullptr;
 void (*glAttachObjectARBPtr)(int, int) = nullptr;
 int (*glCreateShaderPtr)(int) = nullptr;
-void (*glPushAttribPtr)(int) = nullptr;
-void (*glPushClientAttribPtr)(int) = nullptr;
-void (*glPopAttribPtr)() = nullptr;
-void (*glPopClientAttribPtr)() = nullptr;
 void (*glEnablePtr)(int) = nullptr;
 void (*glDisablePtr)(int) = nullptr;
 void (*glShaderSourcePtr)(int, unsigned int, const char**, const int*) = nullptr;
@@ -115,26 +480,45 @@ void* (*dlsymPtr)(void*, const char*) = nullptr;
 
 void (*glGetIntegervPtr)(int, void*) = nullptr;
 void (*glViewportPtr)(int, int, int, int) = nullptr;
-void (*glRenderModePtr)(int) = nullptr;
-void (*glDisableClientStatePtr)(int) = nullptr;
 void (*glActiveTexturePtr)(int) = nullptr;
-void (*glMatrixModePtr)(int) = nullptr;
-void (*glPushMatrixPtr)() = nullptr;
-void (*glLoadIdentityPtr)() = nullptr;
-void (*glOrthoPtr)(GLdouble, GLdouble, GLdouble, GLdouble, GLdouble, GLdouble) = nullptr;
-void (*glPopMatrixPtr)() = nullptr;
-void (*glPolygonModePtr)(GLenum, GLenum) = nullptr;
-void (*glColor3fPtr)(GLfloat, GLfloat, GLfloat) = nullptr;
-void (*glBeginPtr)(GLenum) = nullptr;
-void (*glEndPtr)() = nullptr;
-void (*glVertex3fPtr)(GLfloat, GLfloat, GLfloat) = nullptr;
 void (*glGenTexturesPtr)(GLsizei, GLuint*) = nullptr;
 void (*glBindTexturePtr)(GLenum, GLint) = nullptr;
 void (*glCopyTexImage2DPtr)(GLenum, GLint, GLenum, GLint, GLint, GLsizei, GLsizei, GLint) = nullptr;
 void (*glPixelStoreiPtr)(GLenum, GLint) = nullptr;
 void (*glGetTexImagePtr)(GLenum, GLint, GLenum, GLenum, GLvoid*) = nullptr;
-void (*glColor4fPtr)(GLfloat, GLfloat, GLfloat, GLfloat) = nullptr;
-void (*glDrawBufferPtr)(GLenum) = nullptr;
+void (*glGenBuffersPtr)(GLsizei, GLuint*) = nullptr;
+void (*glBindBufferPtr)(GLenum, GLuint) = nullptr;
+void (*glBufferDataPtr)(GLenum, GLsizeiptr, const GLvoid*, GLenum) = nullptr;
+void* (*glMapBufferPtr)(GLenum, GLenum) = nullptr;
+GLboolean (*glUnmapBufferPtr)(GLenum) = nullptr;
+GLsync (*glFenceSyncPtr)(GLenum, GLbitfield) = nullptr;
+GLenum (*glClientWaitSyncPtr)(GLsync, GLbitfield, GLuint64) = nullptr;
+void (*glDeleteSyncPtr)(GLsync) = nullptr;
+void (*glGenFramebuffersPtr)(GLsizei, GLuint*) = nullptr;
+void (*glBindFramebufferPtr)(GLenum, GLuint) = nullptr;
+void (*glFramebufferTexture2DPtr)(GLenum, GLenum, GLenum, GLuint, GLint) = nullptr;
+GLenum (*glCheckFramebufferStatusPtr)(GLenum) = nullptr;
+void (*glTexImage2DPtr)(GLenum, GLint, GLint, GLsizei, GLsizei, GLint, GLenum, GLenum, const GLvoid*) = nullptr;
+void (*glTexParameteriPtr)(GLenum, GLenum, GLint) = nullptr;
+void (*glReadPixelsPtr)(GLint, GLint, GLsizei, GLsizei, GLenum, GLenum, GLvoid*) = nullptr;
+GLuint (*glCreateProgramPtr)() = nullptr;
+void (*glAttachShaderPtr)(GLuint, GLuint) = nullptr;
+void (*glGetProgramivPtr)(GLuint, GLenum, GLint*) = nullptr;
+GLint (*glGetUniformLocationPtr)(GLuint, const char*) = nullptr;
+void (*glUniform1iPtr)(GLint, GLint) = nullptr;
+void (*glUniform2iPtr)(GLint, GLint, GLint) = nullptr;
+void (*glBlitFramebufferPtr)(GLint, GLint, GLint, GLint, GLint, GLint, GLint, GLint, GLbitfield, GLenum) = nullptr;
+GLboolean (*glIsEnabledPtr)(GLenum) = nullptr;
+void (*glGetBooleanvPtr)(GLenum, GLboolean*) = nullptr;
+void (*glColorMaskPtr)(GLboolean, GLboolean, GLboolean, GLboolean) = nullptr;
+void (*glPolygonModePtr)(GLenum, GLenum) = nullptr;
+void (*glDrawArraysPtr)(GLenum, GLint, GLsizei) = nullptr;
+void (*glGenVertexArraysPtr)(GLsizei, GLuint*) = nullptr;
+void (*glBindVertexArrayPtr)(GLuint) = nullptr;
+void (*glVertexAttribPointerPtr)(GLuint, GLint, GLenum, GLboolean, GLsizei, const GLvoid*) = nullptr;
+void (*glEnableVertexAttribArrayPtr)(GLuint) = nullptr;
+void (*glBindAttribLocationPtr)(GLuint, GLuint, const char*) = nullptr;
+void (*glBindFragDataLocationPtr)(GLuint, GLuint, const char*) = nullptr;
 
 
 
@@ -150,9 +534,19 @@ __attribute__((constructor)) void initialize() {
 		return;
 
 	pthread_mutex_init(&record_mutex, nullptr);
+	pthread_mutex_init(&session_mutex, nullptr);
+	pthread_cond_init(&session_cond, nullptr);
 	av_register_all();
 	avcodec_register_all();
 
+	// SNAPSHOT_FIXED_FPS; fixed-timestep captures record no audio
+	const int fixed_fps = get_config_fixed_fps();
+
+	// devices are known (and kept current) long before the first F12
+	if (fixed_fps <= 0)
+		frame_recorder::start_device_discovery();
+	pthread_create(&session_thread, nullptr, session_thread_func, nullptr);
+
 
 	void* libdl_handle = dlopen("libdl.so.2", RTLD_LAZY);
 	struct link_map* link_map = libdl_handle;
@@ -193,6 +587,9 @@ __attribute__((constructor)) void initialize() {
 		break;
 	}
 
+	// resolves the real clocks through dlsym, before any game code runs
+	init_game_clock(fixed_fps);
+
 	if ((gl_lib = dlopen(gl_lib_name, RTLD_LAZY)) == nullptr) {
 		printf("[%s] cannot load %s\n", __func__, gl_lib_name);
 		abort();
@@ -210,10 +607,6 @@ __attribute__((constructor)) void initialize() {
 	glCreateShaderPtr = dlsymPtr(gl_lib, "glCreateShader");
 	glXGetProcAddressPtr = dlsymPtr(gl_lib, "glXGetProcAddress");
 	glXSwapBuffersPtr = dlsymPtr(gl_lib, "glXSwapBuffers");
-	glPushAttribPtr = dlsymPtr(gl_lib, "glPushAttrib");
-	glPushClientAttribPtr = dlsymPtr(gl_lib, "glPushClientAttrib");
-	glPopAttribPtr = dlsymPtr(gl_lib, "glPopAttrib");
-	glPopClientAttribPtr = dlsymPtr(gl_lib, "glPopClientAttrib");
 	glEnablePtr = dlsymPtr(gl_lib, "glEnable");
 	glDisablePtr = dlsymPtr(gl_lib, "glDisable");
 	glXQueryDrawablePtr = dlsymPtr(gl_lib, "glXQueryDrawable");
@@ -222,330 +615,610 @@ __attribute__((constructor)) void initialize() {
 	#define getprocaddr(f) f##Ptr = dlsymPtr(gl_lib, #f)
 	getprocaddr(glGetIntegerv);
 	getprocaddr(glViewport);
-	getprocaddr(glRenderMode);
-	getprocaddr(glDisableClientState);
 	getprocaddr(glActiveTexture);
-	getprocaddr(glMatrixMode);
-	getprocaddr(glLoadIdentity);
-	getprocaddr(glOrtho);
-	getprocaddr(glPushMatrix);
-	getprocaddr(glPopMatrix);
-	getprocaddr(glPolygonMode);
-	getprocaddr(glColor3f);
-	getprocaddr(glBegin);
-	getprocaddr(glEnd);
-	getprocaddr(glVertex3f);
 	getprocaddr(glGenTextures);
 	getprocaddr(glBindTexture);
 	getprocaddr(glCopyTexImage2D);
 	getprocaddr(glPixelStorei);
 	getprocaddr(glGetTexImage);
-	getprocaddr(glColor4f);
-	getprocaddr(glDrawBuffer);
+	getprocaddr(glGenBuffers);
+	getprocaddr(glBindBuffer);
+	getprocaddr(glBufferData);
+	getprocaddr(glMapBuffer);
+	getprocaddr(glUnmapBuffer);
+	getprocaddr(glFenceSync);
+	getprocaddr(glClientWaitSync);
+	getprocaddr(glDeleteSync);
+	getprocaddr(glGenFramebuffers);
+	getprocaddr(glBindFramebuffer);
+	getprocaddr(glFramebufferTexture2D);
+	getprocaddr(glCheckFramebufferStatus);
+	getprocaddr(glTexImage2D);
+	getprocaddr(glTexParameteri);
+	getprocaddr(glReadPixels);
+	getprocaddr(glCompileShader);
+	getprocaddr(glCreateProgram);
+	getprocaddr(glAttachShader);
+	getprocaddr(glGetProgramiv);
+	getprocaddr(glGetUniformLocation);
+	getprocaddr(glUniform1i);
+	getprocaddr(glUniform2i);
+	getprocaddr(glBlitFramebuffer);
+	getprocaddr(glIsEnabled);
+	getprocaddr(glGetBooleanv);
+	getprocaddr(glColorMask);
+	getprocaddr(glPolygonMode);
+	getprocaddr(glDrawArrays);
+	getprocaddr(glGenVertexArrays);
+	getprocaddr(glBindVertexArray);
+	getprocaddr(glVertexAttribPointer);
+	getprocaddr(glEnableVertexAttribArray);
+	getprocaddr(glBindAttribLocation);
+	getprocaddr(glBindFragDataLocation);
 	#undef getprocaddr
 
+	{
+		const char* pbo_env = getenv(pbo_env_var);
+
+		if (pbo_env != nullptr)
+			pbo_ring_size = std::min(static_cast<unsigned int>(std::max(atoi(pbo_env), 0)), static_cast<unsigned int>(pbo_ring.size()));
+
+		// fences need GL 3.2 or ARB_sync
+		if (glFenceSyncPtr == nullptr || glClientWaitSyncPtr == nullptr || glMapBufferPtr == nullptr)
+			pbo_ring_size = 0;
+
+		printf("[%s] PBO readback ring depth %u\n", __func__, pbo_ring_size);
+	}
+	{
+		const char* yuv_env = getenv(yuv_env_var);
+
+		// "bt601" or "bt709", optionally suffixed by "-full" for JPEG-range output
+		if (yuv_env != nullptr && strlen(yuv_env) > 0) {
+			if (strncmp(yuv_env, "bt601", 5) == 0) {
+				yuv_kr = 0.299f;
+				yuv_kb = 0.114f;
+				yuv_color_space = AVCOL_SPC_SMPTE170M;
+			} else if (strncmp(yuv_env, "bt709", 5) == 0) {
+				yuv_kr = 0.2126f;
+				yuv_kb = 0.0722f;
+				yuv_color_space = AVCOL_SPC_BT709;
+			}
+
+			yuv_capture = (yuv_color_space != AVCOL_SPC_UNSPECIFIED);
+			yuv_color_range = (strstr(yuv_env, "-full") != nullptr)? AVCOL_RANGE_JPEG: AVCOL_RANGE_MPEG;
+
+			if (!yuv_capture)
+				printf("[%s] unknown %s value \"%s\", capturing RGBA\n", __func__, yuv_env_var, yuv_env);
+		}
+	}
+	{
+		const char* scale_env = getenv(scale_env_var);
+
+		if (scale_env != nullptr && strlen(scale_env) > 0) {
+			if (sscanf(scale_env, "%dx%d", &scale_width, &scale_height) != 2) {
+				scale_width = 0;
+				scale_height = 0;
+				scale_factor = std::max(0.0f, std::min(static_cast<float>(atof(scale_env)), 1.0f));
+			}
+
+			if ((scale_width <= 0 || scale_height <= 0) && scale_factor <= 0.0f) {
+				printf("[%s] invalid %s value \"%s\", capturing at drawable size\n", __func__, scale_env_var, scale_env);
+
+				scale_width = 0;
+				scale_height = 0;
+				scale_factor = 1.0f;
+			}
+		}
+
+		// downscaling is done by blitting, which needs GL 3.0 or ARB_framebuffer_object
+		if (glBlitFramebufferPtr == nullptr || glGenFramebuffersPtr == nullptr) {
+			scale_width = 0;
+			scale_height = 0;
+			scale_factor = 1.0f;
+		}
+	}
+
+	replay_seconds = replay_ring::get_config_seconds();
+
 	lib_inited = true;
 	last_frame_time = get_current_time();
 }
 
 
 
+// only the state the capture passes and the overlay change is saved, and
+// only when they run this frame; no fixed-function state is involved, so
+// this works in core-profile contexts as well
 void enter_overlay_context() {
-	glPushAttribPtr(GL_ALL_ATTRIB_BITS);
-	glPushClientAttribPtr(GL_ALL_ATTRIB_BITS);
+	glGetIntegervPtr(GL_VIEWPORT, saved_state.viewport);
+	glGetIntegervPtr(GL_CURRENT_PROGRAM, &saved_state.program);
 
+	saved_state.capture = (recording || first_frame);
+	saved_state.vertex_array = -1;
+	saved_state.pass = false;
 
-	glGetIntegervPtr(GL_VIEWPORT, viewport);
-	glGetIntegervPtr(GL_CURRENT_PROGRAM, &program);
+	if (saved_state.capture) {
+		glGetIntegervPtr(GL_ACTIVE_TEXTURE, &saved_state.active_texture);
+		glActiveTexturePtr(GL_TEXTURE0);
+		glGetIntegervPtr(GL_TEXTURE_BINDING_2D, &saved_state.texture_2d);
+		glGetIntegervPtr(GL_PACK_ALIGNMENT, &saved_state.pack_alignment);
+
+		if (pbo_ring_size > 0)
+			glGetIntegervPtr(GL_PIXEL_PACK_BUFFER_BINDING, &saved_state.pack_buffer);
+	}
+
+	if (glBindFramebufferPtr != nullptr) {
+		glGetIntegervPtr(GL_DRAW_FRAMEBUFFER_BINDING, &saved_state.draw_framebuffer);
+		glGetIntegervPtr(GL_READ_FRAMEBUFFER_BINDING, &saved_state.read_framebuffer);
+
+		// capture and overlay both work on the window's back-buffer
+		if (saved_state.draw_framebuffer != 0 || saved_state.read_framebuffer != 0)
+			glBindFramebufferPtr(GL_FRAMEBUFFER, 0);
+	}
 
-	glUseProgramPtr(0);
-	glDisablePtr(GL_ALPHA_TEST);
-	glDisablePtr(GL_AUTO_NORMAL);
 	glViewportPtr(0, 0, frame_width, frame_height);
-	// skip clip planes
-	glDisablePtr(GL_COLOR_LOGIC_OP);
-	glDisablePtr(GL_COLOR_TABLE);
-	glDisablePtr(GL_CONVOLUTION_1D);
-	glDisablePtr(GL_CONVOLUTION_2D);
-	glDisablePtr(GL_CULL_FACE);
-	glDisablePtr(GL_DEPTH_TEST);
-	glDisablePtr(GL_DITHER);
-	glDisablePtr(GL_FOG);
-	glDisablePtr(GL_HISTOGRAM);
-	glDisablePtr(GL_INDEX_LOGIC_OP);
-	glDisablePtr(GL_LIGHTING);
-	glDisablePtr(GL_NORMALIZE);
-
-	// skip line smooth
-	glDisablePtr(GL_MINMAX);
-	// skip polygon offset
-	glDisablePtr(GL_SEPARABLE_2D);
-	glDisablePtr(GL_SCISSOR_TEST);
-	glDisablePtr(GL_STENCIL_TEST);
-	glDisablePtr(GL_TEXTURE_CUBE_MAP);
-	glDisablePtr(GL_VERTEX_PROGRAM_ARB);
-	glDisablePtr(GL_FRAGMENT_PROGRAM_ARB);
-	glDisablePtr(GL_BLEND);
-	glRenderModePtr(GL_RENDER);
-
-	glDisableClientStatePtr(GL_VERTEX_ARRAY);
-	glDisableClientStatePtr(GL_NORMAL_ARRAY);
-	glDisableClientStatePtr(GL_COLOR_ARRAY);
-	glDisableClientStatePtr(GL_INDEX_ARRAY);
-	glDisableClientStatePtr(GL_TEXTURE_COORD_ARRAY);
-	glDisableClientStatePtr(GL_EDGE_FLAG_ARRAY);
-
-	GLint texunits = 1;
-	glGetIntegervPtr(GL_MAX_TEXTURE_UNITS, &texunits);
-
-	for (int i = texunits - 1; i >= 0; --i) {
-		glActiveTexturePtr(GL_TEXTURE0 + i);
-		glDisablePtr(GL_TEXTURE_1D);
-		glDisablePtr(GL_TEXTURE_2D);
-		glDisablePtr(GL_TEXTURE_3D);
-	}
-
-	glDisablePtr(GL_TEXTURE_CUBE_MAP);
-	glDisablePtr(GL_VERTEX_PROGRAM_ARB);
-	glDisablePtr(GL_FRAGMENT_PROGRAM_ARB);
-
-	glMatrixModePtr(GL_PROJECTION);
-	glPushMatrixPtr();
-	glLoadIdentityPtr();
-	glOrthoPtr(0, frame_width, frame_height, 0, -100.0, 100.0);
-
-	glMatrixModePtr(GL_MODELVIEW);
-	glPushMatrixPtr();
-	glLoadIdentityPtr();
-
-	glEnablePtr(GL_COLOR_MATERIAL);
-	glColor4fPtr(1.0f, 1.0f, 1.0f, 1.0f);
-
-	glDrawBufferPtr(GL_BACK);
 }
 
 void leave_overlay_context() {
-    glMatrixModePtr(GL_MODELVIEW);
-    glPopMatrixPtr();
+	if (saved_state.capture) {
+		glPixelStoreiPtr(GL_PACK_ALIGNMENT, saved_state.pack_alignment);
+		glBindTexturePtr(GL_TEXTURE_2D, saved_state.texture_2d);
+		glActiveTexturePtr(saved_state.active_texture);
 
-    glMatrixModePtr(GL_PROJECTION);
-    glPopMatrixPtr();
+		if (pbo_ring_size > 0)
+			glBindBufferPtr(GL_PIXEL_PACK_BUFFER, saved_state.pack_buffer);
+	}
 
-    glPopClientAttribPtr();
-    glPopAttribPtr();
+	if (saved_state.pass) {
+		for (size_t i = 0; i < pass_caps.size(); i++) {
+			if (saved_state.caps[i])
+				glEnablePtr(pass_caps[i]);
+		}
+
+		if (glPolygonModePtr != nullptr) {
+			if (saved_state.polygon_mode[0] == saved_state.polygon_mode[1]) {
+				glPolygonModePtr(GL_FRONT_AND_BACK, saved_state.polygon_mode[0]);
+			} else {
+				glPolygonModePtr(GL_FRONT, saved_state.polygon_mode[0]);
+				glPolygonModePtr(GL_BACK, saved_state.polygon_mode[1]);
+			}
+		}
+
+		glColorMaskPtr(saved_state.color_mask[0], saved_state.color_mask[1], saved_state.color_mask[2], saved_state.color_mask[3]);
+		glBindBufferPtr(GL_ARRAY_BUFFER, saved_state.array_buffer);
+	}
+
+	if (saved_state.vertex_array >= 0)
+		glBindVertexArrayPtr(saved_state.vertex_array);
+
+	if (glBindFramebufferPtr != nullptr) {
+		glBindFramebufferPtr(GL_DRAW_FRAMEBUFFER, saved_state.draw_framebuffer);
+		glBindFramebufferPtr(GL_READ_FRAMEBUFFER, saved_state.read_framebuffer);
+	}
 
-    glViewportPtr(viewport[0], viewport[1], viewport[2], viewport[3]);
-    glUseProgramPtr(program);
+	glViewportPtr(saved_state.viewport[0], saved_state.viewport[1], saved_state.viewport[2], saved_state.viewport[3]);
+	glUseProgramPtr(saved_state.program);
 }
 
+// our passes bind vertex arrays of their own
+void save_vertex_array_binding() {
+	if (saved_state.vertex_array < 0)
+		glGetIntegervPtr(GL_VERTEX_ARRAY_BINDING, &saved_state.vertex_array);
+}
+
+// saves the pipeline state the game left on and sets the one our capture
+// passes and overlay draw with (no tests, blending or culling, all colors
+// written, filled polygons); once per frame, restored by leave_overlay_context
+void enter_pass_state() {
+	if (saved_state.pass)
+		return;
 
+	saved_state.pass = true;
+	save_vertex_array_binding();
 
-void draw_box_inner(float x1, float y1, float w, float h) {
-	glPolygonModePtr(GL_FRONT_AND_BACK, GL_FILL);
+	glGetIntegervPtr(GL_ARRAY_BUFFER_BINDING, &saved_state.array_buffer);
+	glGetBooleanvPtr(GL_COLOR_WRITEMASK, saved_state.color_mask);
 
-	if (!recording)
-		glColor3fPtr(1.0f, 1.0f, 0.0f);
-	else
-		glColor3fPtr(1.0f, 0.0f, 0.0f);
-
-	glBeginPtr(GL_QUADS);
-		glVertex3fPtr(x1    , y1    , 0.0f);
-		glVertex3fPtr(x1 + w, y1    , 0.0f);
-		glVertex3fPtr(x1 + w, y1 + h, 0.0f);
-		glVertex3fPtr(x1    , y1 + h, 0.0f);
-	glEndPtr();
+	// only disabled (and later re-enabled) if the game left them on
+	for (size_t i = 0; i < pass_caps.size(); i++) {
+		if ((saved_state.caps[i] = glIsEnabledPtr(pass_caps[i])))
+			glDisablePtr(pass_caps[i]);
+	}
+
+	if (glPolygonModePtr != nullptr) {
+		glGetIntegervPtr(GL_POLYGON_MODE, saved_state.polygon_mode);
+		glPolygonModePtr(GL_FRONT_AND_BACK, GL_FILL);
+	}
+
+	glColorMaskPtr(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
 }
 
-void draw_box_outer(float x1, float y1, float w, float h) {
-	glPolygonModePtr(GL_FRONT_AND_BACK, GL_LINE);
-	glColor3fPtr(0.0f, 0.0f, 0.0f);
 
-	glBeginPtr(GL_QUADS);
-		glVertex3fPtr(x1     - 0.5f, y1     - 0.5f, 0.0f);
-		glVertex3fPtr(x1 + w + 0.5f, y1     - 0.5f, 0.0f);
-		glVertex3fPtr(x1 + w + 0.5f, y1 + h + 0.5f, 0.0f);
-		glVertex3fPtr(x1           , y1 + h + 0.5f, 0.0f);
-	glEndPtr();
+
+static GLuint compile_shader(GLenum type, const char* src) {
+	const GLuint shader = glCreateShaderPtr(type);
+
+	glShaderSourcePtr(shader, 1, &src, nullptr);
+	glCompileShaderPtr(shader);
+	return shader;
 }
 
+bool init_overlay() {
+	if (glCreateProgramPtr == nullptr || glGenVertexArraysPtr == nullptr || glVertexAttribPointerPtr == nullptr || glBindFragDataLocationPtr == nullptr)
+		return false;
 
-#define SEGW 10.0f
-#define SEGH 30.0f
+	GLint link_status = GL_FALSE;
 
-void draw_N_A_O(int x, int y, float scale = 1.0f) { draw_box_outer(x             , y                                    , SEGW * scale             , SEGH * scale); }
-void draw_N_B_O(int x, int y, float scale = 1.0f) { draw_box_outer(x             , y                                    , SEGH * scale + SEGW*scale, SEGW * scale); }
-void draw_N_C_O(int x, int y, float scale = 1.0f) { draw_box_outer(x + SEGH*scale, y                                    , SEGW * scale             , SEGH * scale); }
-void draw_N_D_O(int x, int y, float scale = 1.0f) { draw_box_outer(x             , y + SEGH*scale      - SEGW*scale*0.5f, SEGH * scale + SEGW*scale, SEGW * scale); }
-void draw_N_E_O(int x, int y, float scale = 1.0f) { draw_box_outer(x             , y + SEGH*scale                       , SEGW * scale             , SEGH * scale); }
-void draw_N_F_O(int x, int y, float scale = 1.0f) { draw_box_outer(x             , y + SEGH*scale*2.0f - SEGW*scale     , SEGH * scale + SEGW*scale, SEGW * scale); }
-void draw_N_G_O(int x, int y, float scale = 1.0f) { draw_box_outer(x + SEGH*scale, y + SEGH*scale                       , SEGW * scale             , SEGH * scale); }
-
-void draw_N_A_I(int x, int y, float scale = 1.0f) { draw_box_inner(x             , y                                    , SEGW * scale             , SEGH * scale); }
-void draw_N_B_I(int x, int y, float scale = 1.0f) { draw_box_inner(x             , y                                    , SEGH * scale + SEGW*scale, SEGW * scale); }
-void draw_N_C_I(int x, int y, float scale = 1.0f) { draw_box_inner(x + SEGH*scale, y                                    , SEGW * scale             , SEGH * scale); }
-void draw_N_D_I(int x, int y, float scale = 1.0f) { draw_box_inner(x             , y + SEGH*scale      - SEGW*scale*0.5f, SEGH * scale + SEGW*scale, SEGW * scale); }
-void draw_N_E_I(int x, int y, float scale = 1.0f) { draw_box_inner(x             , y + SEGH*scale                       , SEGW * scale             , SEGH * scale); }
-void draw_N_F_I(int x, int y, float scale = 1.0f) { draw_box_inner(x             , y + SEGH*scale*2.0f - SEGW*scale     , SEGH * scale + SEGW*scale, SEGW * scale); }
-void draw_N_G_I(int x, int y, float scale = 1.0f) { draw_box_inner(x + SEGH*scale, y + SEGH*scale                       , SEGW * scale             , SEGH * scale); }
-
-void draw_overlay_number(int x, int y, int n, float scale = 1.0f)
-{
-    switch (n) {
-		case 8:
-			draw_N_A_O(x, y, scale);
-			draw_N_B_O(x, y, scale);
-			draw_N_C_O(x, y, scale);
-			draw_N_D_O(x, y, scale);
-			draw_N_E_O(x, y, scale);
-			draw_N_F_O(x, y, scale);
-			draw_N_G_O(x, y, scale);
-			break;
-		case 1:
-			draw_N_C_O(x, y, scale);
-			draw_N_G_O(x, y, scale);
-			break;
-		case 2:
-			draw_N_B_O(x, y, scale);
-			draw_N_C_O(x, y, scale);
-			draw_N_D_O(x, y, scale);
-			draw_N_E_O(x, y, scale);
-			draw_N_F_O(x, y, scale);
-			break;
-		case 3:
-			draw_N_B_O(x, y, scale);
-			draw_N_C_O(x, y, scale);
-			draw_N_D_O(x, y, scale);
-			draw_N_F_O(x, y, scale);
-			draw_N_G_O(x, y, scale);
-			break;
-		case 4:
-			draw_N_A_O(x, y, scale);
-			draw_N_C_O(x, y, scale);
-			draw_N_D_O(x, y, scale);
-			draw_N_G_O(x, y, scale);
-			break;
-		case 5:
-			draw_N_A_O(x, y, scale);
-			draw_N_B_O(x, y, scale);
-			draw_N_D_O(x, y, scale);
-			draw_N_F_O(x, y, scale);
-			draw_N_G_O(x, y, scale);
-			break;
-		case 6:
-			draw_N_A_O(x, y, scale);
-			draw_N_B_O(x, y, scale);
-			draw_N_D_O(x, y, scale);
-			draw_N_E_O(x, y, scale);
-			draw_N_F_O(x, y, scale);
-			draw_N_G_O(x, y, scale);
-			break;
-		case 7:
-			draw_N_A_O(x, y, scale);
-			draw_N_B_O(x, y, scale);
-			draw_N_C_O(x, y, scale);
-			draw_N_G_O(x, y, scale);
-			break;
-		case 9:
-			draw_N_A_O(x, y, scale);
-			draw_N_B_O(x, y, scale);
-			draw_N_C_O(x, y, scale);
-			draw_N_D_O(x, y, scale);
-			draw_N_F_O(x, y, scale);
-			draw_N_G_O(x, y, scale);
-			break;
-		case 0:
-			draw_N_A_O(x, y, scale);
-			draw_N_B_O(x, y, scale);
-			draw_N_C_O(x, y, scale);
-			draw_N_E_O(x, y, scale);
-			draw_N_F_O(x, y, scale);
-			draw_N_G_O(x, y, scale);
-			break;
-    }
-
-	switch (n) {
-		case 8:
-			draw_N_A_I(x, y, scale);
-			draw_N_B_I(x, y, scale);
-			draw_N_C_I(x, y, scale);
-			draw_N_D_I(x, y, scale);
-			draw_N_E_I(x, y, scale);
-			draw_N_F_I(x, y, scale);
-			draw_N_G_I(x, y, scale);
-			break;
-		case 1:
-			draw_N_C_I(x, y, scale);
-			draw_N_G_I(x, y, scale);
-			break;
-		case 2:
-			draw_N_B_I(x, y, scale);
-			draw_N_C_I(x, y, scale);
-			draw_N_D_I(x, y, scale);
-			draw_N_E_I(x, y, scale);
-			draw_N_F_I(x, y, scale);
-			break;
-		case 3:
-			draw_N_B_I(x, y, scale);
-			draw_N_C_I(x, y, scale);
-			draw_N_D_I(x, y, scale);
-			draw_N_F_I(x, y, scale);
-			draw_N_G_I(x, y, scale);
-			break;
-		case 4:
-			draw_N_A_I(x, y, scale);
-			draw_N_C_I(x, y, scale);
-			draw_N_D_I(x, y, scale);
-			draw_N_G_I(x, y, scale);
-			break;
-		case 5:
-			draw_N_A_I(x, y, scale);
-			draw_N_B_I(x, y, scale);
-			draw_N_D_I(x, y, scale);
-			draw_N_F_I(x, y, scale);
-			draw_N_G_I(x, y, scale);
-			break;
-		case 6:
-			draw_N_A_I(x, y, scale);
-			draw_N_B_I(x, y, scale);
-			draw_N_D_I(x, y, scale);
-			draw_N_E_I(x, y, scale);
-			draw_N_F_I(x, y, scale);
-			draw_N_G_I(x, y, scale);
-			break;
-		case 7:
-			draw_N_A_I(x, y, scale);
-			draw_N_B_I(x, y, scale);
-			draw_N_C_I(x, y, scale);
-			draw_N_G_I(x, y, scale);
-			break;
-		case 9:
-			draw_N_A_I(x, y, scale);
-			draw_N_B_I(x, y, scale);
-			draw_N_C_I(x, y, scale);
-			draw_N_D_I(x, y, scale);
-			draw_N_F_I(x, y, scale);
-			draw_N_G_I(x, y, scale);
-			break;
-		case 0:
-			draw_N_A_I(x, y, scale);
-			draw_N_B_I(x, y, scale);
-			draw_N_C_I(x, y, scale);
-			draw_N_E_I(x, y, scale);
-			draw_N_F_I(x, y, scale);
-			draw_N_G_I(x, y, scale);
-			break;
-    }
+	overlay_program = glCreateProgramPtr();
+
+	glAttachShaderPtr(overlay_program, compile_shader(GL_VERTEX_SHADER, overlay_vert_shader_src));
+	glAttachShaderPtr(overlay_program, compile_shader(GL_FRAGMENT_SHADER, overlay_frag_shader_src));
+	glBindAttribLocationPtr(overlay_program, 0, "position");
+	glBindAttribLocationPtr(overlay_program, 1, "color");
+	glBindFragDataLocationPtr(overlay_program, 0, "frag_color");
+	glLinkProgramPtr(overlay_program);
+	glGetProgramivPtr(overlay_program, GL_LINK_STATUS, &link_status);
+
+	if (link_status != GL_TRUE) {
+		printf("[%s] could not link overlay program\n", __func__);
+		return false;
+	}
+
+	enter_pass_state();
+
+	glGenVertexArraysPtr(1, &overlay_vao);
+	glGenBuffersPtr(1, &overlay_vbo);
+
+	// attribute layout lives in the VAO, the game's arrays are never touched
+	glBindVertexArrayPtr(overlay_vao);
+	glBindBufferPtr(GL_ARRAY_BUFFER, overlay_vbo);
+	glVertexAttribPointerPtr(0, 2, GL_FLOAT, GL_FALSE, sizeof(overlay_vertex), reinterpret_cast<const GLvoid*>(offsetof(overlay_vertex, x)));
+	glVertexAttribPointerPtr(1, 3, GL_FLOAT, GL_FALSE, sizeof(overlay_vertex), reinterpret_cast<const GLvoid*>(offsetof(overlay_vertex, r)));
+	glEnableVertexAttribArrayPtr(0);
+	glEnableVertexAttribArrayPtr(1);
+	return true;
+}
+
+
+// <x>, <y>, <w> and <h> in pixels from the top-left corner
+static void add_overlay_quad(float x, float y, float w, float h, const float* color) {
+	const float x0 = (x    ) * 2.0f / frame_width - 1.0f;
+	const float x1 = (x + w) * 2.0f / frame_width - 1.0f;
+	const float y0 = 1.0f - (y    ) * 2.0f / frame_height;
+	const float y1 = 1.0f - (y + h) * 2.0f / frame_height;
+
+	const overlay_vertex corners[6] = {
+		{x0, y0, color[0], color[1], color[2]},
+		{x1, y0, color[0], color[1], color[2]},
+		{x1, y1, color[0], color[1], color[2]},
+		{x0, y0, color[0], color[1], color[2]},
+		{x1, y1, color[0], color[1], color[2]},
+		{x0, y1, color[0], color[1], color[2]},
+	};
+
+	overlay_vertices.insert(overlay_vertices.end(), corners, corners + 6);
+}
+
+// all lit segments' outlines first, so no outline covers a neighbour's fill
+static void add_overlay_number(int fps, float scale) {
+	static const float outline_color[3] = {0.0f, 0.0f, 0.0f};
+	static const float idle_color[3] = {1.0f, 1.0f, 0.0f};
+	static const float record_color[3] = {1.0f, 0.0f, 0.0f};
+
+	const float size = SEGH * scale + SEGW * scale + SEGW * scale;
+
+	for (int pass = 0; pass < 2; pass++) {
+		float xpos = frame_width;
+
+		for (int n = fps; n > 0; n /= 10) {
+			xpos -= size;
+
+			for (int i = 0; i < 7; i++) {
+				if ((overlay_digit_segments[n % 10] & (1 << i)) == 0)
+					continue;
+
+				const float* s = overlay_segments[i];
+
+				const float x = xpos + s[0] * scale;
+				const float y = 5.0f + s[1] * scale;
+
+				if (pass == 0) {
+					add_overlay_quad(x - 1.0f, y - 1.0f, s[2] * scale + 2.0f, s[3] * scale + 2.0f, outline_color);
+				} else {
+					add_overlay_quad(x, y, s[2] * scale, s[3] * scale, recording? record_color: idle_color);
+				}
+			}
+		}
+	}
 }
 
 void draw_framerate_overlay(int fps, float scale = 1.0f) {
-	int xpos = frame_width;
-	int size = SEGH*scale + SEGW*scale + SEGW*scale;
+	if (overlay_program == 0)
+		return;
+
+	enter_pass_state();
+
+	glBindVertexArrayPtr(overlay_vao);
+	glBindBufferPtr(GL_ARRAY_BUFFER, overlay_vbo);
+
+	// the vertices only change with the number, its color or the drawable size
+	if (fps != overlay_fps || recording != overlay_recording || frame_width != overlay_width || frame_height != overlay_height) {
+		overlay_vertices.clear();
+		add_overlay_number(fps, scale);
+
+		glBufferDataPtr(GL_ARRAY_BUFFER, overlay_vertices.size() * sizeof(overlay_vertex), overlay_vertices.data(), GL_DYNAMIC_DRAW);
+
+		overlay_fps = fps;
+		overlay_recording = recording;
+		overlay_width = frame_width;
+		overlay_height = frame_height;
+	}
+
+	glUseProgramPtr(overlay_program);
+	glDrawArraysPtr(GL_TRIANGLES, 0, overlay_vertices.size());
+}
+
+
+
+bool init_yuv_pass() {
+	if (glCreateProgramPtr == nullptr || glGenFramebuffersPtr == nullptr || glReadPixelsPtr == nullptr || glGenVertexArraysPtr == nullptr)
+		return false;
+
+	GLint link_status = GL_FALSE;
+
+	yuv_program = glCreateProgramPtr();
+
+	glAttachShaderPtr(yuv_program, compile_shader(GL_VERTEX_SHADER, fullscreen_vert_shader_src));
+	glAttachShaderPtr(yuv_program, compile_shader(GL_FRAGMENT_SHADER, yuv_frag_shader_src));
+	glLinkProgramPtr(yuv_program);
+	glGetProgramivPtr(yuv_program, GL_LINK_STATUS, &link_status);
+
+	if (link_status != GL_TRUE) {
+		printf("[%s] could not link YUV conversion program\n", __func__);
+		return false;
+	}
+
+	{
+		// Y' = Kr*R + Kg*G + Kb*B, Cb and Cr are the scaled blue and red differences
+		const float kr = yuv_kr;
+		const float kb = yuv_kb;
+		const float kg = 1.0f - kr - kb;
+
+		const bool full_range = (yuv_color_range == AVCOL_RANGE_JPEG);
+
+		const float ys = full_range? 1.0f: (219.0f / 255.0f);
+		const float cs = full_range? 1.0f: (224.0f / 255.0f);
+		const float yo = full_range? 0.0f: ( 16.0f / 255.0f);
+		const float co = 128.0f / 255.0f;
+
+		const float us = cs / (2.0f * (1.0f - kb));
+		const float vs = cs / (2.0f * (1.0f - kr));
 
-	while (fps > 0) {
-		xpos -= size;
-		draw_overlay_number(xpos, 5, fps % 10, scale);
-		fps /= 10;
+		glUseProgramPtr(yuv_program);
+		glUniform1iPtr(glGetUniformLocationPtr(yuv_program, "src_tex"), 0);
+		glUniform4fPtr(glGetUniformLocationPtr(yuv_program, "y_coeffs"),  kr * ys,          kg * ys,  kb * ys,          yo);
+		glUniform4fPtr(glGetUniformLocationPtr(yuv_program, "u_coeffs"), -kr * us,         -kg * us, (1.0f - kb) * us, co);
+		glUniform4fPtr(glGetUniformLocationPtr(yuv_program, "v_coeffs"), (1.0f - kr) * vs, -kg * vs, -kb * vs,         co);
+		glUseProgramPtr(0);
+
+		yuv_src_size_loc = glGetUniformLocationPtr(yuv_program, "src_size");
 	}
+
+	glGenFramebuffersPtr(1, &yuv_fbo);
+	glGenTexturesPtr(1, &yuv_tex);
+	glGenVertexArraysPtr(1, &fullscreen_vao);
+	return true;
+}
+
+void convert_frame_yuv() {
+	const int tex_width = capture_width;
+	const int tex_height = capture_height + capture_height / 2;
+
+	glBindFramebufferPtr(GL_FRAMEBUFFER, yuv_fbo);
+
+	if (yuv_tex_width != tex_width || yuv_tex_height != tex_height) {
+		glBindTexturePtr(GL_TEXTURE_2D, yuv_tex);
+		glTexParameteriPtr(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteriPtr(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexImage2DPtr(GL_TEXTURE_2D, 0, GL_R8, tex_width, tex_height, 0, GL_RED, GL_UNSIGNED_BYTE, nullptr);
+		glFramebufferTexture2DPtr(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, yuv_tex, 0);
+
+		yuv_tex_width = tex_width;
+		yuv_tex_height = tex_height;
+	}
+
+	glViewportPtr(0, 0, tex_width, tex_height);
+	glBindTexturePtr(GL_TEXTURE_2D, cap_tex);
+	glUseProgramPtr(yuv_program);
+	glUniform2iPtr(yuv_src_size_loc, capture_width, capture_height);
+
+	// covers the whole viewport; every fragment derives its plane and
+	// source texels from gl_FragCoord
+	save_vertex_array_binding();
+	glBindVertexArrayPtr(fullscreen_vao);
+	glDrawArraysPtr(GL_TRIANGLES, 0, 3);
+
+	glUseProgramPtr(0);
+	glViewportPtr(0, 0, frame_width, frame_height);
+	glBindFramebufferPtr(GL_FRAMEBUFFER, 0);
+}
+
+
+size_t capture_frame_size() {
+	if (yuv_capture)
+		return (capture_width * capture_height * 3 / 2);
+
+	return (capture_width * capture_height * 4);
+}
+
+void scale_frame() {
+	if (scale_fbo == 0)
+		glGenFramebuffersPtr(1, &scale_fbo);
+
+	glBindFramebufferPtr(GL_DRAW_FRAMEBUFFER, scale_fbo);
+
+	if (cap_tex_width != capture_width || cap_tex_height != capture_height) {
+		glTexImage2DPtr(GL_TEXTURE_2D, 0, GL_RGBA8, capture_width, capture_height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		glFramebufferTexture2DPtr(GL_DRAW_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, cap_tex, 0);
+
+		cap_tex_width = capture_width;
+		cap_tex_height = capture_height;
+	}
+
+	glBlitFramebufferPtr(
+		0, 0,   frame_width,   frame_height,
+		0, 0, capture_width, capture_height,
+		GL_COLOR_BUFFER_BIT, GL_LINEAR
+	);
+	glBindFramebufferPtr(GL_DRAW_FRAMEBUFFER, 0);
+}
+
+// grab the back-buffer (minus the overlay) into cap_tex, downscaled if requested
+void copy_frame() {
+	// the game's scissor rect also clips the blit, the rest the YUV pass
+	enter_pass_state();
+	glBindTexturePtr(GL_TEXTURE_2D, cap_tex);
+
+	if (scale_width > 0 || scale_factor < 1.0f) {
+		scale_frame();
+	} else {
+		glCopyTexImage2DPtr(GL_TEXTURE_2D, 0, GL_RGBA, 0, 0, capture_width, capture_height, 0);
+
+		cap_tex_width = capture_width;
+		cap_tex_height = capture_height;
+	}
+
+	if (yuv_capture)
+		convert_frame_yuv();
+}
+
+// read the copied frame into <data>, or into the bound pack-buffer if null
+void read_frame(void* data) {
+	if (yuv_capture) {
+		glPixelStoreiPtr(GL_PACK_ALIGNMENT, 1);
+		glBindFramebufferPtr(GL_READ_FRAMEBUFFER, yuv_fbo);
+		glReadPixelsPtr(0, 0, yuv_tex_width, yuv_tex_height, GL_RED, GL_UNSIGNED_BYTE, data);
+		glBindFramebufferPtr(GL_READ_FRAMEBUFFER, 0);
+		return;
+	}
+
+	glPixelStoreiPtr(GL_PACK_ALIGNMENT, 4);
+	glBindTexturePtr(GL_TEXTURE_2D, cap_tex);
+	glGetTexImagePtr(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+}
+
+
+
+void discard_pbo_ring() {
+	for (; pbo_ring_tail != pbo_ring_head; pbo_ring_tail++) {
+		pbo_slot& slot = pbo_ring[pbo_ring_tail % pbo_ring_size];
+
+		glDeleteSyncPtr(slot.fence);
+		slot.fence = nullptr;
+	}
+}
+
+// hand the oldest completed readback to the recorder; only waits on the
+// GPU in fixed-timestep mode, where a full ring must not skip a frame
+void retire_pbo_ring() {
+	if (pbo_ring_tail == pbo_ring_head)
+		return;
+
+	pbo_slot& slot = pbo_ring[pbo_ring_tail % pbo_ring_size];
+
+	const bool wait = (is_game_clock_fixed() && (pbo_ring_head - pbo_ring_tail) >= pbo_ring_size);
+
+	GLenum status = GL_TIMEOUT_EXPIRED;
+
+	// flushed so the fence is sure to signal at all
+	while ((status = glClientWaitSyncPtr(slot.fence, wait? GL_SYNC_FLUSH_COMMANDS_BIT: 0, wait? PBO_WAIT_TIMEOUT: 0)) == GL_TIMEOUT_EXPIRED && wait)
+		continue;
+
+	switch (status) {
+		case GL_ALREADY_SIGNALED:
+		case GL_CONDITION_SATISFIED:
+			break;
+		default:
+			return;
+	}
+
+	glDeleteSyncPtr(slot.fence);
+	slot.fence = nullptr;
+	pbo_ring_tail++;
+
+	// drawable was resized after recording started
+	if (slot.width != curr_recorder->get_frame_width() || slot.height != curr_recorder->get_frame_height())
+		return;
+
+	frame_slot* frame = curr_recorder->acquire_frame();
+
+	// encoder queue is full, frame gets dropped
+	if (frame == nullptr)
+		return;
+
+	glBindBufferPtr(GL_PIXEL_PACK_BUFFER, slot.pbo);
+
+	const char* pbo_data = reinterpret_cast<const char*>(glMapBufferPtr(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY));
+
+	if (pbo_data != nullptr) {
+		memcpy(frame->data, pbo_data, slot.size);
+		glUnmapBufferPtr(GL_PIXEL_PACK_BUFFER);
+
+		pthread_mutex_lock(&record_mutex);
+		curr_recorder->append_frame(frame, slot.time, slot.width, slot.height);
+		pthread_mutex_unlock(&record_mutex);
+	} else {
+		curr_recorder->cancel_frame(frame);
+	}
+
+	glBindBufferPtr(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+// queue a readback of the current back-buffer; skips the frame if the ring is full
+void issue_pbo_ring() {
+	if ((pbo_ring_head - pbo_ring_tail) >= pbo_ring_size)
+		return;
+
+	pbo_slot& slot = pbo_ring[pbo_ring_head % pbo_ring_size];
+
+	const size_t size = capture_frame_size();
+
+	if (slot.pbo == 0)
+		glGenBuffersPtr(1, &slot.pbo);
+
+	glBindBufferPtr(GL_PIXEL_PACK_BUFFER, slot.pbo);
+
+	if (slot.size != size)
+		glBufferDataPtr(GL_PIXEL_PACK_BUFFER, (slot.size = size), nullptr, GL_STREAM_READ);
+
+	copy_frame();
+	// with a pack-buffer bound this only schedules the transfer
+	read_frame(nullptr);
+	glBindBufferPtr(GL_PIXEL_PACK_BUFFER, 0);
+
+	slot.fence = glFenceSyncPtr(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	slot.time = swap_time;
+	slot.width = capture_width;
+	slot.height = capture_height;
+
+	pbo_ring_head++;
+}
+
+
+
+// each glXQueryDrawable can be a server round-trip, so the size is only
+// queried again once the cache is invalidated
+static void update_drawable_size(void* dpy, void* drawable) {
+	const bool stale = drawable_size_stale.exchange(false);
+
+	if (!stale && drawable == sized_drawable && (frame_counter - drawable_query_frame) < DRAWABLE_REFRESH_FRAMES)
+		return;
+
+	glXQueryDrawablePtr(dpy, drawable, 0x801D, reinterpret_cast<unsigned int*>(&frame_width ));
+	glXQueryDrawablePtr(dpy, drawable, 0x801E, reinterpret_cast<unsigned int*>(&frame_height));
+
+	sized_drawable = drawable;
+	drawable_query_frame = frame_counter;
 }
 
 
@@ -553,19 +1226,43 @@ void draw_framerate_overlay(int fps, float scale = 1.0f) {
 extern "C" {
 	__attribute__((visibility("default")))
 	void glXSwapBuffers(void* dpy, void* drawable) {
-		const int old_width = frame_width;
-		const int old_height = frame_height;
+		// slot for the synchronous readback path
+		frame_slot* sync_frame = nullptr;
+
+		// with a fixed timestep, exactly 1/fps after the previous frame
+		swap_time = get_game_time();
+
+		update_drawable_size(dpy, drawable);
 
-		glXQueryDrawablePtr(dpy, drawable, 0x801D, reinterpret_cast<unsigned int*>(&frame_width ));
-		glXQueryDrawablePtr(dpy, drawable, 0x801E, reinterpret_cast<unsigned int*>(&frame_height));
+		// a fixed size is a box the drawable is fitted into, keeping its
+		// aspect ratio; neither it nor a factor ever scales up
+		float capture_scale = scale_factor;
 
-		if (frame_data == nullptr || old_width != frame_width || old_height != frame_height) {
-			if (frame_data == nullptr)
-				frame_data = malloc(frame_width * frame_height * 4);
-			else
-				frame_data = realloc(data, frame_width * frame_height * 4);
-        }
+		if (scale_width > 0 && scale_height > 0)
+			capture_scale = std::min(1.0f, std::min(static_cast<float>(scale_width) / frame_width, static_cast<float>(scale_height) / frame_height));
 
+		capture_width = std::max(1, std::min(static_cast<int>(frame_width * capture_scale), frame_width));
+		capture_height = std::max(1, std::min(static_cast<int>(frame_height * capture_scale), frame_height));
+
+		// 4:2:0 subsampling needs even dimensions
+		capture_width = yuv_capture? (capture_width & ~1): capture_width;
+		capture_height = yuv_capture? (capture_height & ~1): capture_height;
+
+
+		// replay mode records from the first frame on
+		if (replay_seconds > 0.0 && curr_recorder == nullptr && !session_starting && !replay_start_failed)
+			request_session_start();
+
+		// the session thread finished setting up a recorder; installed
+		// before enter_overlay_context, which saves the capture state
+		// only when recording
+		if (session_starting && ready_recorder.load() != nullptr) {
+			pthread_mutex_lock(&record_mutex);
+			curr_recorder = ready_recorder.exchange(nullptr);
+			recording = true;
+			session_starting = false;
+			pthread_mutex_unlock(&record_mutex);
+		}
 
 		enter_overlay_context();
 
@@ -574,13 +1271,26 @@ extern "C" {
 
 			glGenTexturesPtr(1, &cap_tex);
 			glGenTexturesPtr(1, &render_tex);
+
+			// texelFetch needs a complete (non-mipmapped) texture
+			glBindTexturePtr(GL_TEXTURE_2D, cap_tex);
+			glTexParameteriPtr(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteriPtr(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+			if (yuv_capture && !(yuv_capture = init_yuv_pass()))
+				printf("[%s] GPU YUV conversion unavailable, capturing RGBA\n", __func__);
+			if (!init_overlay())
+				printf("[%s] overlay needs GL 3.0, not drawing it\n", __func__);
 		}
 
-		if (recording) {
-			if (curr_recorder->is_ready()) {
-				glPixelStoreiPtr(GL_PACK_ALIGNMENT, 4);
-				glBindTexturePtr(GL_TEXTURE_2D, cap_tex);
-				glCopyTexImage2DPtr(GL_TEXTURE_2D, 0, GL_RGBA, 0, 0, frame_width, frame_height, 0);
+		if (!recording) {
+			discard_pbo_ring();
+		} else if (pbo_ring_size > 0) {
+			retire_pbo_ring();
+			issue_pbo_ring();
+		} else if (capture_width == curr_recorder->get_frame_width() && capture_height == curr_recorder->get_frame_height()) {
+			if ((sync_frame = curr_recorder->acquire_frame()) != nullptr) {
+				copy_frame();
 			}
 		}
 
@@ -598,7 +1308,7 @@ extern "C" {
 		{
 
 
-		if (recording && curr_recorder->is_ready()) {
+		if (sync_frame != nullptr) {
 			#if 0
 			glEnable(GL_TEXTURE_2D);
 			glClear(GL_DEPTH_BUFFER_BIT | GL_COLOR_BUFFER_BIT);
@@ -615,22 +1325,29 @@ extern "C" {
 			glEnd();
 			#endif
 
-			glBindTexturePtr(GL_TEXTURE_2D, cap_tex);
 			// glCopyTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 0, 0, frame_width, frame_height, 0);
-			glGetTexImagePtr(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, frame_data);
+			read_frame(sync_frame->data);
 
 			pthread_mutex_lock(&record_mutex);
-			curr_recorder->append_frame(0.0, frame_width, frame_height, frame_data); // pointer must be valid until next frame
+			curr_recorder->append_frame(sync_frame, swap_time, capture_width, capture_height);
 			pthread_mutex_unlock(&record_mutex);
 		}
 
 		glXSwapBuffersPtr(dpy, drawable);
 		leave_overlay_context();
+
+		// the game's next frame sees time advanced by one frame
+		step_game_clock();
 	}
 
     void XNextEvent(void* display, XEvent* event) {
         XNextEventPtr(display, event);
 
+		// the GLX drawable need not be the configured window itself, any
+		// resize just makes the next swap query its size again
+		if (event->type == ConfigureNotify)
+			drawable_size_stale = true;
+
         if (event->type != KeyPress)
 			return;
         if (event->xkey.keycode != 0x60 /*F12*/)
@@ -644,21 +1361,24 @@ extern "C" {
 
 		pthread_mutex_lock(&record_mutex);
 
-		if ((recording = !recording)) {
-			char* output_dir = getenv(dir_env_var);
-			char filedate[512];
+		if (replay_seconds > 0.0) {
 			char filename[1024];
 
-			strftime_c(filedate, "%F %r", sizeof(date) - 1);
+			make_output_filename(filename, sizeof(filename), "-replay");
 
-			if (output_dir != nullptr && strlen(output_dir) > 0)
-				sprintf(filename,"%s/%s-%s.avi", output_dir, output_file, filedate);
-			else
-				sprintf(filename,"./%s-%s.avi", output_file, filedate);
-
-			curr_recorder = new frame_recorder(filename, frame_width, frame_height);
+			// returns immediately, the dump is written by the recorder
+			if (curr_recorder != nullptr)
+				curr_recorder->dump_replay(filename);
+		} else if (session_starting) {
+			printf("[%s] recorder is still starting\n", __func__);
+		} else if (!recording) {
+			// picked up by glXSwapBuffers once the session thread is done
+			request_session_start();
 		} else {
-			delete curr_recorder;
+			recording = false;
+
+			// flushed and closed on the session thread
+			request_session_stop(curr_recorder);
 			curr_recorder = nullptr;
 		}
 
@@ -730,6 +1450,12 @@ extern "C" {
 		DL_DECLSYMS;
 		DL_DECLSYM(glXGetProcAddressARB);
 
+		// time sources looked up at run-time, in fixed-timestep mode
+		void* clock_hook = get_game_clock_hook(name);
+
+		if (clock_hook != nullptr)
+			return clock_hook;
+
 		return dlsymPtr(handle, name);
 	}
 }
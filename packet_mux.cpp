@@ -0,0 +1,514 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "packet_mux.hpp"
+#include "rec_config.hpp"
+
+static const char* mux_queue_env_var = "SNAPSHOT_MUX_QUEUE";
+static const char* write_buffer_env_var = "SNAPSHOT_WRITE_BUFFER";
+static const char* direct_io_env_var = "SNAPSHOT_DIRECT_IO";
+static const char* segment_time_env_var = "SNAPSHOT_SEGMENT_TIME";
+static const char* segment_size_env_var = "SNAPSHOT_SEGMENT_SIZE";
+static const char* segment_format_env_var = "SNAPSHOT_SEGMENT_FORMAT";
+
+// O_DIRECT wants block-aligned memory, offsets and sizes
+#define WRITE_ALIGN size_t(4096)
+// size of the AVIOContext's own (small) buffer in front of the output_file
+#define AVIO_BUFFER_SIZE (64 * 1024)
+// steps in which disk space is reserved ahead of the write position
+#define PREALLOC_SIZE (int64_t(64) * 1024 * 1024)
+
+
+extern double get_current_time();
+
+static void* mux_thread_proc(void* arg) {
+	reinterpret_cast<packet_muxer*>(arg)->mux_thread_func();
+	return nullptr;
+}
+
+static int avio_write_proc(void* opaque, uint8_t* buf, int size) {
+	return (reinterpret_cast<output_file*>(opaque)->write(buf, size));
+}
+
+static int64_t avio_seek_proc(void* opaque, int64_t offset, int whence) {
+	return (reinterpret_cast<output_file*>(opaque)->seek(offset, whence));
+}
+
+
+
+bool output_file::open(const char* file_name, size_t size, bool direct_io) {
+	if ((file_desc = ::open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		fprintf(stderr, "[%s] could not create \"%s\" (%s)\n", __func__, file_name, strerror(errno));
+		return false;
+	}
+
+	direct_desc = file_desc;
+
+	if (direct_io) {
+		// not every file system (tmpfs) supports it
+		if ((direct_desc = ::open(file_name, O_WRONLY | O_DIRECT)) < 0) {
+			printf("[%s] O_DIRECT not supported for \"%s\", using buffered writes\n", __func__, file_name);
+			direct_desc = file_desc;
+		}
+	}
+
+	buffer_size = std::max((size + WRITE_ALIGN - 1) & ~(WRITE_ALIGN - 1), WRITE_ALIGN);
+	buffer_used = 0;
+	buffer_offset = 0;
+	position = 0;
+	file_allocated = 0;
+
+	if (posix_memalign(reinterpret_cast<void**>(&write_buffer), WRITE_ALIGN, buffer_size) != 0) {
+		fprintf(stderr, "[%s] could not allocate %lu-byte write buffer\n", __func__, buffer_size);
+		close();
+		return false;
+	}
+
+	printf("[%s] writing \"%s\" in %lu-byte blocks%s\n", __func__, file_name, buffer_size, (direct_desc != file_desc)? " (O_DIRECT)": "");
+	return true;
+}
+
+void output_file::close() {
+	if (file_desc < 0)
+		return;
+
+	// the partial last block can not go through O_DIRECT
+	if (buffer_used > 0 && pwrite(file_desc, write_buffer, buffer_used, buffer_offset) != ssize_t(buffer_used))
+		fprintf(stderr, "[%s] could not write last %lu bytes\n", __func__, buffer_used);
+
+	// drop whatever was preallocated past the end
+	if (ftruncate(file_desc, get_size()) != 0)
+		fprintf(stderr, "[%s] could not truncate output file\n", __func__);
+
+	if (direct_desc != file_desc)
+		::close(direct_desc);
+
+	::close(file_desc);
+	free(write_buffer);
+
+	write_buffer = nullptr;
+	direct_desc = -1;
+	file_desc = -1;
+}
+
+
+int output_file::write(const uint8_t* data, int size) {
+	int written = 0;
+
+	while (written < size) {
+		const size_t left = size - written;
+
+		if (position < buffer_offset) {
+			// back into data already written out, e.g. a header's size field
+			const size_t n = std::min(left, size_t(buffer_offset - position));
+
+			if (pwrite(file_desc, &data[written], n, position) != ssize_t(n))
+				return -1;
+
+			position += n;
+			written += n;
+			continue;
+		}
+
+		// position is never past the end, so this is inside the buffer
+		const size_t start = position - buffer_offset;
+		const size_t n = std::min(left, buffer_size - start);
+
+		memcpy(&write_buffer[start], &data[written], n);
+
+		buffer_used = std::max(buffer_used, start + n);
+		position += n;
+		written += n;
+
+		if (buffer_used == buffer_size && !flush_buffer())
+			return -1;
+	}
+
+	return written;
+}
+
+int64_t output_file::seek(int64_t offset, int whence) {
+	int64_t target = offset;
+
+	switch (whence & ~AVSEEK_FORCE) {
+		case SEEK_SET: { } break;
+		case SEEK_CUR: { target += position; } break;
+		case SEEK_END: { target += get_size(); } break;
+		case AVSEEK_SIZE: { return (get_size()); } break;
+		default: { return -1; } break;
+	}
+
+	// muxers only ever seek back to patch what they wrote
+	if (target < 0 || target > get_size())
+		return -1;
+
+	return (position = target);
+}
+
+
+bool output_file::flush_buffer() {
+	if (preallocate) {
+		while (file_allocated < buffer_offset + int64_t(buffer_size)) {
+			// keeps the file size, a crashed session leaves no zeroed tail
+			if (fallocate(direct_desc, FALLOC_FL_KEEP_SIZE, file_allocated, PREALLOC_SIZE) != 0) {
+				printf("[%s] could not preallocate (%s), continuing without\n", __func__, strerror(errno));
+				preallocate = false;
+				break;
+			}
+
+			file_allocated += PREALLOC_SIZE;
+		}
+	}
+
+	for (size_t done = 0; done < buffer_size; ) {
+		const ssize_t n = pwrite(direct_desc, &write_buffer[done], buffer_size - done, buffer_offset + done);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0) {
+			fprintf(stderr, "[%s] write failed (%s)\n", __func__, strerror(errno));
+			return false;
+		}
+
+		done += n;
+	}
+
+	buffer_offset += buffer_size;
+	buffer_used = 0;
+	return true;
+}
+
+
+
+packet_muxer::packet_muxer(AVFormatContext* format_ctx) {
+	this->format_ctx = format_ctx;
+
+	max_queued_bytes = get_config_queue_size();
+
+	pthread_mutex_init(&queue_mutex, nullptr);
+	pthread_cond_init(&packet_cond, nullptr);
+	pthread_cond_init(&space_cond, nullptr);
+}
+
+packet_muxer::~packet_muxer() {
+	close();
+
+	pthread_cond_destroy(&space_cond);
+	pthread_cond_destroy(&packet_cond);
+	pthread_mutex_destroy(&queue_mutex);
+}
+
+
+size_t packet_muxer::get_config_queue_size() {
+	return (size_t(std::max(get_config_int(mux_queue_env_var, 64), 1)) * 1024 * 1024);
+}
+
+size_t packet_muxer::get_config_buffer_size() {
+	return (size_t(std::max(get_config_int(write_buffer_env_var, 4), 1)) * 1024 * 1024);
+}
+
+bool packet_muxer::get_config_direct_io() {
+	return (get_config_int(direct_io_env_var, 0) != 0);
+}
+
+int packet_muxer::get_config_segment_time() {
+	return (std::max(get_config_int(segment_time_env_var, 0), 0));
+}
+
+int64_t packet_muxer::get_config_segment_size() {
+	return (int64_t(std::max(get_config_int(segment_size_env_var, 0), 0)) * 1024 * 1024);
+}
+
+bool packet_muxer::get_config_segment_ts() {
+	const char* format = get_config_value(segment_format_env_var);
+
+	if (format == nullptr || strlen(format) == 0 || strcmp(format, "mp4") == 0)
+		return false;
+	if (strcmp(format, "ts") == 0)
+		return true;
+
+	printf("[%s] unknown segment format \"%s\", using mp4\n", __func__, format);
+	return false;
+}
+
+AVOutputFormat* packet_muxer::get_config_format(const char* file_name) {
+	if (get_config_segment_time() == 0 && get_config_segment_size() == 0)
+		return (av_guess_format(nullptr, file_name, nullptr));
+
+	// encoders decide on global headers by this, so it has to match the segments
+	return (av_guess_format(get_config_segment_ts()? "mpegts": "mp4", nullptr, nullptr));
+}
+
+
+bool packet_muxer::open(const char* file_name) {
+	segment_time = get_config_segment_time();
+	segment_size = get_config_segment_size();
+	segment_ts = get_config_segment_ts();
+
+	if (segment_time > 0 || segment_size > 0) {
+		const char* ext = strrchr(file_name, '.');
+
+		// "name.avi" becomes "name-0000.mp4", "name-0001.mp4", ...
+		segment_base.assign(file_name, (ext != nullptr && strchr(ext, '/') == nullptr)? (ext - file_name): strlen(file_name));
+
+		printf("[%s] segmenting every %ds / %ldMB as %s\n", __func__, segment_time, segment_size / (1024 * 1024), segment_ts? "MPEG-TS": "fragmented MP4");
+
+		if (!open_segment())
+			return false;
+	} else {
+		output_ctx = format_ctx;
+
+		if (!open_output(file_name, nullptr))
+			return false;
+	}
+
+	keep_running = true;
+	thread_running = true;
+
+	pthread_create(&mux_thread, nullptr, mux_thread_proc, this);
+	return true;
+}
+
+void packet_muxer::close() {
+	if (!thread_running)
+		return;
+
+	pthread_mutex_lock(&queue_mutex);
+	keep_running = false;
+	pthread_cond_signal(&packet_cond);
+	pthread_mutex_unlock(&queue_mutex);
+
+	pthread_join(mux_thread, nullptr);
+
+	thread_running = false;
+
+	if (segment_index > 0) {
+		close_segment();
+		printf("[%s] wrote %u segments, longest switch %.1fms\n", __func__, segment_index, max_switch_time * 1000.0);
+	} else {
+		close_output();
+	}
+
+	printf("[%s] muxed %lu packets (%lu bytes), %lu queue stalls, longest write %.1fms\n", __func__, num_packets, bytes_written, num_stalls, max_write_time * 1000.0);
+}
+
+
+bool packet_muxer::open_output(const char* file_name, AVDictionary** options) {
+	if (!file.open(file_name, get_config_buffer_size(), get_config_direct_io()))
+		return false;
+
+	uint8_t* avio_buffer = reinterpret_cast<uint8_t*>(av_malloc(AVIO_BUFFER_SIZE));
+
+	if ((io_ctx = avio_alloc_context(avio_buffer, AVIO_BUFFER_SIZE, 1, &file, nullptr, avio_write_proc, avio_seek_proc)) == nullptr) {
+		fprintf(stderr, "[%s] could not allocate I/O context\n", __func__);
+		av_free(avio_buffer);
+		file.close();
+		return false;
+	}
+
+	output_ctx->pb = io_ctx;
+
+	av_dump_format(output_ctx, 0, file_name, 1);
+
+	if (avformat_write_header(output_ctx, options) < 0) {
+		fprintf(stderr, "[%s] could not write header to \"%s\"\n", __func__, file_name);
+
+		output_ctx->pb = nullptr;
+
+		av_free(io_ctx->buffer);
+		av_free(io_ctx);
+
+		io_ctx = nullptr;
+
+		file.close();
+		return false;
+	}
+
+	return true;
+}
+
+void packet_muxer::close_output() {
+	// also flushes the packets still held back for interleaving
+	av_write_trailer(output_ctx);
+	avio_flush(io_ctx);
+
+	output_ctx->pb = nullptr;
+
+	av_free(io_ctx->buffer);
+	av_free(io_ctx);
+
+	io_ctx = nullptr;
+
+	bytes_written += file.get_size();
+	file.close();
+}
+
+
+bool packet_muxer::open_segment() {
+	char file_name[1024];
+	snprintf(file_name, sizeof(file_name), "%s-%04u.%s", segment_base.c_str(), segment_index, segment_ts? "ts": "mp4");
+
+	output_ctx = avformat_alloc_context();
+	output_ctx->oformat = av_guess_format(segment_ts? "mpegts": "mp4", nullptr, nullptr);
+	snprintf(output_ctx->filename, sizeof(output_ctx->filename), "%s", file_name);
+
+	for (unsigned int i = 0; i < format_ctx->nb_streams; i++) {
+		AVStream* stream = av_new_stream(output_ctx, i);
+
+		avcodec_copy_context(stream->codec, format_ctx->streams[i]->codec);
+		stream->codec->codec_tag = 0;
+		stream->r_frame_rate = format_ctx->streams[i]->r_frame_rate;
+	}
+
+	AVDictionary* options = nullptr;
+
+	// an empty moov up front and a fragment per keyframe, so the file
+	// plays without its trailer
+	if (!segment_ts)
+		av_dict_set(&options, "movflags", "frag_keyframe+empty_moov", 0);
+
+	const bool ret = open_output(file_name, &options);
+
+	av_dict_free(&options);
+
+	if (!ret) {
+		avformat_free_context(output_ctx);
+		output_ctx = nullptr;
+		return false;
+	}
+
+	segment_index += 1;
+	segment_start_time = -1.0;
+	return true;
+}
+
+void packet_muxer::close_segment() {
+	if (output_ctx == nullptr)
+		return;
+
+	close_output();
+	avformat_free_context(output_ctx);
+
+	output_ctx = nullptr;
+}
+
+double packet_muxer::get_packet_time(const AVPacket& p) const {
+	return (p.dts * av_q2d(format_ctx->streams[p.stream_index]->codec->time_base));
+}
+
+bool packet_muxer::segment_full(const AVPacket& p) {
+	const double time = get_packet_time(p);
+
+	if (segment_start_time < 0.0) {
+		segment_start_time = time;
+		return false;
+	}
+
+	if (segment_time > 0 && (time - segment_start_time) >= segment_time)
+		return true;
+	if (segment_size > 0 && file.get_size() >= segment_size)
+		return true;
+
+	return false;
+}
+
+
+void packet_muxer::write_packet(AVPacket* p) {
+	AVPacket q = *p;
+
+	// the queued copy owns the data from here on
+	av_dup_packet(&q);
+	av_init_packet(p);
+
+	p->data = nullptr;
+	p->size = 0;
+
+	pthread_mutex_lock(&queue_mutex);
+
+	if (queued_bytes >= max_queued_bytes) {
+		// the disk has fallen further behind than the queue can absorb
+		printf("[%s] mux queue full (%lu bytes), waiting\n", __func__, queued_bytes);
+		num_stalls += 1;
+
+		while (queued_bytes >= max_queued_bytes && thread_running) {
+			pthread_cond_wait(&space_cond, &queue_mutex);
+		}
+	}
+
+	packets.push_back(q);
+	queued_bytes += q.size;
+
+	pthread_cond_signal(&packet_cond);
+	pthread_mutex_unlock(&queue_mutex);
+}
+
+void packet_muxer::mux_thread_func() {
+	while (true) {
+		pthread_mutex_lock(&queue_mutex);
+
+		while (packets.empty() && keep_running) {
+			pthread_cond_wait(&packet_cond, &queue_mutex);
+		}
+
+		// keeps draining queued packets after keep_running is cleared
+		if (packets.empty()) {
+			pthread_mutex_unlock(&queue_mutex);
+			break;
+		}
+
+		AVPacket p = packets.front();
+
+		packets.pop_front();
+		queued_bytes -= p.size;
+
+		pthread_cond_signal(&space_cond);
+		pthread_mutex_unlock(&queue_mutex);
+
+		if (segment_index > 0 && p.stream_index == 0 && (p.flags & AV_PKT_FLAG_KEY) != 0 && segment_full(p)) {
+			const double t0 = get_current_time();
+
+			// only this thread waits for the switch, the encoders keep queueing
+			close_segment();
+			open_segment();
+
+			// the keyframe that rolled over is the new segment's first packet
+			segment_start_time = get_packet_time(p);
+
+			max_switch_time = std::max(max_switch_time, get_current_time() - t0);
+			printf("[%s] switched to segment %u in %.1fms\n", __func__, segment_index - 1, (get_current_time() - t0) * 1000.0);
+		}
+
+		if (output_ctx == nullptr) {
+			// segment could not be opened, drop packets until the next one
+			av_free_packet(&p);
+			continue;
+		}
+
+		const AVStream* stream = output_ctx->streams[p.stream_index];
+
+		if (p.pts != AV_NOPTS_VALUE)
+			p.pts = av_rescale_q(p.pts, stream->codec->time_base, stream->time_base);
+		if (p.dts != AV_NOPTS_VALUE)
+			p.dts = av_rescale_q(p.dts, stream->codec->time_base, stream->time_base);
+
+		const double t0 = get_current_time();
+
+		// takes over the packet, holding it back until the other stream catches up
+		if (av_interleaved_write_frame(output_ctx, &p) < 0)
+			fprintf(stderr, "[%s] could not write packet (stream %d)\n", __func__, p.stream_index);
+
+		max_write_time = std::max(max_write_time, get_current_time() - t0);
+		num_packets += 1;
+	}
+
+	printf("[%s] exiting\n", __func__);
+}
+
@@ -0,0 +1,158 @@
+#ifndef PACKET_MUX_HDR
+#define PACKET_MUX_HDR
+
+extern "C" {
+#include <avcodec.h>
+#include <avformat.h>
+}
+
+#include <pthread.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+
+
+// write-back file behind the muxer's AVIOContext: sequential output is
+// gathered in one large aligned buffer and written out a whole buffer at
+// a time (optionally with O_DIRECT) into space preallocated ahead of it;
+// the few writes that seek back (container size fields) are done through
+// the page cache
+class output_file {
+public:
+	output_file() = default;
+	output_file(const output_file&) = delete;
+	~output_file() { close(); }
+
+	output_file& operator = (const output_file&) = delete;
+
+	bool open(const char* file_name, size_t buffer_size, bool direct_io);
+	// writes the buffered tail and trims the preallocated space
+	void close();
+
+	// AVIOContext callbacks
+	int write(const uint8_t* data, int size);
+	int64_t seek(int64_t offset, int whence);
+
+	int64_t get_size() const { return (buffer_offset + buffer_used); }
+
+private:
+	bool flush_buffer();
+
+private:
+	uint8_t* write_buffer = nullptr;
+
+	size_t buffer_size = 0;
+	size_t buffer_used = 0;
+
+	// file offset of write_buffer[0], always a multiple of buffer_size;
+	// everything past it is still in the buffer
+	int64_t buffer_offset = 0;
+	int64_t position = 0;
+	int64_t file_allocated = 0;
+
+	// sequential (possibly O_DIRECT) and random-access writes
+	int direct_desc = -1;
+	int file_desc = -1;
+
+	bool preallocate = true;
+};
+
+
+// owns all output I/O of a recording: encoders hand their packets to
+// write_packet, which only queues them, and a thread of its own muxes
+// them with av_interleaved_write_frame into an output_file, so a slow
+// disk never stalls the encoding thread (until the queue fills up).
+// with segmenting enabled the output rolls over to a new self-contained
+// file (fragmented MP4 or MPEG-TS) on the first video keyframe past the
+// segment's duration or size, so a crash loses at most the open fragment
+class packet_muxer {
+public:
+	// <format_ctx> holds the streams; in segment mode it is only a template
+	packet_muxer(AVFormatContext* format_ctx);
+	~packet_muxer();
+
+	// reads SNAPSHOT_MUX_QUEUE and SNAPSHOT_WRITE_BUFFER (MB) and SNAPSHOT_DIRECT_IO
+	static size_t get_config_queue_size();
+	static size_t get_config_buffer_size();
+	static bool get_config_direct_io();
+	// reads SNAPSHOT_SEGMENT_TIME (seconds), SNAPSHOT_SEGMENT_SIZE (MB)
+	// and SNAPSHOT_SEGMENT_FORMAT (mp4 or ts); segmenting is off unless
+	// a duration or size is set
+	static int get_config_segment_time();
+	static int64_t get_config_segment_size();
+	static bool get_config_segment_ts();
+	// container for <file_name>, or the segment container in segment mode
+	static AVOutputFormat* get_config_format(const char* file_name);
+
+	// opens the file (or first segment), writes the header and starts the muxer thread
+	bool open(const char* file_name);
+	// muxes what is still queued, writes the trailer and closes the file
+	void close();
+
+	// takes over the packet's data and leaves <p> empty; timestamps are
+	// in the time base of the stream's codec context
+	void write_packet(AVPacket* p);
+
+	void mux_thread_func();
+
+private:
+	bool open_output(const char* file_name, AVDictionary** options);
+	void close_output();
+
+	bool open_segment();
+	void close_segment();
+	// true if <p> (a video keyframe) should start a new segment
+	bool segment_full(const AVPacket& p);
+	// dts of <p> in seconds
+	double get_packet_time(const AVPacket& p) const;
+
+private:
+	std::deque<AVPacket> packets;
+
+	output_file file;
+
+	pthread_t mux_thread;
+
+	pthread_mutex_t queue_mutex;
+	// signalled when packets are queued, and when queue space is freed
+	pthread_cond_t packet_cond;
+	pthread_cond_t space_cond;
+
+	// the recorder's context, and the one currently written (a copy of
+	// it per segment, or the same one if not segmenting)
+	AVFormatContext* format_ctx = nullptr;
+	AVFormatContext* output_ctx = nullptr;
+	AVIOContext* io_ctx = nullptr;
+
+	// output file name without its extension
+	std::string segment_base;
+
+	size_t queued_bytes = 0;
+	size_t max_queued_bytes = 0;
+
+	uint64_t num_packets = 0;
+	uint64_t num_stalls = 0;
+	uint64_t bytes_written = 0;
+
+	int64_t segment_size = 0;
+
+	// longest single av_interleaved_write_frame call, and segment switch
+	double max_write_time = 0.0;
+	double max_switch_time = 0.0;
+
+	// time of the segment's first video packet, negative until it is written
+	double segment_start_time = -1.0;
+
+	unsigned int segment_index = 0;
+
+	int segment_time = 0;
+
+	bool segment_ts = false;
+	bool keep_running = true;
+	bool thread_running = false;
+};
+
+#endif
+
@@ -0,0 +1,287 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "pulse_capture.hpp"
+#include "audio_gain.hpp"
+#include "rec_config.hpp"
+
+static const char* audio_latency_env_var = "SNAPSHOT_AUDIO_LATENCY";
+
+
+extern double get_current_time();
+
+static void context_state_proc(pa_context* c, void* userdata) {
+	reinterpret_cast<pulse_capture*>(userdata)->context_state_callback(c);
+}
+
+static void stream_state_proc(pa_stream* s, void* userdata) {
+	pulse_capture_stream* stream = reinterpret_cast<pulse_capture_stream*>(userdata);
+	stream->owner->stream_state_callback(stream);
+}
+
+static void stream_read_proc(pa_stream* s, size_t nbytes, void* userdata) {
+	pulse_capture_stream* stream = reinterpret_cast<pulse_capture_stream*>(userdata);
+	stream->owner->stream_read_callback(stream);
+}
+
+
+
+pulse_capture::pulse_capture(frame_queue* queue, char* scratch) {
+	this->queue = queue;
+	this->scratch = scratch;
+}
+
+
+int pulse_capture::get_config_latency() {
+	return (std::max(get_config_int(audio_latency_env_var, 10), 1));
+}
+
+
+void pulse_capture::add_source(const char* source_name, const audio_gain* gain) {
+	pulse_capture_stream s;
+	s.owner = this;
+	s.source_name = (source_name != nullptr)? source_name: "";
+	s.gain = gain;
+	s.index = streams.size();
+
+	streams.push_back(s);
+}
+
+
+bool pulse_capture::start(int sample_rate, int channels, size_t block_samples) {
+	if (streams.empty())
+		return false;
+
+	block_size = block_samples;
+	block_frame_size = audio_gain::get_sample_size(streams[0].gain->get_dst_format()) * channels;
+
+	this->sample_rate = sample_rate;
+	this->num_channels = channels;
+
+	mainloop = pa_threaded_mainloop_new();
+	context = pa_context_new(pa_threaded_mainloop_get_api(mainloop), "SnapShot Record");
+
+	pa_context_set_state_callback(context, context_state_proc, this);
+
+	if (pa_context_connect(context, nullptr, PA_CONTEXT_NOFLAGS, nullptr) < 0) {
+		printf("[%s] could not connect to PA-server\n", __func__);
+		stop();
+		return false;
+	}
+
+	pa_threaded_mainloop_lock(mainloop);
+	pa_threaded_mainloop_start(mainloop);
+
+	// the state callbacks signal every transition
+	while (!context_ready && !context_failed)
+		pa_threaded_mainloop_wait(mainloop);
+
+	size_t num_ready = 0;
+
+	if (context_ready) {
+		for (pulse_capture_stream& s: streams) {
+			if (!connect_stream(&s))
+				s.failed = true;
+		}
+
+		// all streams connect concurrently, wait for each to settle
+		for (pulse_capture_stream& s: streams) {
+			while (!s.ready && !s.failed && !context_failed)
+				pa_threaded_mainloop_wait(mainloop);
+
+			if (!s.ready) {
+				printf("[%s] could not record from \"%s\" (error %d)\n", __func__, s.source_name.c_str(), pa_context_errno(context));
+				continue;
+			}
+
+			const pa_buffer_attr* stream_attr = pa_stream_get_buffer_attr(s.stream);
+			const pa_sample_spec* stream_spec = pa_stream_get_sample_spec(s.stream);
+
+			printf("[%s] recording from \"%s\" (%s, %uHz, %lu-sample blocks, %u-byte fragments)\n", __func__,
+				pa_stream_get_device_name(s.stream),
+				pa_sample_format_to_string(stream_spec->format),
+				stream_spec->rate,
+				block_size,
+				stream_attr->fragsize
+			);
+
+			num_ready += 1;
+		}
+	}
+
+	pa_threaded_mainloop_unlock(mainloop);
+
+	if (num_ready == 0) {
+		printf("[%s] could not create any audio-stream\n", __func__);
+		stop();
+		return false;
+	}
+
+	return true;
+}
+
+bool pulse_capture::connect_stream(pulse_capture_stream* s) {
+	const pa_sample_spec ss = {
+		.format = (s->gain->get_src_format() == AUDIO_SAMPLE_FLOAT)? PA_SAMPLE_FLOAT32LE: PA_SAMPLE_S16LE,
+		.rate = uint32_t(sample_rate),
+		.channels = uint8_t(num_channels)
+	};
+
+	const pa_stream_flags_t flags = pa_stream_flags_t(PA_STREAM_ADJUST_LATENCY | PA_STREAM_INTERPOLATE_TIMING | PA_STREAM_AUTO_TIMING_UPDATE);
+
+	// fragments of the requested latency instead of the server's default (~2s)
+	pa_buffer_attr attr;
+	attr.maxlength = uint32_t(-1);
+	attr.tlength = uint32_t(-1);
+	attr.prebuf = uint32_t(-1);
+	attr.minreq = uint32_t(-1);
+	attr.fragsize = pa_usec_to_bytes(get_config_latency() * PA_USEC_PER_MSEC, &ss);
+
+	s->capture_frame_size = pa_frame_size(&ss);
+
+	if ((s->stream = pa_stream_new(context, s->source_name.c_str(), &ss, nullptr)) == nullptr)
+		return false;
+
+	pa_stream_set_state_callback(s->stream, stream_state_proc, s);
+	pa_stream_set_read_callback(s->stream, stream_read_proc, s);
+
+	return (pa_stream_connect_record(s->stream, (!s->source_name.empty())? s->source_name.c_str(): nullptr, &attr, flags) >= 0);
+}
+
+void pulse_capture::stop() {
+	if (mainloop == nullptr)
+		return;
+
+	// the mainloop thread only ever waits in poll, stopping it never blocks on the device
+	pa_threaded_mainloop_stop(mainloop);
+
+	for (pulse_capture_stream& s: streams) {
+		if (s.stream != nullptr) {
+			pa_stream_disconnect(s.stream);
+			pa_stream_unref(s.stream);
+		}
+
+		// partial last blocks never get queued
+		if (s.slot != nullptr)
+			queue->cancel_slot(s.slot);
+
+		s.stream = nullptr;
+		s.slot = nullptr;
+	}
+
+	if (context != nullptr) {
+		pa_context_disconnect(context);
+		pa_context_unref(context);
+	}
+
+	pa_threaded_mainloop_free(mainloop);
+
+	mainloop = nullptr;
+	context = nullptr;
+}
+
+
+void pulse_capture::context_state_callback(pa_context* c) {
+	switch (pa_context_get_state(c)) {
+		case PA_CONTEXT_READY: {
+			context_ready = true;
+		} break;
+
+		case PA_CONTEXT_FAILED:
+		case PA_CONTEXT_TERMINATED: {
+			context_failed = true;
+		} break;
+
+		default: {
+		} break;
+	}
+
+	pa_threaded_mainloop_signal(mainloop, 0);
+}
+
+void pulse_capture::stream_state_callback(pulse_capture_stream* s) {
+	switch (pa_stream_get_state(s->stream)) {
+		case PA_STREAM_READY: {
+			s->ready = true;
+		} break;
+
+		case PA_STREAM_FAILED:
+		case PA_STREAM_TERMINATED: {
+			s->failed = true;
+		} break;
+
+		default: {
+		} break;
+	}
+
+	pa_threaded_mainloop_signal(mainloop, 0);
+}
+
+void pulse_capture::stream_read_callback(pulse_capture_stream* s) {
+	const void* data = nullptr;
+	size_t size = 0;
+
+	while (pa_stream_peek(s->stream, &data, &size) == 0 && size > 0) {
+		// nothing but a hole in the stream
+		if (data == nullptr) {
+			pa_stream_drop(s->stream);
+			continue;
+		}
+
+		pa_usec_t latency = 0;
+		int negative = 0;
+
+		// for record streams: how long ago the first unread sample was captured
+		if (pa_stream_get_latency(s->stream, &latency, &negative) != 0 || negative != 0)
+			latency = 0;
+
+		max_latency = std::max(max_latency, latency);
+
+		append_samples(s, reinterpret_cast<const char*>(data), size, get_current_time() - (latency / 1000000.0));
+		pa_stream_drop(s->stream);
+	}
+}
+
+
+void pulse_capture::append_samples(pulse_capture_stream* s, const char* data, size_t size, double time) {
+	// fragments hold whole frames
+	size_t num_frames = size / s->capture_frame_size;
+
+	while (num_frames > 0) {
+		if (s->block_used == 0) {
+			// encoder is behind and holds every block; keep draining the stream
+			s->slot = queue->acquire_slot();
+			s->block_data = (s->slot != nullptr)? s->slot->data: scratch;
+			s->block_time = time;
+		}
+
+		const size_t n = std::min(num_frames, block_size - s->block_used);
+
+		// the one pass over the samples: gain, and the format conversion if any
+		s->gain->apply(data, &s->block_data[s->block_used * block_frame_size], n * num_channels);
+
+		s->block_used += n;
+		data += n * s->capture_frame_size;
+		num_frames -= n;
+		time += (double(n) / sample_rate);
+
+		if (s->block_used == block_size)
+			finish_block(s);
+	}
+}
+
+void pulse_capture::finish_block(pulse_capture_stream* s) {
+	s->block_used = 0;
+
+	if (s->slot == nullptr)
+		return;
+
+	s->slot->time = s->block_time;
+	s->slot->size = block_size * block_frame_size;
+	s->slot->source = s->index;
+
+	queue->commit_slot(s->slot);
+	s->slot = nullptr;
+}
+
@@ -0,0 +1,108 @@
+#ifndef PULSE_CAPTURE_HDR
+#define PULSE_CAPTURE_HDR
+
+#include <pulse/pulseaudio.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "frame_queue.hpp"
+
+class audio_gain;
+class pulse_capture;
+
+
+// one record stream and the block it is filling
+struct pulse_capture_stream {
+	pulse_capture* owner = nullptr;
+	pa_stream* stream = nullptr;
+
+	std::string source_name;
+
+	const audio_gain* gain = nullptr;
+
+	frame_slot* slot = nullptr;
+	// slot->data, or the scratch block while the queue is full
+	char* block_data = nullptr;
+
+	// in frames
+	size_t block_used = 0;
+	size_t capture_frame_size = 0;
+
+	// capture time of the block's first sample
+	double block_time = 0.0;
+
+	int index = 0;
+
+	bool ready = false;
+	bool failed = false;
+};
+
+
+// records from one or more PulseAudio sources on a threaded mainloop;
+// each stream's read callback copies every fragment straight from
+// PulseAudio's memory block into the slots of an audio queue (scaled,
+// and converted if the queue runs in another sample format on the way),
+// stamping a block with the capture time of its first sample as soon as
+// it is complete. all callbacks run on the mainloop's thread, so streams
+// share the queue as a single producer; blocks carry their source index
+class pulse_capture {
+public:
+	// <scratch> holds one block and is written to while the queue is full
+	pulse_capture(frame_queue* queue, char* scratch);
+	~pulse_capture() { stop(); }
+
+	// reads SNAPSHOT_AUDIO_LATENCY (milliseconds, default 10)
+	static int get_config_latency();
+
+	// before start; the stream is opened in <gain>'s source format, its
+	// blocks hold the destination format (the same for every source)
+	void add_source(const char* source_name, const audio_gain* gain);
+
+	// <block_samples> frames of <channels> per queued block; succeeds if
+	// any source could be opened, the others stay silent
+	bool start(int sample_rate, int channels, size_t block_samples);
+	// returns without waiting on the device; partial blocks are discarded
+	void stop();
+
+	void context_state_callback(pa_context* c);
+	void stream_state_callback(pulse_capture_stream* s);
+	void stream_read_callback(pulse_capture_stream* s);
+
+	double get_latency() const { return (max_latency / 1000000.0); }
+
+private:
+	bool connect_stream(pulse_capture_stream* s);
+
+	void append_samples(pulse_capture_stream* s, const char* data, size_t size, double time);
+	void finish_block(pulse_capture_stream* s);
+
+private:
+	pa_threaded_mainloop* mainloop = nullptr;
+	pa_context* context = nullptr;
+
+	// not resized once started, callbacks hold pointers into it
+	std::vector<pulse_capture_stream> streams;
+
+	frame_queue* queue = nullptr;
+
+	char* scratch = nullptr;
+
+	// in frames, and bytes per queued frame
+	size_t block_size = 0;
+	size_t block_frame_size = 0;
+
+	// largest latency PulseAudio reported, in microseconds
+	pa_usec_t max_latency = 0;
+
+	int sample_rate = 0;
+	int num_channels = 0;
+
+	bool context_ready = false;
+	bool context_failed = false;
+};
+
+#endif
+
@@ -0,0 +1,197 @@
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <ctime>
+
+#include "pulse_devices.hpp"
+#include "game_clock.hpp"
+
+
+static void context_state_proc(pa_context* c, void* userdata) {
+	reinterpret_cast<pulse_device_list*>(userdata)->context_state_callback(c);
+}
+
+static void subscribe_proc(pa_context* c, pa_subscription_event_type_t type, uint32_t idx, void* userdata) {
+	reinterpret_cast<pulse_device_list*>(userdata)->subscribe_callback(type);
+}
+
+static void source_info_proc(pa_context* c, const pa_source_info* i, int eol, void* userdata) {
+	reinterpret_cast<pulse_device_list*>(userdata)->source_info_callback(i, eol);
+}
+
+static void server_info_proc(pa_context* c, const pa_server_info* i, void* userdata) {
+	reinterpret_cast<pulse_device_list*>(userdata)->server_info_callback(i);
+}
+
+
+
+pulse_device_list::pulse_device_list() {
+	pthread_mutex_init(&devices_mutex, nullptr);
+	pthread_cond_init(&devices_cond, nullptr);
+}
+
+pulse_device_list::~pulse_device_list() {
+	stop();
+
+	pthread_cond_destroy(&devices_cond);
+	pthread_mutex_destroy(&devices_mutex);
+}
+
+
+bool pulse_device_list::start() {
+	mainloop = pa_threaded_mainloop_new();
+	context = pa_context_new(pa_threaded_mainloop_get_api(mainloop), "SnapShot Devices");
+
+	pa_context_set_state_callback(context, context_state_proc, this);
+	pa_context_set_subscribe_callback(context, subscribe_proc, this);
+
+	if (pa_context_connect(context, nullptr, PA_CONTEXT_NOFLAGS, nullptr) < 0 || pa_threaded_mainloop_start(mainloop) < 0) {
+		printf("[%s] could not connect to PA-server\n", __func__);
+		stop();
+		publish();
+		return false;
+	}
+
+	return true;
+}
+
+void pulse_device_list::stop() {
+	if (mainloop == nullptr)
+		return;
+
+	pa_threaded_mainloop_stop(mainloop);
+
+	if (context != nullptr) {
+		pa_context_disconnect(context);
+		pa_context_unref(context);
+	}
+
+	pa_threaded_mainloop_free(mainloop);
+
+	mainloop = nullptr;
+	context = nullptr;
+}
+
+
+pulse_device_info pulse_device_list::get_devices(double timeout) {
+	// the condition variable waits on the real clock, not the game's
+	struct timespec deadline;
+	real_clock_gettime(CLOCK_REALTIME, &deadline);
+
+	deadline.tv_sec += time_t(timeout);
+	deadline.tv_nsec += long(std::fmod(timeout, 1.0) * 1000000000.0);
+
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec += 1;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&devices_mutex);
+
+	// only ever waits if a recorder starts right after library load
+	while (!listed) {
+		if (pthread_cond_timedwait(&devices_cond, &devices_mutex, &deadline) == ETIMEDOUT) {
+			printf("[%s] no device listing after %.1fs\n", __func__, timeout);
+			break;
+		}
+	}
+
+	const pulse_device_info info = devices;
+
+	pthread_mutex_unlock(&devices_mutex);
+	return info;
+}
+
+
+void pulse_device_list::context_state_callback(pa_context* c) {
+	switch (pa_context_get_state(c)) {
+		case PA_CONTEXT_READY: {
+			const pa_subscription_mask_t mask = pa_subscription_mask_t(PA_SUBSCRIPTION_MASK_SOURCE | PA_SUBSCRIPTION_MASK_SERVER);
+
+			pa_operation_unref(pa_context_subscribe(c, mask, nullptr, nullptr));
+			refresh();
+		} break;
+
+		case PA_CONTEXT_FAILED:
+		case PA_CONTEXT_TERMINATED: {
+			printf("[%s] lost the PA-server (error %d)\n", __func__, pa_context_errno(c));
+
+			// waiters get whatever was listed last
+			publish();
+		} break;
+
+		default: {
+		} break;
+	}
+}
+
+void pulse_device_list::subscribe_callback(pa_subscription_event_type_t type) {
+	// sources come and go (or change format), the default sink or source moved
+	refresh();
+}
+
+void pulse_device_list::source_info_callback(const pa_source_info* i, int eol) {
+	if (eol < 0) {
+		printf("[%s] could not list sources (error %d)\n", __func__, pa_context_errno(context));
+		listing = false;
+		return;
+	}
+
+	if (eol > 0) {
+		pa_operation_unref(pa_context_get_server_info(context, server_info_proc, this));
+		return;
+	}
+
+	if (num_listings == 0) {
+		char spec[PA_SAMPLE_SPEC_SNPRINT_MAX];
+		printf("[%s] PA source name=\"%s\" descr=\"%s\" spec=\"%s\"\n", __func__, i->name, i->description, pa_sample_spec_snprint(spec, sizeof(spec), &i->sample_spec));
+	}
+
+	pending.source_specs[i->name] = i->sample_spec;
+
+	if (i->monitor_of_sink != PA_INVALID_INDEX)
+		pending.monitor_sources[i->monitor_of_sink_name] = i->name;
+}
+
+void pulse_device_list::server_info_callback(const pa_server_info* i) {
+	pending.default_sink = (i->default_sink_name != nullptr)? i->default_sink_name: "";
+	pending.default_source = (i->default_source_name != nullptr)? i->default_source_name: "";
+
+	printf("[%s] %lu PA sources, default sink=\"%s\" source=\"%s\"\n", __func__, pending.source_specs.size(), pending.default_sink.c_str(), pending.default_source.c_str());
+
+	pthread_mutex_lock(&devices_mutex);
+	devices = pending;
+	listed = true;
+	pthread_cond_broadcast(&devices_cond);
+	pthread_mutex_unlock(&devices_mutex);
+
+	listing = false;
+	num_listings += 1;
+
+	if (refresh_again)
+		refresh();
+}
+
+
+void pulse_device_list::refresh() {
+	// events tend to come in bursts, one listing after the running one covers them all
+	if (listing) {
+		refresh_again = true;
+		return;
+	}
+
+	listing = true;
+	refresh_again = false;
+	pending = pulse_device_info();
+
+	pa_operation_unref(pa_context_get_source_info_list(context, source_info_proc, this));
+}
+
+// wakes waiters without a new listing
+void pulse_device_list::publish() {
+	pthread_mutex_lock(&devices_mutex);
+	listed = true;
+	pthread_cond_broadcast(&devices_cond);
+	pthread_mutex_unlock(&devices_mutex);
+}
+
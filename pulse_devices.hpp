@@ -0,0 +1,71 @@
+#ifndef PULSE_DEVICES_HDR
+#define PULSE_DEVICES_HDR
+
+#include <pulse/pulseaudio.h>
+#include <pthread.h>
+
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+
+
+struct pulse_device_info {
+	// monitor source of every sink, by sink name
+	std::unordered_map<std::string, std::string> monitor_sources;
+	// native format of every source, by source name
+	std::unordered_map<std::string, pa_sample_spec> source_specs;
+
+	std::string default_sink;
+	std::string default_source;
+};
+
+
+// lists the server's sources and defaults on a threaded mainloop of its
+// own, from library load on, and lists them again whenever a source or
+// the server's defaults change (subscription events), so a recorder can
+// look its devices up without a round-trip to the server
+class pulse_device_list {
+public:
+	pulse_device_list();
+	~pulse_device_list();
+
+	// connects and returns; the listing arrives in the background
+	bool start();
+	void stop();
+
+	// copy of the latest listing; waits up to <timeout> seconds for the
+	// first one, returns an empty listing if there is none by then
+	pulse_device_info get_devices(double timeout);
+
+	void context_state_callback(pa_context* c);
+	void subscribe_callback(pa_subscription_event_type_t type);
+	void source_info_callback(const pa_source_info* i, int eol);
+	void server_info_callback(const pa_server_info* i);
+
+private:
+	// starts a full listing, or queues another one behind the running one
+	void refresh();
+	void publish();
+
+private:
+	pa_threaded_mainloop* mainloop = nullptr;
+	pa_context* context = nullptr;
+
+	// guards devices and listed
+	pthread_mutex_t devices_mutex;
+	pthread_cond_t devices_cond;
+
+	pulse_device_info devices;
+	// being filled by the running listing, mainloop thread only
+	pulse_device_info pending;
+
+	size_t num_listings = 0;
+
+	bool listed = false;
+	// mainloop thread only
+	bool listing = false;
+	bool refresh_again = false;
+};
+
+#endif
+
@@ -0,0 +1,93 @@
+#include <pthread.h>
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+
+#include "rec_config.hpp"
+
+static const char* config_env_var = "SNAPSHOT_CONFIG";
+
+static std::unordered_map<std::string, std::string> config_values;
+static pthread_once_t config_once = PTHREAD_ONCE_INIT;
+
+
+static std::string trim_string(const std::string& str) {
+	size_t i = 0;
+	size_t j = str.size();
+
+	while (i < j && isspace(str[i    ])) i++;
+	while (j > i && isspace(str[j - 1])) j--;
+
+	return (str.substr(i, j - i));
+}
+
+static void load_config_file() {
+	const char* config_file = getenv(config_env_var);
+
+	if (config_file == nullptr)
+		return;
+
+	FILE* f = fopen(config_file, "r");
+
+	if (f == nullptr) {
+		fprintf(stderr, "[%s] could not open config file \"%s\"\n", __func__, config_file);
+		return;
+	}
+
+	char line[1024];
+
+	for (unsigned int line_num = 1; fgets(line, sizeof(line), f) != nullptr; line_num++) {
+		char* comment = strchr(line, '#');
+
+		if (comment != nullptr)
+			*comment = 0;
+
+		const std::string str = trim_string(line);
+
+		if (str.empty())
+			continue;
+
+		const size_t sep = str.find('=');
+
+		if (sep == std::string::npos) {
+			fprintf(stderr, "[%s] ignoring malformed line %u in \"%s\"\n", __func__, line_num, config_file);
+			continue;
+		}
+
+		config_values[trim_string(str.substr(0, sep))] = trim_string(str.substr(sep + 1));
+	}
+
+	fclose(f);
+	printf("[%s] read %lu settings from \"%s\"\n", __func__, config_values.size(), config_file);
+}
+
+
+const char* get_config_value(const char* name) {
+	const char* env_value = getenv(name);
+
+	if (env_value != nullptr)
+		return env_value;
+
+	pthread_once(&config_once, load_config_file);
+
+	const auto it = config_values.find(name);
+
+	if (it == config_values.end())
+		return nullptr;
+
+	return ((it->second).c_str());
+}
+
+int get_config_int(const char* name, int def_value) {
+	const char* value = get_config_value(name);
+
+	if (value == nullptr || strlen(value) == 0)
+		return def_value;
+
+	return (atoi(value));
+}
+
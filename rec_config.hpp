@@ -0,0 +1,12 @@
+#ifndef REC_CONFIG_HDR
+#define REC_CONFIG_HDR
+
+// looks up a SNAPSHOT_* setting; the environment takes precedence over
+// the file named by SNAPSHOT_CONFIG, which holds one NAME=value pair per
+// line ('#' starts a comment). returns nullptr if the setting is absent
+const char* get_config_value(const char* name);
+
+int get_config_int(const char* name, int def_value);
+
+#endif
+
@@ -0,0 +1,430 @@
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "replay_ring.hpp"
+#include "buffer_pool.hpp"
+#include "rec_config.hpp"
+
+static const char* replay_env_var = "SNAPSHOT_REPLAY";
+static const char* replay_memory_env_var = "SNAPSHOT_REPLAY_MEMORY";
+
+
+extern double get_current_time();
+
+static void* dump_thread_proc(void* arg) {
+	reinterpret_cast<replay_ring*>(arg)->dump_thread_func();
+	return nullptr;
+}
+
+static bool is_video_keyframe(const replay_packet& p) {
+	return (p.stream_index == 0 && (p.flags & AV_PKT_FLAG_KEY) != 0);
+}
+
+static replay_stream_params get_stream_params(const AVCodecContext* ctx) {
+	replay_stream_params params;
+
+	params.codec_type = ctx->codec_type;
+	params.codec_id = ctx->codec_id;
+	params.time_base = ctx->time_base;
+	params.bit_rate = ctx->bit_rate;
+	params.flags = ctx->flags;
+	params.has_b_frames = ctx->has_b_frames;
+	params.bits_per_coded_sample = ctx->bits_per_coded_sample;
+
+	params.width = ctx->width;
+	params.height = ctx->height;
+	params.pix_fmt = ctx->pix_fmt;
+	params.color_space = ctx->colorspace;
+	params.color_range = ctx->color_range;
+	params.sample_aspect_ratio = ctx->sample_aspect_ratio;
+
+	params.sample_rate = ctx->sample_rate;
+	params.channels = ctx->channels;
+	params.channel_layout = ctx->channel_layout;
+	params.sample_fmt = ctx->sample_fmt;
+	params.frame_size = ctx->frame_size;
+
+	if (ctx->extradata != nullptr && ctx->extradata_size > 0)
+		params.extradata.assign(ctx->extradata, ctx->extradata + ctx->extradata_size);
+
+	return params;
+}
+
+static bool set_stream_params(AVCodecContext* ctx, const replay_stream_params& params) {
+	ctx->codec_type = params.codec_type;
+	ctx->codec_id = static_cast<decltype(ctx->codec_id)>(params.codec_id);
+	ctx->codec_tag = 0;
+	ctx->time_base = params.time_base;
+	ctx->bit_rate = params.bit_rate;
+	ctx->flags = params.flags;
+	ctx->has_b_frames = params.has_b_frames;
+	ctx->bits_per_coded_sample = params.bits_per_coded_sample;
+
+	ctx->width = params.width;
+	ctx->height = params.height;
+	ctx->pix_fmt = static_cast<decltype(ctx->pix_fmt)>(params.pix_fmt);
+	ctx->colorspace = static_cast<AVColorSpace>(params.color_space);
+	ctx->color_range = static_cast<AVColorRange>(params.color_range);
+	ctx->sample_aspect_ratio = params.sample_aspect_ratio;
+
+	ctx->sample_rate = params.sample_rate;
+	ctx->channels = params.channels;
+	ctx->channel_layout = params.channel_layout;
+	ctx->sample_fmt = static_cast<AVSampleFormat>(params.sample_fmt);
+	ctx->frame_size = params.frame_size;
+
+	if (params.extradata.empty())
+		return true;
+
+	// freed with the format context
+	if ((ctx->extradata = reinterpret_cast<uint8_t*>(av_mallocz(params.extradata.size() + FF_INPUT_BUFFER_PADDING_SIZE))) == nullptr)
+		return false;
+
+	memcpy(ctx->extradata, params.extradata.data(), params.extradata.size());
+	ctx->extradata_size = params.extradata.size();
+	return true;
+}
+
+
+
+replay_ring::replay_ring(buffer_pool* pool, double seconds, AVCodecContext* video_ctx, const std::vector<AVCodecContext*>& audio_ctxs) {
+	max_seconds = seconds;
+
+	// the encoders are open, so their extradata is final
+	stream_params.push_back(get_stream_params(video_ctx));
+
+	for (const AVCodecContext* ctx: audio_ctxs)
+		stream_params.push_back(get_stream_params(ctx));
+
+	max_packets = get_max_packets(seconds);
+	data_size = get_config_memory();
+
+	data_arena = reinterpret_cast<uint8_t*>(pool->alloc(data_size));
+	packets = reinterpret_cast<replay_packet*>(pool->alloc(max_packets * sizeof(replay_packet)));
+
+	if (data_arena == nullptr || packets == nullptr) {
+		fprintf(stderr, "[%s] could not allocate replay ring\n", __func__);
+		exit(1);
+	}
+
+	pthread_mutex_init(&ring_mutex, nullptr);
+	pthread_mutex_init(&dump_mutex, nullptr);
+	pthread_cond_init(&dump_cond, nullptr);
+	pthread_create(&dump_thread, nullptr, dump_thread_proc, this);
+
+	printf("[%s] keeping up to %.1fs of packets in %lu bytes (+%lu bytes index)\n", __func__, seconds, data_size, max_packets * sizeof(replay_packet));
+}
+
+replay_ring::~replay_ring() {
+	pthread_mutex_lock(&dump_mutex);
+	keep_running = false;
+	pthread_cond_signal(&dump_cond);
+	pthread_mutex_unlock(&dump_mutex);
+
+	// finishes requests that are already pending
+	pthread_join(dump_thread, nullptr);
+
+	pthread_cond_destroy(&dump_cond);
+	pthread_mutex_destroy(&dump_mutex);
+	pthread_mutex_destroy(&ring_mutex);
+}
+
+
+double replay_ring::get_config_seconds() {
+	const char* seconds_env = get_config_value(replay_env_var);
+
+	if (seconds_env == nullptr || strlen(seconds_env) == 0)
+		return 0.0;
+
+	return (std::max(atof(seconds_env), 0.0));
+}
+
+size_t replay_ring::get_max_packets(double seconds) {
+	// generous for 240Hz video plus audio; the byte arena is the real limit
+	return (std::max(size_t(seconds * 512), size_t(64)));
+}
+
+size_t replay_ring::get_pool_size() {
+	const size_t index_size = get_max_packets(get_config_seconds()) * sizeof(replay_packet);
+	return (buffer_pool::align_size(get_config_memory()) + buffer_pool::align_size(index_size));
+}
+
+size_t replay_ring::get_config_memory() {
+	return (size_t(std::max(get_config_int(replay_memory_env_var, 256), 1)) * 1024 * 1024);
+}
+
+
+
+// finds room for <size> bytes after the newest packet without reaching the
+// oldest one; data never wraps within a packet, the arena tail is skipped
+bool replay_ring::reserve_data(size_t size, size_t* offset) {
+	if (num_packets == 0) {
+		*offset = 0;
+		return (size <= data_size);
+	}
+
+	const size_t front_offset = packets[packet_head].offset;
+
+	if (data_head > front_offset) {
+		if ((data_head + size) <= data_size) {
+			*offset = data_head;
+			return true;
+		}
+		if (size < front_offset) {
+			*offset = 0;
+			return true;
+		}
+
+		return false;
+	}
+
+	if ((data_head + size) < front_offset) {
+		*offset = data_head;
+		return true;
+	}
+
+	return false;
+}
+
+void replay_ring::pop_packet() {
+	packet_head = (packet_head + 1) % max_packets;
+	num_packets -= 1;
+}
+
+void replay_ring::pop_gop() {
+	keyframe_seqs.pop_front();
+
+	// up to the next keyframe, or everything if this was the only GOP
+	const uint64_t end_seq = keyframe_seqs.empty()? next_seq: keyframe_seqs.front();
+
+	while (get_front_seq() < end_seq)
+		pop_packet();
+}
+
+
+void replay_ring::push_packet(const AVPacket& p) {
+	if (p.size <= 0 || p.stream_index < 0 || p.stream_index >= int(stream_params.size()))
+		return;
+
+	replay_packet packet;
+	packet.size = p.size;
+	packet.pts = p.pts;
+	packet.dts = (p.dts != AV_NOPTS_VALUE)? p.dts: p.pts;
+	packet.time = packet.dts * av_q2d(stream_params[p.stream_index].time_base);
+	packet.flags = p.flags;
+	packet.stream_index = p.stream_index;
+
+	const bool keyframe = is_video_keyframe(packet);
+
+	pthread_mutex_lock(&ring_mutex);
+
+	// the rest of a GOP that lost a frame can not be decoded either
+	if (keyframe) {
+		skip_to_keyframe = false;
+	} else if (skip_to_keyframe && packet.stream_index == 0) {
+		pthread_mutex_unlock(&ring_mutex);
+		return;
+	}
+
+	// whole GOPs that ended before the window; the newest one is always
+	// kept, however long it runs
+	while (keyframe_seqs.size() > 1 && (packet.time - packets[get_index(keyframe_seqs[1])].time) > max_seconds)
+		pop_gop();
+
+	bool fits = false;
+
+	// older GOPs until this packet fits; the newest one only makes room
+	// for the keyframe that ends it
+	while (!(fits = (num_packets < max_packets && reserve_data(packet.size, &packet.offset)))) {
+		if (keyframe_seqs.empty() || (keyframe_seqs.size() == 1 && !keyframe))
+			break;
+
+		pop_gop();
+	}
+
+	// the ring starts on a keyframe
+	if (!fits || (num_packets == 0 && !keyframe)) {
+		skip_to_keyframe = skip_to_keyframe || (packet.stream_index == 0);
+		pthread_mutex_unlock(&ring_mutex);
+		return;
+	}
+
+	memcpy(&data_arena[packet.offset], p.data, packet.size);
+
+	if (keyframe)
+		keyframe_seqs.push_back(next_seq);
+
+	packets[(packet_head + num_packets) % max_packets] = packet;
+	num_packets += 1;
+	next_seq += 1;
+	data_head = packet.offset + packet.size;
+
+	pthread_mutex_unlock(&ring_mutex);
+}
+
+void replay_ring::request_dump(const char* file_name) {
+	pthread_mutex_lock(&dump_mutex);
+	dump_requests.push_back(std::make_pair(std::string(file_name), get_current_time()));
+	pthread_cond_signal(&dump_cond);
+	pthread_mutex_unlock(&dump_mutex);
+}
+
+
+
+void replay_ring::dump_thread_func() {
+	std::vector<replay_packet> dump_packets;
+	std::vector<uint8_t> dump_data;
+
+	dump_data.reserve(data_size);
+
+	while (true) {
+		pthread_mutex_lock(&dump_mutex);
+
+		while (keep_running && dump_requests.empty())
+			pthread_cond_wait(&dump_cond, &dump_mutex);
+
+		if (dump_requests.empty()) {
+			pthread_mutex_unlock(&dump_mutex);
+			break;
+		}
+
+		const std::pair<std::string, double> request = dump_requests.front();
+
+		dump_requests.erase(dump_requests.begin());
+		pthread_mutex_unlock(&dump_mutex);
+
+		const double copy_start_time = get_current_time();
+
+		{
+			// only the index is copied under the lock, the encoder never
+			// waits for the (up to arena-sized) data copy or the file
+			pthread_mutex_lock(&ring_mutex);
+
+			const uint64_t first_seq = get_front_seq();
+
+			dump_packets.resize(num_packets);
+
+			for (size_t i = 0; i < num_packets; i++)
+				dump_packets[i] = packets[(packet_head + i) % max_packets];
+
+			pthread_mutex_unlock(&ring_mutex);
+
+			// arena space is only reused after its packet was evicted, so
+			// a packet still in the ring after its copy was copied intact
+			dump_data.resize(0);
+
+			for (replay_packet& packet: dump_packets) {
+				dump_data.insert(dump_data.end(), &data_arena[packet.offset], &data_arena[packet.offset + packet.size]);
+				packet.offset = dump_data.size() - packet.size;
+			}
+
+			pthread_mutex_lock(&ring_mutex);
+			const size_t num_evicted = std::min(size_t(get_front_seq() - first_seq), dump_packets.size());
+			pthread_mutex_unlock(&ring_mutex);
+
+			// evicted while copying; the dump starts at the next keyframe left
+			size_t first = num_evicted;
+
+			while (first < dump_packets.size() && !is_video_keyframe(dump_packets[first]))
+				first++;
+
+			dump_packets.erase(dump_packets.begin(), dump_packets.begin() + first);
+		}
+
+		const double copy_end_time = get_current_time();
+
+		if (dump_packets.empty()) {
+			printf("[%s] replay ring is empty, nothing to dump\n", __func__);
+			continue;
+		}
+
+		if (!write_dump(request.first, dump_packets, dump_data))
+			continue;
+
+		num_dumps += 1;
+
+		printf("[%s] dumped %lu packets (%.2fs, %lu bytes) to \"%s\" in %.1fms (copy %.1fms)\n", __func__,
+			dump_packets.size(),
+			dump_packets.back().time - dump_packets.front().time,
+			dump_data.size(),
+			request.first.c_str(),
+			(get_current_time() - request.second) * 1000.0,
+			(copy_end_time - copy_start_time) * 1000.0
+		);
+	}
+}
+
+bool replay_ring::write_dump(const std::string& file_name, const std::vector<replay_packet>& dump_packets, const std::vector<uint8_t>& dump_data) {
+	AVFormatContext* format_ctx = avformat_alloc_context();
+	std::vector<AVStream*> streams(stream_params.size(), nullptr);
+
+	format_ctx->oformat = av_guess_format(nullptr, file_name.c_str(), nullptr);
+	snprintf(format_ctx->filename, sizeof(format_ctx->filename), "%s", file_name.c_str());
+
+	if (format_ctx->oformat == nullptr || avio_open2(&format_ctx->pb, file_name.c_str(), AVIO_FLAG_WRITE, nullptr, nullptr) < 0) {
+		fprintf(stderr, "[%s] could not open \"%s\"\n", __func__, file_name.c_str());
+		avformat_free_context(format_ctx);
+		return false;
+	}
+
+	bool ret = true;
+
+	for (size_t i = 0; i < stream_params.size() && ret; i++) {
+		streams[i] = av_new_stream(format_ctx, i);
+		ret = (streams[i] != nullptr) && set_stream_params(streams[i]->codec, stream_params[i]);
+	}
+
+	if (!ret || avformat_write_header(format_ctx, nullptr) < 0) {
+		fprintf(stderr, "[%s] could not write header of \"%s\"\n", __func__, file_name.c_str());
+		avio_close(format_ctx->pb);
+		avformat_free_context(format_ctx);
+		unlink(file_name.c_str());
+		return false;
+	}
+
+	// the dump starts at zero on its first (key)frame
+	std::vector<int64_t> base_ts(stream_params.size(), dump_packets[0].dts);
+
+	for (size_t i = 1; i < stream_params.size(); i++)
+		base_ts[i] = av_rescale_q(base_ts[0], stream_params[0].time_base, stream_params[i].time_base);
+
+	for (const replay_packet& packet: dump_packets) {
+		const int idx = packet.stream_index;
+
+		if (!ret)
+			break;
+
+		// audio captured just before the keyframe
+		if (packet.dts < base_ts[idx])
+			continue;
+
+		AVPacket p;
+		av_init_packet(&p);
+
+		p.data = const_cast<uint8_t*>(&dump_data[packet.offset]);
+		p.size = packet.size;
+		p.flags = packet.flags;
+		p.stream_index = idx;
+		p.pts = av_rescale_q(packet.pts - base_ts[idx], stream_params[idx].time_base, streams[idx]->time_base);
+		p.dts = av_rescale_q(packet.dts - base_ts[idx], stream_params[idx].time_base, streams[idx]->time_base);
+
+		ret = (av_interleaved_write_frame(format_ctx, &p) >= 0);
+	}
+
+	ret = ret && (av_write_trailer(format_ctx) >= 0);
+	ret = (avio_close(format_ctx->pb) >= 0) && ret;
+
+	avformat_free_context(format_ctx);
+
+	if (!ret) {
+		fprintf(stderr, "[%s] could not write \"%s\"\n", __func__, file_name.c_str());
+		unlink(file_name.c_str());
+	}
+
+	return ret;
+}
+
@@ -0,0 +1,142 @@
+#ifndef REPLAY_RING_HDR
+#define REPLAY_RING_HDR
+
+extern "C" {
+#include <avcodec.h>
+#include <avformat.h>
+}
+
+#include <pthread.h>
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+class buffer_pool;
+
+
+struct replay_packet {
+	// into the data arena
+	size_t offset = 0;
+	size_t size = 0;
+
+	// codec time-base units, and the same position in seconds
+	int64_t pts = 0;
+	int64_t dts = 0;
+	double time = 0.0;
+
+	int flags = 0;
+	int stream_index = 0;
+};
+
+
+// what a dump needs of an encoder to describe its stream; copied once,
+// the dump thread never touches the encoders the encoding threads use
+struct replay_stream_params {
+	AVMediaType codec_type = AVMEDIA_TYPE_UNKNOWN;
+	int codec_id = 0;
+	AVRational time_base = {0, 1};
+
+	int bit_rate = 0;
+	int flags = 0;
+	int has_b_frames = 0;
+	int bits_per_coded_sample = 0;
+
+	// video
+	int width = 0;
+	int height = 0;
+	int pix_fmt = 0;
+	int color_space = 0;
+	int color_range = 0;
+	AVRational sample_aspect_ratio = {0, 1};
+
+	// audio
+	int sample_rate = 0;
+	int channels = 0;
+	uint64_t channel_layout = 0;
+	int sample_fmt = 0;
+	int frame_size = 0;
+
+	std::vector<uint8_t> extradata;
+};
+
+
+// keeps the last <seconds> of encoded packets (stream 0 is video, the
+// rest are audio tracks) in a fixed byte arena; the oldest packets are
+// evicted in whole GOPs, once they lie completely outside the window or
+// to make room, so the ring always starts on a video keyframe and keeps
+// at least the newest GOP, however long it runs. dumps are written
+// by a thread of their own from a copy of the ring, so neither the
+// requesting (render) thread nor the encoder waits on file I/O
+class replay_ring {
+public:
+	replay_ring(buffer_pool* pool, double seconds, AVCodecContext* video_ctx, const std::vector<AVCodecContext*>& audio_ctxs);
+	~replay_ring();
+
+	// reads SNAPSHOT_REPLAY (seconds, 0 disables) and SNAPSHOT_REPLAY_MEMORY (MB)
+	static double get_config_seconds();
+	static size_t get_config_memory();
+	static size_t get_max_packets(double seconds);
+	static size_t get_pool_size();
+
+	// called by the encoding thread for every packet, in decode order
+	void push_packet(const AVPacket& p);
+	// only records the file name and wakes the dump thread
+	void request_dump(const char* file_name);
+
+	void dump_thread_func();
+
+private:
+	bool reserve_data(size_t size, size_t* offset);
+	void pop_packet();
+	// evicts the oldest GOP
+	void pop_gop();
+
+	// packets are numbered in push order
+	uint64_t get_front_seq() const { return (next_seq - num_packets); }
+	size_t get_index(uint64_t seq) const { return ((packet_head + (seq - get_front_seq())) % max_packets); }
+
+	bool write_dump(const std::string& file_name, const std::vector<replay_packet>& packets, const std::vector<uint8_t>& data);
+
+private:
+	pthread_t dump_thread;
+
+	// guards the ring itself
+	pthread_mutex_t ring_mutex;
+	// guards the pending dump requests
+	pthread_mutex_t dump_mutex;
+	pthread_cond_t dump_cond;
+
+	// file names and the times they were requested at
+	std::vector< std::pair<std::string, double> > dump_requests;
+
+	// by stream index, copied from the (open) encoders at construction
+	std::vector<replay_stream_params> stream_params;
+
+	uint8_t* data_arena = nullptr;
+	replay_packet* packets = nullptr;
+
+	size_t data_size = 0;
+	size_t data_head = 0;
+
+	size_t max_packets = 0;
+	size_t packet_head = 0;
+	size_t num_packets = 0;
+
+	// numbers of the video keyframes in the ring, and of the next packet
+	std::deque<uint64_t> keyframe_seqs;
+	uint64_t next_seq = 0;
+
+	double max_seconds = 0.0;
+
+	uint64_t num_dumps = 0;
+
+	// a video packet was dropped, the rest of its GOP goes as well
+	bool skip_to_keyframe = false;
+	bool keep_running = true;
+};
+
+#endif
+
@@ -0,0 +1,574 @@
+// turns a spool file written by a recorder in SNAPSHOT_SPOOL mode into a
+// regular video file; chunks of frames are encoded in parallel to packet
+// files next to the output which survive an interrupted run, so starting
+// the tool again only encodes the chunks that are still missing (or were
+// encoded with other settings)
+//
+// usage: snapshot_transcode <in.spool> <out.mp4> [num_threads]
+
+extern "C" {
+#include <avcodec.h>
+#include <avformat.h>
+}
+
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "chunk_enc.hpp"
+#include "frame_enc.hpp"
+#include "spool_file.hpp"
+#include "yuv_convert.hpp"
+
+#ifndef AV_CODEC_ID_MP2
+#define AV_CODEC_ID_MP2 CODEC_ID_MP2
+#endif
+
+// must match the recorders
+#define TIMEBASE 600.0
+
+#define PART_FILE_MAGIC 0x3174726170736e73ULL // "snspart1"
+
+
+// starts every part file; a part is only reused if it was encoded from
+// the same frames with the same settings as the current run would
+struct part_file_header {
+	uint64_t magic;
+	uint64_t chunk;
+	uint64_t chunk_frames;
+	uint64_t num_frames;
+
+	int32_t width;
+	int32_t height;
+	int32_t color_space;
+	int32_t color_range;
+	int32_t bit_rate;
+	int32_t reserved;
+
+	char codec[32];
+	char preset[32];
+	char tune[32];
+};
+
+struct packet_header {
+	int64_t pts;
+	int64_t dts;
+	int32_t flags;
+	int32_t size;
+};
+
+struct transcode_job {
+	spool_reader spool;
+
+	video_encoder_params enc_params;
+
+	std::string parts_dir;
+
+	AVFormatContext* format_ctx = nullptr;
+
+	double init_time = 0.0;
+
+	size_t num_chunks = 0;
+	size_t chunk_frames = 0;
+
+	std::atomic<size_t> next_chunk = {0};
+	std::atomic<bool> failed = {false};
+};
+
+
+static std::string get_part_name(const transcode_job& job, size_t chunk) {
+	char name[64];
+	snprintf(name, sizeof(name), "/%08lu.pkt", chunk);
+	return (job.parts_dir + name);
+}
+
+static bool file_exists(const std::string& name) {
+	struct stat st;
+	return (stat(name.c_str(), &st) == 0);
+}
+
+
+static part_file_header get_part_header(const transcode_job& job, size_t chunk) {
+	const spool_file_header& header = job.spool.get_header();
+
+	part_file_header ph;
+
+	// zeroed including the string tails, the header is compared bytewise
+	memset(&ph, 0, sizeof(ph));
+
+	ph.magic = PART_FILE_MAGIC;
+	ph.chunk = chunk;
+	ph.chunk_frames = job.chunk_frames;
+	ph.num_frames = job.spool.get_num_video_frames();
+	ph.width = header.width;
+	ph.height = header.height;
+	ph.color_space = header.color_space;
+	ph.color_range = header.color_range;
+	ph.bit_rate = job.enc_params.bit_rate;
+
+	strncpy(ph.codec, job.enc_params.codec.c_str(), sizeof(ph.codec) - 1);
+	strncpy(ph.preset, job.enc_params.preset.c_str(), sizeof(ph.preset) - 1);
+	strncpy(ph.tune, job.enc_params.tune.c_str(), sizeof(ph.tune) - 1);
+
+	return ph;
+}
+
+// opens part <chunk> and checks its header against the current run
+static FILE* open_part(const transcode_job& job, size_t chunk) {
+	FILE* f = fopen(get_part_name(job, chunk).c_str(), "rb");
+
+	if (f == nullptr)
+		return nullptr;
+
+	const part_file_header expected = get_part_header(job, chunk);
+	part_file_header ph;
+
+	if (fread(&ph, sizeof(ph), 1, f) != 1 || memcmp(&ph, &expected, sizeof(ph)) != 0) {
+		fclose(f);
+		return nullptr;
+	}
+
+	return f;
+}
+
+static bool is_part_valid(const transcode_job& job, size_t chunk) {
+	FILE* f = open_part(job, chunk);
+
+	if (f == nullptr)
+		return false;
+
+	fclose(f);
+	return true;
+}
+
+
+static bool write_packet(FILE* f, const AVPacket& p) {
+	const packet_header header = {p.pts, p.dts, p.flags, p.size};
+
+	if (fwrite(&header, sizeof(header), 1, f) != 1)
+		return false;
+
+	return (fwrite(p.data, p.size, 1, f) == 1);
+}
+
+static bool encode_packet(AVCodecContext* ctx, AVFrame* frame, FILE* f, bool* got_packet) {
+	AVPacket p;
+	av_init_packet(&p);
+	p.data = nullptr;
+	p.size = 0;
+
+	int encode_status = 0;
+
+	if (avcodec_encode_video2(ctx, &p, frame, &encode_status) < 0)
+		return false;
+
+	if ((*got_packet = (encode_status != 0))) {
+		if (p.pts == AV_NOPTS_VALUE && frame != nullptr)
+			p.pts = frame->pts;
+		if (p.dts == AV_NOPTS_VALUE)
+			p.dts = p.pts;
+
+		const bool ret = write_packet(f, p);
+
+		av_free_packet(&p);
+		return ret;
+	}
+
+	return true;
+}
+
+
+// encodes [chunk * chunk_frames, (chunk + 1) * chunk_frames) with a fresh
+// encoder so the chunk is a closed GOP, then publishes the part atomically
+static bool encode_chunk(transcode_job& job, size_t chunk, yuv_converter* converter, char* frame_buf, AVFrame* picture) {
+	const spool_file_header& header = job.spool.get_header();
+
+	const std::string part_name = get_part_name(job, chunk);
+	const std::string temp_name = part_name + ".tmp";
+
+	const size_t first_frame = chunk * job.chunk_frames;
+	const size_t last_frame = std::min(first_frame + job.chunk_frames, job.spool.get_num_video_frames());
+
+	AVCodecContext* ctx = open_video_encoder(job.enc_params, job.format_ctx, header.width, header.height, TIMEBASE, header.color_space, header.color_range);
+	FILE* f = fopen(temp_name.c_str(), "wb");
+
+	const part_file_header ph = get_part_header(job, chunk);
+
+	bool ret = (ctx != nullptr && f != nullptr) && (fwrite(&ph, sizeof(ph), 1, f) == 1);
+	bool got_packet = false;
+
+	for (size_t i = first_frame; i < last_frame && ret; i++) {
+		if (!(ret = job.spool.read_video_frame(i, frame_buf))) {
+			fprintf(stderr, "[%s] frame %lu is corrupt\n", __func__, i);
+			break;
+		}
+
+		if (converter != nullptr) {
+			converter->convert(reinterpret_cast<const uint8_t*>(frame_buf), picture->data, picture->linesize);
+		} else {
+			avpicture_fill((AVPicture*) picture, reinterpret_cast<uint8_t*>(frame_buf), PIX_FMT_YUV420P, header.width, header.height);
+		}
+
+		picture->pts = int64_t((job.spool.get_video_frame_time(i) - job.init_time) * TIMEBASE);
+		picture->pict_type = (i == first_frame)? AV_PICTURE_TYPE_I: AV_PICTURE_TYPE_NONE;
+		picture->key_frame = (i == first_frame);
+
+		ret = encode_packet(ctx, picture, f, &got_packet);
+	}
+
+	// drain whatever the encoder still holds
+	for (got_packet = true; ret && got_packet && (ctx->codec->capabilities & CODEC_CAP_DELAY) != 0; ) {
+		ret = encode_packet(ctx, nullptr, f, &got_packet);
+	}
+
+	if (f != nullptr)
+		ret = (fclose(f) == 0) && ret;
+
+	if (ctx != nullptr) {
+		avcodec_close(ctx);
+		av_free(ctx);
+	}
+
+	if (!ret) {
+		unlink(temp_name.c_str());
+		return false;
+	}
+
+	return (rename(temp_name.c_str(), part_name.c_str()) == 0);
+}
+
+static void* encode_thread_proc(void* arg) {
+	transcode_job& job = *reinterpret_cast<transcode_job*>(arg);
+	const spool_file_header& header = job.spool.get_header();
+
+	std::vector<char> frame_buf(job.spool.get_video_frame_size(0));
+	std::vector<uint8_t> picture_buf(avpicture_get_size(PIX_FMT_YUV420P, header.width, header.height));
+
+	yuv_converter* converter = nullptr;
+	AVFrame* picture = avcodec_alloc_frame();
+
+	if (header.pix_fmt != PIX_FMT_YUV420P) {
+		// same matrix the recorder would have used; parallelism comes from the chunks
+		converter = new yuv_converter(header.width, header.height, 1, 0.299f, 0.114f, false);
+		avpicture_fill((AVPicture*) picture, picture_buf.data(), PIX_FMT_YUV420P, header.width, header.height);
+	}
+
+	picture->width = header.width;
+	picture->height = header.height;
+
+	for (size_t chunk = job.next_chunk++; chunk < job.num_chunks && !job.failed; chunk = job.next_chunk++) {
+		if (is_part_valid(job, chunk))
+			continue;
+
+		if (file_exists(get_part_name(job, chunk)))
+			printf("[%s] chunk %lu is from a run with other settings, encoding it again\n", __func__, chunk);
+
+		if (!encode_chunk(job, chunk, converter, frame_buf.data(), picture)) {
+			fprintf(stderr, "[%s] could not encode chunk %lu\n", __func__, chunk);
+			job.failed = true;
+			break;
+		}
+
+		printf("[%s] chunk %lu/%lu done\n", __func__, chunk + 1, job.num_chunks);
+	}
+
+	av_free(picture);
+	delete converter;
+	return nullptr;
+}
+
+
+
+static AVCodecContext* open_audio_encoder(const spool_file_header& header) {
+	AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_MP2);
+	AVCodecContext* ctx = avcodec_alloc_context3(codec);
+
+	avcodec_get_context_defaults3(ctx, codec);
+
+	ctx->sample_fmt = AV_SAMPLE_FMT_S16;
+	ctx->sample_rate = header.sample_rate;
+	ctx->channels = header.channels;
+	ctx->channel_layout = (header.channels == 2)? 3: 4;
+	ctx->time_base.den = header.sample_rate;
+	ctx->time_base.num = 1;
+	ctx->bit_rate = 128000;
+
+	if (avcodec_open2(ctx, codec, nullptr) < 0) {
+		fprintf(stderr, "[%s] could not open audio codec\n", __func__);
+		av_free(ctx);
+		return nullptr;
+	}
+
+	return ctx;
+}
+
+// feeds spooled audio to the encoder in codec-sized frames up to <end_time>
+struct audio_muxer {
+public:
+	bool write_until(double end_time) {
+		const spool_file_header& header = spool->get_header();
+
+		while (ctx != nullptr) {
+			const size_t frame_samples = ctx->frame_size * header.channels;
+
+			while (fifo.size() < frame_samples && next_block < spool->get_num_audio_blocks()) {
+				size_t num_samples = 0;
+				double time = 0.0;
+
+				const short* samples = spool->get_audio_block(next_block++, &num_samples, &time);
+
+				fifo.insert(fifo.end(), samples, samples + num_samples);
+			}
+
+			if (fifo.size() < frame_samples)
+				break;
+
+			const double frame_time = double(samples_written) / header.sample_rate;
+
+			if (frame_time > end_time)
+				break;
+
+			AVFrame* frame = avcodec_alloc_frame();
+
+			frame->nb_samples = ctx->frame_size;
+			frame->format = AV_SAMPLE_FMT_S16;
+			frame->channel_layout = ctx->channel_layout;
+			frame->pts = samples_written;
+
+			avcodec_fill_audio_frame(frame, header.channels, AV_SAMPLE_FMT_S16, reinterpret_cast<const uint8_t*>(fifo.data()), frame_samples * sizeof(short), 0);
+
+			AVPacket p;
+			av_init_packet(&p);
+			p.data = nullptr;
+			p.size = 0;
+
+			int encode_status = 0;
+			int ret = avcodec_encode_audio2(ctx, &p, frame, &encode_status);
+
+			if (ret >= 0 && encode_status != 0) {
+				p.stream_index = stream->index;
+				p.pts = av_rescale_q(p.pts, ctx->time_base, stream->time_base);
+				p.dts = p.pts;
+
+				ret = av_interleaved_write_frame(format_ctx, &p);
+			}
+
+			avcodec_free_frame(&frame);
+
+			if (ret < 0) {
+				fprintf(stderr, "[%s] could not write audio at %.3fs\n", __func__, frame_time);
+				return false;
+			}
+
+			fifo.erase(fifo.begin(), fifo.begin() + frame_samples);
+			samples_written += ctx->frame_size;
+		}
+
+		return true;
+	}
+
+public:
+	const spool_reader* spool = nullptr;
+
+	AVCodecContext* ctx = nullptr;
+	AVFormatContext* format_ctx = nullptr;
+	AVStream* stream = nullptr;
+
+	std::vector<short> fifo;
+
+	size_t next_block = 0;
+	uint64_t samples_written = 0;
+};
+
+
+static bool mux_parts(transcode_job& job, const char* out_file) {
+	const spool_file_header& header = job.spool.get_header();
+
+	AVCodecContext* video_ctx = open_video_encoder(job.enc_params, job.format_ctx, header.width, header.height, TIMEBASE, header.color_space, header.color_range);
+	AVCodecContext* audio_ctx = (job.spool.get_num_audio_blocks() > 0)? open_audio_encoder(header): nullptr;
+
+	if (video_ctx == nullptr)
+		return false;
+
+	AVStream* vs = av_new_stream(job.format_ctx, 0);
+	AVStream* as = (audio_ctx != nullptr)? av_new_stream(job.format_ctx, 1): nullptr;
+
+	vs->codec = video_ctx;
+	vs->r_frame_rate.den = TIMEBASE;
+	vs->r_frame_rate.num = 1;
+
+	if (as != nullptr) {
+		as->codec = audio_ctx;
+		as->r_frame_rate.den = header.sample_rate;
+		as->r_frame_rate.num = 1;
+	}
+
+	if (avio_open2(&job.format_ctx->pb, out_file, AVIO_FLAG_WRITE, nullptr, nullptr) < 0) {
+		fprintf(stderr, "[%s] could not open \"%s\"\n", __func__, out_file);
+		return false;
+	}
+
+	if (avformat_write_header(job.format_ctx, nullptr) < 0) {
+		fprintf(stderr, "[%s] could not write header of \"%s\"\n", __func__, out_file);
+		avio_close(job.format_ctx->pb);
+		return false;
+	}
+
+	audio_muxer audio;
+	audio.spool = &job.spool;
+	audio.ctx = audio_ctx;
+	audio.format_ctx = job.format_ctx;
+	audio.stream = as;
+
+	std::vector<uint8_t> packet_buf;
+
+	bool ret = true;
+
+	for (size_t chunk = 0; chunk < job.num_chunks && ret; chunk++) {
+		FILE* f = open_part(job, chunk);
+		packet_header ph;
+
+		if (f == nullptr) {
+			fprintf(stderr, "[%s] chunk %lu is missing or invalid\n", __func__, chunk);
+			ret = false;
+			break;
+		}
+
+		while (ret && fread(&ph, sizeof(ph), 1, f) == 1) {
+			packet_buf.resize(ph.size + FF_INPUT_BUFFER_PADDING_SIZE);
+
+			if (ph.size <= 0 || fread(packet_buf.data(), ph.size, 1, f) != 1) {
+				fprintf(stderr, "[%s] chunk %lu is truncated, delete it to encode it again\n", __func__, chunk);
+				ret = false;
+				break;
+			}
+
+			if (!(ret = audio.write_until(ph.dts / TIMEBASE)))
+				break;
+
+			AVPacket p;
+			av_init_packet(&p);
+
+			p.data = packet_buf.data();
+			p.size = ph.size;
+			p.flags = ph.flags;
+			p.stream_index = vs->index;
+			p.pts = av_rescale_q(ph.pts, video_ctx->time_base, vs->time_base);
+			p.dts = av_rescale_q(ph.dts, video_ctx->time_base, vs->time_base);
+
+			if (av_interleaved_write_frame(job.format_ctx, &p) < 0) {
+				fprintf(stderr, "[%s] could not write chunk %lu to \"%s\"\n", __func__, chunk, out_file);
+				ret = false;
+			}
+		}
+
+		fclose(f);
+	}
+
+	ret = ret && audio.write_until(1e30);
+
+	if (ret && av_write_trailer(job.format_ctx) < 0) {
+		fprintf(stderr, "[%s] could not finish \"%s\"\n", __func__, out_file);
+		ret = false;
+	}
+
+	ret = (avio_close(job.format_ctx->pb) >= 0) && ret;
+
+	avcodec_close(video_ctx);
+
+	if (audio_ctx != nullptr)
+		avcodec_close(audio_ctx);
+
+	return ret;
+}
+
+
+
+int main(int argc, char** argv) {
+	if (argc < 3) {
+		fprintf(stderr, "usage: %s <in.spool> <out.mp4> [num_threads]\n", argv[0]);
+		return 1;
+	}
+
+	av_register_all();
+
+	transcode_job job;
+
+	if (!job.spool.open(argv[1]))
+		return 1;
+
+	if (job.spool.get_num_video_frames() == 0) {
+		fprintf(stderr, "[%s] \"%s\" contains no frames\n", __func__, argv[1]);
+		return 1;
+	}
+
+	// same settings as the recorder, one closed GOP per chunk
+	job.chunk_frames = chunk_encoder::get_config_chunk_frames();
+	job.num_chunks = (job.spool.get_num_video_frames() + job.chunk_frames - 1) / job.chunk_frames;
+	job.init_time = job.spool.get_video_frame_time(0);
+	job.enc_params = video_encoder_params::from_config();
+	job.enc_params.gop_size = job.chunk_frames;
+	job.enc_params.thread_count = 1;
+
+	job.parts_dir = std::string(argv[2]) + ".parts";
+
+	if (mkdir(job.parts_dir.c_str(), 0755) != 0 && !file_exists(job.parts_dir)) {
+		fprintf(stderr, "[%s] could not create \"%s\"\n", __func__, job.parts_dir.c_str());
+		return 1;
+	}
+
+	job.format_ctx = avformat_alloc_context();
+	job.format_ctx->oformat = av_guess_format(nullptr, argv[2], nullptr);
+	snprintf(job.format_ctx->filename, sizeof(job.format_ctx->filename), "%s", argv[2]);
+
+	if (job.format_ctx->oformat == nullptr) {
+		fprintf(stderr, "[%s] unknown output format for \"%s\"\n", __func__, argv[2]);
+		return 1;
+	}
+
+	{
+		const int num_threads = (argc > 3)? std::max(atoi(argv[3]), 1): std::max(int(sysconf(_SC_NPROCESSORS_ONLN)), 1);
+
+		std::vector<pthread_t> threads(std::min(size_t(num_threads), job.num_chunks));
+
+		printf("[%s] encoding %lu chunks of %lu frames on %lu threads\n", __func__, job.num_chunks, job.chunk_frames, threads.size());
+
+		for (pthread_t& thread: threads) {
+			pthread_create(&thread, nullptr, encode_thread_proc, &job);
+		}
+		for (pthread_t& thread: threads) {
+			pthread_join(thread, nullptr);
+		}
+	}
+
+	if (job.failed) {
+		fprintf(stderr, "[%s] encoding failed, run again to resume\n", __func__);
+		return 1;
+	}
+
+	// the parts are kept for another run
+	if (!mux_parts(job, argv[2])) {
+		fprintf(stderr, "[%s] could not write \"%s\"\n", __func__, argv[2]);
+		return 1;
+	}
+
+	// output is complete, the parts are no longer needed
+	for (size_t chunk = 0; chunk < job.num_chunks; chunk++) {
+		unlink(get_part_name(job, chunk).c_str());
+	}
+
+	rmdir(job.parts_dir.c_str());
+	avformat_free_context(job.format_ctx);
+
+	printf("[%s] wrote \"%s\"\n", __func__, argv[2]);
+	return 0;
+}
+
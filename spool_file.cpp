@@ -0,0 +1,399 @@
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <lz4.h>
+#include <zstd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "spool_file.hpp"
+#include "rec_config.hpp"
+
+static const char* spool_env_var = "SNAPSHOT_SPOOL";
+static const char* spool_codec_env_var = "SNAPSHOT_SPOOL_CODEC";
+static const char* spool_tile_env_var = "SNAPSHOT_SPOOL_TILE";
+static const char* spool_threads_env_var = "SNAPSHOT_SPOOL_THREADS";
+
+// address space reserved for the file mapping, and the steps it is backed in
+#define SPOOL_MAP_SIZE (size_t(1) << 40)
+#define SPOOL_GROW_SIZE (size_t(256) * 1024 * 1024)
+
+#define SPOOL_ZSTD_LEVEL 1
+
+
+static_assert((sizeof(spool_file_header) % 8) == 0, "records must start 8-byte aligned");
+
+// records start on 8-byte boundaries so their headers can be read in place
+static size_t get_record_size(size_t data_size) {
+	return ((sizeof(spool_record_header) + data_size + 7) & ~size_t(7));
+}
+
+static void* worker_thread_proc(void* arg) {
+	reinterpret_cast<spool_writer*>(arg)->worker_thread_func();
+	return nullptr;
+}
+
+static size_t get_tile_bound(uint32_t codec, size_t tile_size) {
+	if (codec == SPOOL_CODEC_ZSTD)
+		return (ZSTD_compressBound(tile_size));
+
+	return (LZ4_compressBound(tile_size));
+}
+
+
+
+spool_writer::spool_writer(const char* file_name, const spool_file_header& header, size_t frame_size, int num_threads) {
+	file_header = header;
+
+	if ((file_desc = ::open(file_name, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		fprintf(stderr, "[%s] could not create spool file \"%s\"\n", __func__, file_name);
+		exit(1);
+	}
+
+	void* mem = mmap(nullptr, SPOOL_MAP_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, file_desc, 0);
+
+	if (mem == MAP_FAILED) {
+		fprintf(stderr, "[%s] could not map spool file \"%s\"\n", __func__, file_name);
+		exit(1);
+	}
+
+	file_base = reinterpret_cast<char*>(mem);
+
+	memcpy(reserve(sizeof(spool_file_header)), &file_header, sizeof(spool_file_header));
+
+	num_tiles = (frame_size + file_header.tile_size - 1) / file_header.tile_size;
+	tile_bound = get_tile_bound(file_header.codec, file_header.tile_size);
+
+	tile_buffers.resize(num_tiles * tile_bound);
+	tile_sizes.resize(num_tiles);
+
+	pthread_mutex_init(&work_mutex, nullptr);
+	pthread_cond_init(&work_cond, nullptr);
+	pthread_cond_init(&done_cond, nullptr);
+
+	workers.resize(std::max(0, num_threads - 1));
+
+	for (pthread_t& worker: workers) {
+		pthread_create(&worker, nullptr, worker_thread_proc, this);
+	}
+
+	printf("[%s] spooling to \"%s\" (%s, %u tiles of %u bytes, %d thread(s))\n", __func__, file_name, (file_header.codec == SPOOL_CODEC_ZSTD)? "zstd": "lz4", num_tiles, file_header.tile_size, num_threads);
+}
+
+spool_writer::~spool_writer() {
+	pthread_mutex_lock(&work_mutex);
+	keep_running = false;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&work_mutex);
+
+	for (pthread_t& worker: workers) {
+		pthread_join(worker, nullptr);
+	}
+
+	pthread_cond_destroy(&done_cond);
+	pthread_cond_destroy(&work_cond);
+	pthread_mutex_destroy(&work_mutex);
+
+	munmap(file_base, SPOOL_MAP_SIZE);
+
+	// drop the preallocated tail
+	if (ftruncate(file_desc, file_used) != 0)
+		fprintf(stderr, "[%s] could not truncate spool file\n", __func__);
+
+	::close(file_desc);
+
+	printf("[%s] spooled %lu bytes into %lu (%.2f:1)\n", __func__, bytes_in, file_used, bytes_in / std::max(double(file_used), 1.0));
+}
+
+
+bool spool_writer::get_config_enabled() {
+	return (get_config_int(spool_env_var, 0) != 0);
+}
+
+uint32_t spool_writer::get_config_codec() {
+	const char* codec = get_config_value(spool_codec_env_var);
+
+	if (codec == nullptr || strlen(codec) == 0 || strcmp(codec, "lz4") == 0)
+		return SPOOL_CODEC_LZ4;
+	if (strcmp(codec, "zstd") == 0)
+		return SPOOL_CODEC_ZSTD;
+
+	printf("[%s] unknown spool codec \"%s\", using lz4\n", __func__, codec);
+	return SPOOL_CODEC_LZ4;
+}
+
+uint32_t spool_writer::get_config_tile_size() {
+	return (std::max(get_config_int(spool_tile_env_var, 256 * 1024), 4096));
+}
+
+int spool_writer::get_config_num_threads() {
+	return (std::max(get_config_int(spool_threads_env_var, 2), 1));
+}
+
+
+
+char* spool_writer::reserve(size_t size) {
+	const size_t offset = file_used;
+
+	if ((file_used += size) > file_size) {
+		const size_t new_size = (file_used + SPOOL_GROW_SIZE - 1) & ~(SPOOL_GROW_SIZE - 1);
+
+		if (new_size > SPOOL_MAP_SIZE || posix_fallocate(file_desc, file_size, new_size - file_size) != 0) {
+			fprintf(stderr, "[%s] could not grow spool file to %lu bytes\n", __func__, new_size);
+			exit(1);
+		}
+
+		file_size = new_size;
+	}
+
+	return (file_base + offset);
+}
+
+
+void spool_writer::write_video_frame(const char* data, size_t size, double time) {
+	pthread_mutex_lock(&work_mutex);
+
+	src_data = data;
+	src_size = size;
+
+	tiles_done = 0;
+	next_tile = 0;
+	job_counter += 1;
+
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&work_mutex);
+
+	compress_tiles();
+
+	pthread_mutex_lock(&work_mutex);
+
+	while (tiles_done < num_tiles)
+		pthread_cond_wait(&done_cond, &work_mutex);
+
+	pthread_mutex_unlock(&work_mutex);
+
+	spool_record_header header;
+	header.type = SPOOL_RECORD_VIDEO;
+	header.num_tiles = num_tiles;
+	header.raw_size = size;
+	header.time = time;
+	header.data_size = num_tiles * sizeof(uint32_t);
+
+	for (unsigned int i = 0; i < num_tiles; i++) {
+		header.data_size += tile_sizes[i];
+	}
+
+	char* dst = reserve(get_record_size(header.data_size));
+	char* ptr = dst + sizeof(spool_record_header);
+
+	memcpy(ptr, tile_sizes.data(), num_tiles * sizeof(uint32_t));
+	ptr += (num_tiles * sizeof(uint32_t));
+
+	for (unsigned int i = 0; i < num_tiles; i++) {
+		memcpy(ptr, &tile_buffers[i * tile_bound], tile_sizes[i]);
+		ptr += tile_sizes[i];
+	}
+
+	// header goes in last, a reader never sees a half-written record
+	memcpy(dst, &header, sizeof(spool_record_header));
+
+	bytes_in += size;
+}
+
+void spool_writer::write_audio_block(const short* samples, size_t size, double time) {
+	spool_record_header header;
+	header.type = SPOOL_RECORD_AUDIO;
+	header.num_tiles = 0;
+	header.data_size = size;
+	header.raw_size = size;
+	header.time = time;
+
+	char* dst = reserve(get_record_size(size));
+
+	memcpy(dst + sizeof(spool_record_header), samples, size);
+	memcpy(dst, &header, sizeof(spool_record_header));
+
+	bytes_in += size;
+}
+
+
+
+void spool_writer::compress_tiles() {
+	unsigned int tile = 0;
+	unsigned int done = 0;
+
+	while ((tile = next_tile.fetch_add(1)) < num_tiles) {
+		const size_t tile_offset = size_t(tile) * file_header.tile_size;
+		const size_t tile_size = std::min(size_t(file_header.tile_size), src_size - std::min(tile_offset, src_size));
+
+		const char* src = src_data + tile_offset;
+		char* dst = &tile_buffers[tile * tile_bound];
+
+		size_t comp_size = 0;
+
+		if (file_header.codec == SPOOL_CODEC_ZSTD) {
+			comp_size = ZSTD_compress(dst, tile_bound, src, tile_size, SPOOL_ZSTD_LEVEL);
+			comp_size = ZSTD_isError(comp_size)? 0: comp_size;
+		} else {
+			comp_size = LZ4_compress_default(src, dst, tile_size, tile_bound);
+		}
+
+		// incompressible (or failed) tiles are stored raw
+		if (comp_size == 0 || comp_size >= tile_size) {
+			memcpy(dst, src, tile_size);
+			comp_size = tile_size;
+		}
+
+		tile_sizes[tile] = comp_size;
+		done += 1;
+	}
+
+	pthread_mutex_lock(&work_mutex);
+
+	if ((tiles_done += done) == num_tiles)
+		pthread_cond_signal(&done_cond);
+
+	pthread_mutex_unlock(&work_mutex);
+}
+
+void spool_writer::worker_thread_func() {
+	unsigned int last_job = 0;
+
+	pthread_mutex_lock(&work_mutex);
+
+	while (true) {
+		while (keep_running && job_counter == last_job)
+			pthread_cond_wait(&work_cond, &work_mutex);
+
+		if (!keep_running)
+			break;
+
+		last_job = job_counter;
+		pthread_mutex_unlock(&work_mutex);
+
+		compress_tiles();
+
+		pthread_mutex_lock(&work_mutex);
+	}
+
+	pthread_mutex_unlock(&work_mutex);
+}
+
+
+
+
+bool spool_reader::open(const char* file_name) {
+	close();
+
+	const int fd = ::open(file_name, O_RDONLY);
+
+	if (fd < 0) {
+		fprintf(stderr, "[%s] could not open spool file \"%s\"\n", __func__, file_name);
+		return false;
+	}
+
+	struct stat st;
+
+	if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(spool_file_header)) {
+		fprintf(stderr, "[%s] \"%s\" is not a spool file\n", __func__, file_name);
+		::close(fd);
+		return false;
+	}
+
+	void* mem = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+	// the mapping stays valid without the descriptor
+	::close(fd);
+
+	if (mem == MAP_FAILED) {
+		fprintf(stderr, "[%s] could not map spool file \"%s\"\n", __func__, file_name);
+		return false;
+	}
+
+	file_base = reinterpret_cast<const char*>(mem);
+	file_size = st.st_size;
+
+	memcpy(&file_header, file_base, sizeof(spool_file_header));
+
+	if (file_header.magic != SPOOL_FILE_MAGIC || file_header.version != SPOOL_FILE_VERSION) {
+		fprintf(stderr, "[%s] \"%s\" is not a version %d spool file\n", __func__, file_name, SPOOL_FILE_VERSION);
+		close();
+		return false;
+	}
+
+	// a recorder that died mid-session leaves a zeroed (or partial) tail
+	for (size_t offset = sizeof(spool_file_header); (offset + sizeof(spool_record_header)) <= file_size; ) {
+		const spool_record_header* header = get_record(offset);
+
+		if (header->magic != SPOOL_RECORD_MAGIC)
+			break;
+		if ((offset + sizeof(spool_record_header) + header->data_size) > file_size)
+			break;
+
+		switch (header->type) {
+			case SPOOL_RECORD_VIDEO: { video_records.push_back(offset); } break;
+			case SPOOL_RECORD_AUDIO: { audio_records.push_back(offset); } break;
+			default: {} break;
+		}
+
+		offset += get_record_size(header->data_size);
+	}
+
+	printf("[%s] \"%s\": %dx%d, %lu frames, %lu audio blocks\n", __func__, file_name, file_header.width, file_header.height, video_records.size(), audio_records.size());
+	return true;
+}
+
+void spool_reader::close() {
+	if (file_base == nullptr)
+		return;
+
+	munmap(const_cast<char*>(file_base), file_size);
+
+	video_records.clear();
+	audio_records.clear();
+
+	file_base = nullptr;
+	file_size = 0;
+}
+
+
+bool spool_reader::read_video_frame(size_t i, char* dst) const {
+	const spool_record_header* header = get_record(video_records[i]);
+
+	const uint32_t* tile_sizes = reinterpret_cast<const uint32_t*>(header + 1);
+	const char* src = reinterpret_cast<const char*>(tile_sizes + header->num_tiles);
+
+	for (uint32_t tile = 0; tile < header->num_tiles; tile++) {
+		const size_t tile_offset = size_t(tile) * file_header.tile_size;
+		const size_t tile_size = std::min(size_t(file_header.tile_size), header->raw_size - std::min(size_t(header->raw_size), tile_offset));
+
+		if (tile_sizes[tile] == tile_size) {
+			memcpy(dst + tile_offset, src, tile_size);
+		} else if (file_header.codec == SPOOL_CODEC_ZSTD) {
+			if (ZSTD_decompress(dst + tile_offset, tile_size, src, tile_sizes[tile]) != tile_size)
+				return false;
+		} else {
+			if (LZ4_decompress_safe(src, dst + tile_offset, tile_sizes[tile], tile_size) != int(tile_size))
+				return false;
+		}
+
+		src += tile_sizes[tile];
+	}
+
+	return true;
+}
+
+const short* spool_reader::get_audio_block(size_t i, size_t* num_samples, double* time) const {
+	const spool_record_header* header = get_record(audio_records[i]);
+
+	*num_samples = header->raw_size / sizeof(short);
+	*time = header->time;
+
+	return (reinterpret_cast<const short*>(header + 1));
+}
+
@@ -0,0 +1,172 @@
+#ifndef SPOOL_FILE_HDR
+#define SPOOL_FILE_HDR
+
+#include <pthread.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+// "SNPSPOOL" and "SREC" in little-endian byte order
+#define SPOOL_FILE_MAGIC 0x4c4f4f5053504e53ull
+#define SPOOL_RECORD_MAGIC 0x43455253u
+#define SPOOL_FILE_VERSION 1
+
+enum {
+	SPOOL_CODEC_LZ4  = 0,
+	SPOOL_CODEC_ZSTD = 1,
+};
+
+enum {
+	SPOOL_RECORD_VIDEO = 0, // one frame, tile-compressed
+	SPOOL_RECORD_AUDIO = 1, // one block of interleaved s16 samples, stored as-is
+};
+
+
+struct spool_file_header {
+	uint64_t magic = SPOOL_FILE_MAGIC;
+	uint32_t version = SPOOL_FILE_VERSION;
+	uint32_t codec = SPOOL_CODEC_LZ4;
+
+	// PIX_FMT_RGBA (bottom-up) or PIX_FMT_YUV420P frames, as captured
+	int32_t width = 0;
+	int32_t height = 0;
+	int32_t pix_fmt = 0;
+	int32_t color_space = 0;
+	int32_t color_range = 0;
+
+	// uncompressed bytes per tile; the last tile of a frame may be shorter
+	uint32_t tile_size = 0;
+
+	int32_t sample_rate = 0;
+	int32_t channels = 0;
+};
+
+// followed by <num_tiles> compressed tile sizes and the tile data; a
+// tile whose compressed size equals its raw size is stored uncompressed
+struct spool_record_header {
+	uint32_t magic = SPOOL_RECORD_MAGIC;
+	uint32_t type = SPOOL_RECORD_VIDEO;
+	uint32_t num_tiles = 0;
+	uint32_t reserved = 0;
+
+	// bytes following this header, and the record's uncompressed size
+	uint64_t data_size = 0;
+	uint64_t raw_size = 0;
+
+	// capture time in seconds (video), or sample offset in seconds (audio)
+	double time = 0.0;
+};
+
+
+// appends records to a memory-mapped spool file; every frame is cut into
+// fixed-size tiles which a small thread pool compresses independently
+// (LZ4 or zstd at its fastest level), the calling thread included
+class spool_writer {
+public:
+	spool_writer(const char* file_name, const spool_file_header& header, size_t frame_size, int num_threads);
+	~spool_writer();
+
+	// reads SNAPSHOT_SPOOL, SNAPSHOT_SPOOL_CODEC, _TILE and _THREADS
+	static bool get_config_enabled();
+	static uint32_t get_config_codec();
+	static uint32_t get_config_tile_size();
+	static int get_config_num_threads();
+
+	void write_video_frame(const char* data, size_t size, double time);
+	void write_audio_block(const short* samples, size_t size, double time);
+
+	void worker_thread_func();
+
+	uint64_t get_bytes_in() const { return bytes_in; }
+	uint64_t get_bytes_out() const { return file_used; }
+
+private:
+	// returns the mapped address of the next <size> bytes, growing the file as needed
+	char* reserve(size_t size);
+
+	void compress_tiles();
+
+private:
+	std::vector<pthread_t> workers;
+
+	pthread_mutex_t work_mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+
+	// compressed tiles land here before being copied into the file in order
+	std::vector<char> tile_buffers;
+	std::vector<uint32_t> tile_sizes;
+
+	spool_file_header file_header;
+
+	char* file_base = nullptr;
+
+	// current job
+	const char* src_data = nullptr;
+	size_t src_size = 0;
+
+	size_t tile_bound = 0;
+
+	size_t file_used = 0;
+	size_t file_size = 0;
+
+	uint64_t bytes_in = 0;
+
+	unsigned int num_tiles = 0;
+	unsigned int tiles_done = 0;
+	unsigned int job_counter = 0;
+
+	std::atomic<unsigned int> next_tile = {0};
+
+	int file_desc = -1;
+
+	bool keep_running = true;
+};
+
+
+// read-only view of a (possibly truncated) spool file with an index of
+// its records; frames can be decompressed concurrently by any thread
+class spool_reader {
+public:
+	spool_reader() = default;
+	spool_reader(const spool_reader&) = delete;
+	~spool_reader() { close(); }
+
+	spool_reader& operator = (const spool_reader&) = delete;
+
+	bool open(const char* file_name);
+	void close();
+
+	const spool_file_header& get_header() const { return file_header; }
+
+	size_t get_num_video_frames() const { return video_records.size(); }
+	size_t get_num_audio_blocks() const { return audio_records.size(); }
+
+	double get_video_frame_time(size_t i) const { return (get_record(video_records[i])->time); }
+	size_t get_video_frame_size(size_t i) const { return (get_record(video_records[i])->raw_size); }
+
+	// decompresses frame <i> into <dst>, which must hold get_video_frame_size(i) bytes
+	bool read_video_frame(size_t i, char* dst) const;
+	const short* get_audio_block(size_t i, size_t* num_samples, double* time) const;
+
+private:
+	const spool_record_header* get_record(size_t offset) const {
+		return (reinterpret_cast<const spool_record_header*>(file_base + offset));
+	}
+
+private:
+	std::vector<size_t> video_records;
+	std::vector<size_t> audio_records;
+
+	spool_file_header file_header;
+
+	const char* file_base = nullptr;
+
+	size_t file_size = 0;
+};
+
+#endif
+
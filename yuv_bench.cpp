@@ -0,0 +1,273 @@
+// checks the SIMD kernels of yuv_converter against its scalar path and
+// against swscale, and times them next to swscale at 720p, 1080p, 1440p
+// and 2160p; every kernel the CPU supports must produce the exact bytes
+// the scalar kernel does, odd sizes (vector tails, the last row and column
+// paired with themselves) included
+//
+// usage: yuv_bench [iterations [num_threads [width height]]]
+
+extern "C" {
+#include <avcodec.h>
+#include <swscale.h>
+}
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <utility>
+#include <vector>
+
+#include "yuv_convert.hpp"
+
+static const char* kernel_names[] = {"scalar", "sse4.1", "avx2", "avx512"};
+
+
+static double get_time() {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+
+	return (t.tv_sec + t.tv_nsec / 1000000000.0);
+}
+
+
+// a bottom-up RGBA frame and the YUV420P planes converted from it
+struct bench_frame {
+public:
+	// <smooth> fills gradients instead of noise
+	bench_frame(int w, int h, bool smooth = false) {
+		width = w;
+		height = h;
+
+		rgba.resize(size_t(w) * h * 4);
+		yuv.resize(avpicture_get_size(PIX_FMT_YUV420P, w, h));
+
+		// deterministic noise; extremes hit the clamping in every kernel
+		uint32_t seed = 0x12345678;
+
+		for (size_t i = 0; i < rgba.size(); i++) {
+			seed = seed * 1664525 + 1013904223;
+			rgba[i] = ((i % 61) == 0)? 0: ((i % 67) == 0)? 255: (seed >> 24);
+		}
+
+		for (int y = 0; y < h && smooth; y++) {
+			for (int x = 0; x < w; x++) {
+				uint8_t* p = &rgba[(size_t(y) * w + x) * 4];
+
+				p[0] = (x * 255) / w;
+				p[1] = (y * 255) / h;
+				p[2] = ((x + y) * 255) / (w + h);
+			}
+		}
+
+		avpicture_fill(&picture, yuv.data(), PIX_FMT_YUV420P, w, h);
+	}
+
+	void convert(yuv_converter* converter) {
+		std::fill(yuv.begin(), yuv.end(), 0);
+		converter->convert(rgba.data(), picture.data, picture.linesize);
+	}
+
+public:
+	int width = 0;
+	int height = 0;
+
+	std::vector<uint8_t> rgba;
+	std::vector<uint8_t> yuv;
+
+	AVPicture picture;
+};
+
+
+// compares every kernel's output with the scalar kernel's at <width>x<height>
+static bool check_kernels(int width, int height, int num_threads) {
+	bench_frame frame(width, height);
+	yuv_converter converter(width, height, num_threads, 0.299f, 0.114f, false);
+
+	converter.set_kernel("scalar");
+	frame.convert(&converter);
+
+	const std::vector<uint8_t> expected = frame.yuv;
+
+	bool ret = true;
+
+	for (const char* name: kernel_names) {
+		if (!converter.set_kernel(name))
+			continue;
+
+		frame.convert(&converter);
+
+		const std::pair<std::vector<uint8_t>::const_iterator, std::vector<uint8_t>::iterator> diff = std::mismatch(expected.begin(), expected.end(), frame.yuv.begin());
+
+		if (diff.first != expected.end()) {
+			const size_t ofs = diff.first - expected.begin();
+
+			fprintf(stderr, "[%s] %dx%d: %s differs from scalar at byte %lu (%d instead of %d)\n", __func__,
+				width, height, name, ofs, *diff.second, *diff.first);
+			ret = false;
+		}
+	}
+
+	printf("[%s] %dx%d: %s\n", __func__, width, height, ret? "bit-exact": "MISMATCH");
+	return ret;
+}
+
+
+// swscale with the flags the recorders use for SNAPSHOT_CONVERTER=swscale
+struct bench_swscale_ctx {
+public:
+	bench_swscale_ctx(bench_frame& frame) {
+		ctx = sws_getContext(
+			frame.width, frame.height, PIX_FMT_RGBA,
+			frame.width, frame.height, PIX_FMT_YUV420P,
+			SWS_FAST_BILINEAR, nullptr, nullptr, nullptr
+		);
+
+		// walk the bottom-up rows in reverse through a negative stride
+		src_planes[0] = &frame.rgba[size_t(frame.height - 1) * frame.width * 4];
+		src_strides[0] = -frame.width * 4;
+	}
+
+	~bench_swscale_ctx() {
+		sws_freeContext(ctx);
+	}
+
+	void convert(bench_frame& frame) {
+		sws_scale(ctx, src_planes, src_strides, 0, frame.height, frame.picture.data, frame.picture.linesize);
+	}
+
+public:
+	SwsContext* ctx = nullptr;
+
+	uint8_t* src_planes[4] = {nullptr, nullptr, nullptr, nullptr};
+	int src_strides[4] = {0, 0, 0, 0};
+};
+
+
+// compares the converter's output with the swscale output it replaces; the
+// two round and site chroma differently, so the frame is smooth and only
+// large average deviations (a wrong matrix, range, flip or plane order)
+// count as a mismatch
+static bool check_swscale(int width, int height) {
+	bench_frame frame(width, height, true);
+	bench_swscale_ctx sws(frame);
+
+	if (sws.ctx == nullptr) {
+		fprintf(stderr, "[%s] could not initialize image-conversion context\n", __func__);
+		return false;
+	}
+
+	yuv_converter converter(width, height, 1, 0.299f, 0.114f, false);
+
+	frame.convert(&converter);
+
+	const std::vector<uint8_t> expected = frame.yuv;
+
+	sws.convert(frame);
+
+	// luma plane, then both chroma planes
+	const size_t luma_size = size_t(width) * height;
+	const size_t ranges[2][2] = {{0, luma_size}, {luma_size, expected.size()}};
+	const char* range_names[2] = {"luma", "chroma"};
+
+	bool ret = true;
+
+	for (int i = 0; i < 2; i++) {
+		uint64_t sum = 0;
+		int max_diff = 0;
+
+		for (size_t j = ranges[i][0]; j < ranges[i][1]; j++) {
+			const int diff = std::abs(int(expected[j]) - int(frame.yuv[j]));
+
+			sum += diff;
+			max_diff = std::max(max_diff, diff);
+		}
+
+		const double mean_diff = double(sum) / std::max(ranges[i][1] - ranges[i][0], size_t(1));
+
+		printf("[%s] %dx%d %-6s vs swscale: mean difference %.3f, max %d\n", __func__, width, height, range_names[i], mean_diff, max_diff);
+
+		if (mean_diff > 1.0) {
+			fprintf(stderr, "[%s] %dx%d: %s deviates from swscale\n", __func__, width, height, range_names[i]);
+			ret = false;
+		}
+	}
+
+	return ret;
+}
+
+
+static void bench_kernels(int width, int height, int iterations, int num_threads) {
+	bench_frame frame(width, height);
+	yuv_converter converter(width, height, num_threads, 0.299f, 0.114f, false);
+
+	for (const char* name: kernel_names) {
+		if (!converter.set_kernel(name)) {
+			printf("[%s] %-8s not supported\n", __func__, name);
+			continue;
+		}
+
+		// the first pass faults in the destination
+		frame.convert(&converter);
+
+		const double t0 = get_time();
+
+		for (int i = 0; i < iterations; i++)
+			converter.convert(frame.rgba.data(), frame.picture.data, frame.picture.linesize);
+
+		printf("[%s] %dx%d %-8s %.3fms per frame\n", __func__, width, height, name, (get_time() - t0) * 1000.0 / iterations);
+	}
+}
+
+static void bench_swscale(int width, int height, int iterations) {
+	bench_frame frame(width, height);
+	bench_swscale_ctx sws(frame);
+
+	if (sws.ctx == nullptr)
+		return;
+
+	sws.convert(frame);
+
+	const double t0 = get_time();
+
+	for (int i = 0; i < iterations; i++)
+		sws.convert(frame);
+
+	printf("[%s] %dx%d %-8s %.3fms per frame\n", __func__, width, height, "swscale", (get_time() - t0) * 1000.0 / iterations);
+}
+
+
+
+int main(int argc, char** argv) {
+	const int iterations = (argc > 1)? std::max(atoi(argv[1]), 1): 100;
+	const int num_threads = (argc > 2)? std::max(atoi(argv[2]), 1): 1;
+
+	// 720p, 1080p, 1440p and 2160p unless a size is given
+	std::vector<std::pair<int, int>> bench_sizes = {{1280, 720}, {1920, 1080}, {2560, 1440}, {3840, 2160}};
+
+	if (argc > 4)
+		bench_sizes.assign(1, std::make_pair(std::max(atoi(argv[3]), 1), std::max(atoi(argv[4]), 1)));
+
+	// odd sizes that exercise every tail path
+	std::vector<std::pair<int, int>> check_sizes = {{1, 1}, {2, 2}, {3, 3}, {15, 7}, {17, 9}, {33, 5}, {63, 31}, {65, 33}, {1283, 721}};
+
+	check_sizes.insert(check_sizes.end(), bench_sizes.begin(), bench_sizes.end());
+
+	bool ret = true;
+
+	for (const std::pair<int, int>& size: check_sizes)
+		ret = check_kernels(size.first, size.second, num_threads) && ret;
+
+	for (const std::pair<int, int>& size: bench_sizes)
+		ret = check_swscale(size.first, size.second) && ret;
+
+	printf("[%s] %d iterations, %d thread(s)\n", __func__, iterations, num_threads);
+
+	for (const std::pair<int, int>& size: bench_sizes) {
+		bench_kernels(size.first, size.second, iterations, num_threads);
+		bench_swscale(size.first, size.second, iterations);
+	}
+
+	return (ret? 0: 1);
+}
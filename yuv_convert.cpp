@@ -0,0 +1,505 @@
+#include <immintrin.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+#include "yuv_convert.hpp"
+
+
+static inline uint8_t clamp_u8(int32_t v) { return std::max(0, std::min(v, 255)); }
+
+static inline uint8_t rgb_to_luma(const uint8_t* p, const yuv_coeffs& c) {
+	return clamp_u8((c.y[0] * p[0] + c.y[1] * p[1] + c.y[2] * p[2] + c.y_ofs) >> 8);
+}
+
+
+// handles [x, width) of a row pair; also the tail of every vectorized kernel
+static void convert_row_pair_tail(
+	const uint8_t* src0,
+	const uint8_t* src1,
+	uint8_t* dst_y0,
+	uint8_t* dst_y1,
+	uint8_t* dst_u,
+	uint8_t* dst_v,
+	int x,
+	int width,
+	const yuv_coeffs& c
+) {
+	for (; x < width; x += 2) {
+		// odd widths average the last pixel with itself
+		const int x1 = std::min(x + 1, width - 1);
+
+		const uint8_t* p00 = &src0[x  * 4];
+		const uint8_t* p01 = &src0[x1 * 4];
+		const uint8_t* p10 = &src1[x  * 4];
+		const uint8_t* p11 = &src1[x1 * 4];
+
+		dst_y0[x ] = rgb_to_luma(p00, c);
+		dst_y0[x1] = rgb_to_luma(p01, c);
+		dst_y1[x ] = rgb_to_luma(p10, c);
+		dst_y1[x1] = rgb_to_luma(p11, c);
+
+		// rounded vertical average first, same as pavgb in the SIMD kernels
+		const int r = ((p00[0] + p10[0] + 1) >> 1) + ((p01[0] + p11[0] + 1) >> 1);
+		const int g = ((p00[1] + p10[1] + 1) >> 1) + ((p01[1] + p11[1] + 1) >> 1);
+		const int b = ((p00[2] + p10[2] + 1) >> 1) + ((p01[2] + p11[2] + 1) >> 1);
+
+		dst_u[x >> 1] = clamp_u8((c.u[0] * r + c.u[1] * g + c.u[2] * b + c.c_ofs) >> 9);
+		dst_v[x >> 1] = clamp_u8((c.v[0] * r + c.v[1] * g + c.v[2] * b + c.c_ofs) >> 9);
+	}
+}
+
+static void convert_row_pair_scalar(
+	const uint8_t* src0,
+	const uint8_t* src1,
+	uint8_t* dst_y0,
+	uint8_t* dst_y1,
+	uint8_t* dst_u,
+	uint8_t* dst_v,
+	int width,
+	const yuv_coeffs& c
+) {
+	convert_row_pair_tail(src0, src1, dst_y0, dst_y1, dst_u, dst_v, 0, width, c);
+}
+
+
+
+// every kernel computes a per-pixel dot-product as madd([R,B], [cr,cb]) +
+// madd([G,A], [cg,0]) on 32-bit lanes, which keeps pixels in order; chroma
+// is taken on the vertically averaged row and summed over pixel pairs
+__attribute__((target("sse4.1")))
+static inline __m128i dot_rgba_sse41(__m128i px, __m128i rb_coeffs, __m128i ga_coeffs) {
+	const __m128i rb = _mm_and_si128(px, _mm_set1_epi32(0x00FF00FF));
+	const __m128i ga = _mm_srli_epi16(px, 8);
+
+	return (_mm_add_epi32(_mm_madd_epi16(rb, rb_coeffs), _mm_madd_epi16(ga, ga_coeffs)));
+}
+
+__attribute__((target("sse4.1")))
+static void convert_row_pair_sse41(
+	const uint8_t* src0,
+	const uint8_t* src1,
+	uint8_t* dst_y0,
+	uint8_t* dst_y1,
+	uint8_t* dst_u,
+	uint8_t* dst_v,
+	int width,
+	const yuv_coeffs& c
+) {
+	const __m128i y_rb = _mm_set1_epi32((c.y[2] << 16) | uint16_t(c.y[0]));
+	const __m128i u_rb = _mm_set1_epi32((c.u[2] << 16) | uint16_t(c.u[0]));
+	const __m128i v_rb = _mm_set1_epi32((c.v[2] << 16) | uint16_t(c.v[0]));
+	const __m128i y_ga = _mm_set1_epi32(uint16_t(c.y[1]));
+	const __m128i u_ga = _mm_set1_epi32(uint16_t(c.u[1]));
+	const __m128i v_ga = _mm_set1_epi32(uint16_t(c.v[1]));
+	const __m128i y_ofs = _mm_set1_epi32(c.y_ofs);
+	const __m128i c_ofs = _mm_set1_epi32(c.c_ofs);
+
+	int x = 0;
+
+	for (; (x + 16) <= width; x += 16) {
+		__m128i row0[4];
+		__m128i row1[4];
+		__m128i ysum[4];
+		__m128i usum[4];
+		__m128i vsum[4];
+
+		for (int k = 0; k < 4; k++) {
+			row0[k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&src0[(x + k * 4) * 4]));
+			row1[k] = _mm_loadu_si128(reinterpret_cast<const __m128i*>(&src1[(x + k * 4) * 4]));
+		}
+
+		for (int k = 0; k < 4; k++) {
+			ysum[k] = _mm_srli_epi32(_mm_add_epi32(dot_rgba_sse41(row0[k], y_rb, y_ga), y_ofs), 8);
+		}
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(&dst_y0[x]), _mm_packus_epi16(_mm_packs_epi32(ysum[0], ysum[1]), _mm_packs_epi32(ysum[2], ysum[3])));
+
+		for (int k = 0; k < 4; k++) {
+			ysum[k] = _mm_srli_epi32(_mm_add_epi32(dot_rgba_sse41(row1[k], y_rb, y_ga), y_ofs), 8);
+		}
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(&dst_y1[x]), _mm_packus_epi16(_mm_packs_epi32(ysum[0], ysum[1]), _mm_packs_epi32(ysum[2], ysum[3])));
+
+		for (int k = 0; k < 4; k++) {
+			const __m128i avg = _mm_avg_epu8(row0[k], row1[k]);
+
+			usum[k] = dot_rgba_sse41(avg, u_rb, u_ga);
+			vsum[k] = dot_rgba_sse41(avg, v_rb, v_ga);
+		}
+
+		{
+			const __m128i u0 = _mm_srli_epi32(_mm_add_epi32(_mm_hadd_epi32(usum[0], usum[1]), c_ofs), 9);
+			const __m128i u1 = _mm_srli_epi32(_mm_add_epi32(_mm_hadd_epi32(usum[2], usum[3]), c_ofs), 9);
+			const __m128i v0 = _mm_srli_epi32(_mm_add_epi32(_mm_hadd_epi32(vsum[0], vsum[1]), c_ofs), 9);
+			const __m128i v1 = _mm_srli_epi32(_mm_add_epi32(_mm_hadd_epi32(vsum[2], vsum[3]), c_ofs), 9);
+
+			// low half holds the eight U samples, high half the eight V samples
+			const __m128i uv = _mm_packus_epi16(_mm_packs_epi32(u0, u1), _mm_packs_epi32(v0, v1));
+
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(&dst_u[x >> 1]), uv);
+			_mm_storel_epi64(reinterpret_cast<__m128i*>(&dst_v[x >> 1]), _mm_unpackhi_epi64(uv, uv));
+		}
+	}
+
+	convert_row_pair_tail(src0, src1, dst_y0, dst_y1, dst_u, dst_v, x, width, c);
+}
+
+
+
+__attribute__((target("avx2")))
+static inline __m256i dot_rgba_avx2(__m256i px, __m256i rb_coeffs, __m256i ga_coeffs) {
+	const __m256i rb = _mm256_and_si256(px, _mm256_set1_epi32(0x00FF00FF));
+	const __m256i ga = _mm256_srli_epi16(px, 8);
+
+	return (_mm256_add_epi32(_mm256_madd_epi16(rb, rb_coeffs), _mm256_madd_epi16(ga, ga_coeffs)));
+}
+
+__attribute__((target("avx2")))
+static void convert_row_pair_avx2(
+	const uint8_t* src0,
+	const uint8_t* src1,
+	uint8_t* dst_y0,
+	uint8_t* dst_y1,
+	uint8_t* dst_u,
+	uint8_t* dst_v,
+	int width,
+	const yuv_coeffs& c
+) {
+	const __m256i y_rb = _mm256_set1_epi32((c.y[2] << 16) | uint16_t(c.y[0]));
+	const __m256i u_rb = _mm256_set1_epi32((c.u[2] << 16) | uint16_t(c.u[0]));
+	const __m256i v_rb = _mm256_set1_epi32((c.v[2] << 16) | uint16_t(c.v[0]));
+	const __m256i y_ga = _mm256_set1_epi32(uint16_t(c.y[1]));
+	const __m256i u_ga = _mm256_set1_epi32(uint16_t(c.u[1]));
+	const __m256i v_ga = _mm256_set1_epi32(uint16_t(c.v[1]));
+	const __m256i y_ofs = _mm256_set1_epi32(c.y_ofs);
+	const __m256i c_ofs = _mm256_set1_epi32(c.c_ofs);
+
+	// packs/packus interleave the two 128-bit lanes, this undoes it
+	const __m256i lane_order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+	int x = 0;
+
+	for (; (x + 32) <= width; x += 32) {
+		__m256i row0[4];
+		__m256i row1[4];
+		__m256i ysum[4];
+		__m256i usum[4];
+		__m256i vsum[4];
+
+		for (int k = 0; k < 4; k++) {
+			row0[k] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&src0[(x + k * 8) * 4]));
+			row1[k] = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(&src1[(x + k * 8) * 4]));
+		}
+
+		for (int k = 0; k < 4; k++) {
+			ysum[k] = _mm256_srli_epi32(_mm256_add_epi32(dot_rgba_avx2(row0[k], y_rb, y_ga), y_ofs), 8);
+		}
+
+		{
+			const __m256i y8 = _mm256_packus_epi16(_mm256_packs_epi32(ysum[0], ysum[1]), _mm256_packs_epi32(ysum[2], ysum[3]));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(&dst_y0[x]), _mm256_permutevar8x32_epi32(y8, lane_order));
+		}
+
+		for (int k = 0; k < 4; k++) {
+			ysum[k] = _mm256_srli_epi32(_mm256_add_epi32(dot_rgba_avx2(row1[k], y_rb, y_ga), y_ofs), 8);
+		}
+
+		{
+			const __m256i y8 = _mm256_packus_epi16(_mm256_packs_epi32(ysum[0], ysum[1]), _mm256_packs_epi32(ysum[2], ysum[3]));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(&dst_y1[x]), _mm256_permutevar8x32_epi32(y8, lane_order));
+		}
+
+		for (int k = 0; k < 4; k++) {
+			const __m256i avg = _mm256_avg_epu8(row0[k], row1[k]);
+
+			usum[k] = dot_rgba_avx2(avg, u_rb, u_ga);
+			vsum[k] = dot_rgba_avx2(avg, v_rb, v_ga);
+		}
+
+		{
+			// in-lane hadd leaves pair-sums in qword order 0,2,1,3
+			const __m256i u0 = _mm256_srli_epi32(_mm256_add_epi32(_mm256_permute4x64_epi64(_mm256_hadd_epi32(usum[0], usum[1]), 0xD8), c_ofs), 9);
+			const __m256i u1 = _mm256_srli_epi32(_mm256_add_epi32(_mm256_permute4x64_epi64(_mm256_hadd_epi32(usum[2], usum[3]), 0xD8), c_ofs), 9);
+			const __m256i v0 = _mm256_srli_epi32(_mm256_add_epi32(_mm256_permute4x64_epi64(_mm256_hadd_epi32(vsum[0], vsum[1]), 0xD8), c_ofs), 9);
+			const __m256i v1 = _mm256_srli_epi32(_mm256_add_epi32(_mm256_permute4x64_epi64(_mm256_hadd_epi32(vsum[2], vsum[3]), 0xD8), c_ofs), 9);
+
+			// lower 128 bits hold the sixteen U samples, upper 128 the sixteen V samples
+			const __m256i uv = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(_mm256_packs_epi32(u0, u1), _mm256_packs_epi32(v0, v1)), lane_order);
+
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(&dst_u[x >> 1]), _mm256_castsi256_si128(uv));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(&dst_v[x >> 1]), _mm256_extracti128_si256(uv, 1));
+		}
+	}
+
+	convert_row_pair_tail(src0, src1, dst_y0, dst_y1, dst_u, dst_v, x, width, c);
+}
+
+
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i dot_rgba_avx512(__m512i px, __m512i rb_coeffs, __m512i ga_coeffs) {
+	const __m512i rb = _mm512_and_si512(px, _mm512_set1_epi32(0x00FF00FF));
+	const __m512i ga = _mm512_srli_epi16(px, 8);
+
+	return (_mm512_add_epi32(_mm512_madd_epi16(rb, rb_coeffs), _mm512_madd_epi16(ga, ga_coeffs)));
+}
+
+// sums each even/odd pair of 32-bit lanes and compacts the sixteen results in order
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i pair_sum_avx512(__m512i a, __m512i b) {
+	// the even lanes of a and b, a's first
+	const __m512i even_lanes = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+
+	const __m512i sa = _mm512_add_epi32(a, _mm512_bsrli_epi128(a, 4));
+	const __m512i sb = _mm512_add_epi32(b, _mm512_bsrli_epi128(b, 4));
+
+	return (_mm512_permutex2var_epi32(sa, even_lanes, sb));
+}
+
+// the zero-masking (maskz) forms compute the same as the plain ones, but gcc's
+// plain forms start from an undefined vector and warn about it at -O2
+__attribute__((target("avx512f,avx512bw")))
+static void convert_row_pair_avx512(
+	const uint8_t* src0,
+	const uint8_t* src1,
+	uint8_t* dst_y0,
+	uint8_t* dst_y1,
+	uint8_t* dst_u,
+	uint8_t* dst_v,
+	int width,
+	const yuv_coeffs& c
+) {
+	const __m512i y_rb = _mm512_set1_epi32((c.y[2] << 16) | uint16_t(c.y[0]));
+	const __m512i u_rb = _mm512_set1_epi32((c.u[2] << 16) | uint16_t(c.u[0]));
+	const __m512i v_rb = _mm512_set1_epi32((c.v[2] << 16) | uint16_t(c.v[0]));
+	const __m512i y_ga = _mm512_set1_epi32(uint16_t(c.y[1]));
+	const __m512i u_ga = _mm512_set1_epi32(uint16_t(c.u[1]));
+	const __m512i v_ga = _mm512_set1_epi32(uint16_t(c.v[1]));
+	const __m512i y_ofs = _mm512_set1_epi32(c.y_ofs);
+	const __m512i c_ofs = _mm512_set1_epi32(c.c_ofs);
+
+	int x = 0;
+
+	for (; (x + 32) <= width; x += 32) {
+		__m512i row0[2];
+		__m512i row1[2];
+		__m512i usum[2];
+		__m512i vsum[2];
+
+		for (int k = 0; k < 2; k++) {
+			row0[k] = _mm512_loadu_si512(&src0[(x + k * 16) * 4]);
+			row1[k] = _mm512_loadu_si512(&src1[(x + k * 16) * 4]);
+
+			// vpmovusdb narrows sixteen lanes in order, no fix-up needed
+			const __m512i y0 = _mm512_maskz_srli_epi32(0xFFFF, _mm512_add_epi32(dot_rgba_avx512(row0[k], y_rb, y_ga), y_ofs), 8);
+			const __m512i y1 = _mm512_maskz_srli_epi32(0xFFFF, _mm512_add_epi32(dot_rgba_avx512(row1[k], y_rb, y_ga), y_ofs), 8);
+
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(&dst_y0[x + k * 16]), _mm512_maskz_cvtusepi32_epi8(0xFFFF, y0));
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(&dst_y1[x + k * 16]), _mm512_maskz_cvtusepi32_epi8(0xFFFF, y1));
+
+			const __m512i avg = _mm512_avg_epu8(row0[k], row1[k]);
+
+			usum[k] = dot_rgba_avx512(avg, u_rb, u_ga);
+			vsum[k] = dot_rgba_avx512(avg, v_rb, v_ga);
+		}
+
+		const __m512i u = _mm512_maskz_srli_epi32(0xFFFF, _mm512_add_epi32(pair_sum_avx512(usum[0], usum[1]), c_ofs), 9);
+		const __m512i v = _mm512_maskz_srli_epi32(0xFFFF, _mm512_add_epi32(pair_sum_avx512(vsum[0], vsum[1]), c_ofs), 9);
+
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(&dst_u[x >> 1]), _mm512_maskz_cvtusepi32_epi8(0xFFFF, u));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(&dst_v[x >> 1]), _mm512_maskz_cvtusepi32_epi8(0xFFFF, v));
+	}
+
+	convert_row_pair_tail(src0, src1, dst_y0, dst_y1, dst_u, dst_v, x, width, c);
+}
+
+
+
+
+static void* worker_thread_proc(void* converter) {
+	reinterpret_cast<yuv_converter*>(converter)->worker_thread_func();
+	return nullptr;
+}
+
+
+yuv_converter::yuv_converter(int width, int height, int num_threads, float kr, float kb, bool full_range) {
+	frame_width = width;
+	frame_height = height;
+
+	{
+		const float kg = 1.0f - kr - kb;
+		const float ys = full_range? 1.0f: (219.0f / 255.0f);
+		const float cs = full_range? 1.0f: (224.0f / 255.0f);
+		const float us = cs / (2.0f * (1.0f - kb));
+		const float vs = cs / (2.0f * (1.0f - kr));
+
+		coeffs.y[0] = std::lround(256.0f * ys * kr);
+		coeffs.y[1] = std::lround(256.0f * ys * kg);
+		coeffs.y[2] = std::lround(256.0f * ys * kb);
+		coeffs.u[0] = std::lround(256.0f * us * -kr);
+		coeffs.u[1] = std::lround(256.0f * us * -kg);
+		coeffs.u[2] = std::lround(256.0f * us * (1.0f - kb));
+		coeffs.v[0] = std::lround(256.0f * vs * (1.0f - kr));
+		coeffs.v[1] = std::lround(256.0f * vs * -kg);
+		coeffs.v[2] = std::lround(256.0f * vs * -kb);
+
+		// luma is (dot + ofs) >> 8, chroma sums two averaged pixels so (dot + ofs) >> 9
+		coeffs.y_ofs = (1 << 7) + (full_range? 0: (16 << 8));
+		coeffs.c_ofs = (1 << 8) + (128 << 9);
+	}
+
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx512bw")) {
+		kernel = convert_row_pair_avx512;
+		kernel_name = "avx512";
+	} else if (__builtin_cpu_supports("avx2")) {
+		kernel = convert_row_pair_avx2;
+		kernel_name = "avx2";
+	} else if (__builtin_cpu_supports("sse4.1")) {
+		kernel = convert_row_pair_sse41;
+		kernel_name = "sse4.1";
+	} else {
+		kernel = convert_row_pair_scalar;
+		kernel_name = "scalar";
+	}
+
+	// a couple of bands per thread evens out scheduling noise
+	num_bands = std::max(1, num_threads) * 2;
+
+	pthread_mutex_init(&work_mutex, nullptr);
+	pthread_cond_init(&work_cond, nullptr);
+	pthread_cond_init(&done_cond, nullptr);
+
+	workers.resize(std::max(0, num_threads - 1));
+
+	for (pthread_t& worker: workers) {
+		pthread_create(&worker, nullptr, worker_thread_proc, this);
+	}
+
+	printf("[%s] %dx%d, %s kernel, %d thread(s)\n", __func__, width, height, kernel_name, num_threads);
+}
+
+yuv_converter::~yuv_converter() {
+	pthread_mutex_lock(&work_mutex);
+	keep_running = false;
+	pthread_cond_broadcast(&work_cond);
+	pthread_mutex_unlock(&work_mutex);
+
+	for (pthread_t& worker: workers) {
+		pthread_join(worker, nullptr);
+	}
+
+	pthread_cond_destroy(&done_cond);
+	pthread_cond_destroy(&work_cond);
+	pthread_mutex_destroy(&work_mutex);
+}
+
+
+
+bool yuv_converter::set_kernel(const char* name) {
+	__builtin_cpu_init();
+
+	if (strcmp(name, "avx512") == 0 && __builtin_cpu_supports("avx512bw")) {
+		kernel = convert_row_pair_avx512;
+		kernel_name = "avx512";
+	} else if (strcmp(name, "avx2") == 0 && __builtin_cpu_supports("avx2")) {
+		kernel = convert_row_pair_avx2;
+		kernel_name = "avx2";
+	} else if (strcmp(name, "sse4.1") == 0 && __builtin_cpu_supports("sse4.1")) {
+		kernel = convert_row_pair_sse41;
+		kernel_name = "sse4.1";
+	} else if (strcmp(name, "scalar") == 0) {
+		kernel = convert_row_pair_scalar;
+		kernel_name = "scalar";
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+
+
+void yuv_converter::convert_rows(const yuv_convert_job& job, unsigned int band) {
+	const int num_pairs = (frame_height + 1) / 2;
+	const int pair_min = (num_pairs * (band    )) / num_bands;
+	const int pair_max = (num_pairs * (band + 1)) / num_bands;
+
+	for (int pair = pair_min; pair < pair_max; pair++) {
+		const int y0 = pair * 2;
+		// odd heights pair the last row with itself
+		const int y1 = std::min(y0 + 1, frame_height - 1);
+
+		// source rows are bottom-up
+		const uint8_t* src0 = &job.src[(frame_height - 1 - y0) * frame_width * 4];
+		const uint8_t* src1 = &job.src[(frame_height - 1 - y1) * frame_width * 4];
+
+		uint8_t* dst_y0 = &job.dst_planes[0][y0   * job.dst_strides[0]];
+		uint8_t* dst_y1 = &job.dst_planes[0][y1   * job.dst_strides[0]];
+		uint8_t* dst_u  = &job.dst_planes[1][pair * job.dst_strides[1]];
+		uint8_t* dst_v  = &job.dst_planes[2][pair * job.dst_strides[2]];
+
+		kernel(src0, src1, dst_y0, dst_y1, dst_u, dst_v, frame_width, coeffs);
+	}
+}
+
+void yuv_converter::convert_bands(unsigned int job_id) {
+	while (job_counter == job_id && next_band < num_bands) {
+		const yuv_convert_job band_job = job;
+		const unsigned int band = next_band++;
+
+		pthread_mutex_unlock(&work_mutex);
+		convert_rows(band_job, band);
+		pthread_mutex_lock(&work_mutex);
+
+		if (++bands_done == num_bands)
+			pthread_cond_signal(&done_cond);
+	}
+}
+
+void yuv_converter::convert(const uint8_t* src, uint8_t* const planes[3], const int strides[3]) {
+	pthread_mutex_lock(&work_mutex);
+
+	job.src = src;
+
+	for (int i = 0; i < 3; i++) {
+		job.dst_planes[i] = planes[i];
+		job.dst_strides[i] = strides[i];
+	}
+
+	next_band = 0;
+	bands_done = 0;
+	job_counter += 1;
+
+	pthread_cond_broadcast(&work_cond);
+
+	convert_bands(job_counter);
+
+	while (bands_done < num_bands)
+		pthread_cond_wait(&done_cond, &work_mutex);
+
+	pthread_mutex_unlock(&work_mutex);
+}
+
+void yuv_converter::worker_thread_func() {
+	unsigned int last_job = 0;
+
+	pthread_mutex_lock(&work_mutex);
+
+	while (true) {
+		while (keep_running && job_counter == last_job)
+			pthread_cond_wait(&work_cond, &work_mutex);
+
+		if (!keep_running)
+			break;
+
+		last_job = job_counter;
+		convert_bands(last_job);
+	}
+
+	pthread_mutex_unlock(&work_mutex);
+}
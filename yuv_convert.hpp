@@ -0,0 +1,90 @@
+#ifndef YUV_CONVERT_HDR
+#define YUV_CONVERT_HDR
+
+#include <pthread.h>
+
+#include <cstdint>
+#include <vector>
+
+
+// fixed-point (x256) conversion coefficients; offsets include the rounding term
+struct yuv_coeffs {
+	int16_t y[3];
+	int16_t u[3];
+	int16_t v[3];
+
+	int32_t y_ofs;
+	int32_t c_ofs;
+};
+
+// one frame to convert; published to the workers under the mutex
+struct yuv_convert_job {
+	const uint8_t* src = nullptr;
+	uint8_t* dst_planes[3] = {nullptr, nullptr, nullptr};
+	int dst_strides[3] = {0, 0, 0};
+};
+
+typedef void (*yuv_row_pair_kernel)(
+	const uint8_t* src0,
+	const uint8_t* src1,
+	uint8_t* dst_y0,
+	uint8_t* dst_y1,
+	uint8_t* dst_u,
+	uint8_t* dst_v,
+	int width,
+	const yuv_coeffs& coeffs
+);
+
+
+// converts bottom-up RGBA frames (as read back from GL) into top-down
+// planar YUV420 in a single pass; each worker handles a band of row
+// pairs, the calling thread takes the first band itself
+class yuv_converter {
+public:
+	yuv_converter(int width, int height, int num_threads, float kr, float kb, bool full_range);
+	~yuv_converter();
+
+	void convert(const uint8_t* src, uint8_t* const dst_planes[3], const int dst_strides[3]);
+	void worker_thread_func();
+
+	const char* get_kernel_name() const { return kernel_name; }
+	// replaces the dispatched kernel by <name> (scalar, sse4.1, avx2 or
+	// avx512); false if the CPU does not support it. for yuv_bench
+	bool set_kernel(const char* name);
+
+private:
+	void convert_rows(const yuv_convert_job& job, unsigned int band);
+	// converts unclaimed bands of the current job; called and returns with work_mutex held
+	void convert_bands(unsigned int job_id);
+
+private:
+	std::vector<pthread_t> workers;
+
+	pthread_mutex_t work_mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+
+	yuv_coeffs coeffs;
+	yuv_row_pair_kernel kernel = nullptr;
+
+	const char* kernel_name = "";
+
+	int frame_width = 0;
+	int frame_height = 0;
+
+	unsigned int num_bands = 1;
+
+	// current job and its progress (under work_mutex); bands are claimed
+	// under the mutex as well, so a worker that wakes up late can never
+	// take a band of a job it did not read
+	yuv_convert_job job;
+
+	unsigned int job_counter = 0;
+	unsigned int next_band = 0;
+	unsigned int bands_done = 0;
+
+	bool keep_running = true;
+};
+
+#endif
+